@@ -0,0 +1,390 @@
+/*
+  Micro-benchmarks for the libraspigpio access paths and the raspi-gpio
+  formatters, run against an in-memory register image so that they need
+  no hardware and measure only the software cost.
+
+  Each benchmark is timed in samples of a fixed number of operations; the
+  per-operation latency of every sample gives the p50/p99/max figures and
+  the total gives the throughput. Results are printed one per line, tab
+  separated, so that runs from different commits can be compared with
+  join(1) or a spreadsheet.
+
+  Use: raspi-gpio-bench [-c bcm2835|bcm2711] [-n samples] [-d pud_delay_ns] [name...]
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "raspigpio.h"
+#include "raspigpio-priv.h"
+#include "raspi-gpio-print.h"
+
+#define BENCH_SAMPLES 2000
+#define BENCH_WARMUP  50
+
+struct bench_ctx
+{
+    struct gpio_chip *chip;
+    struct gpio_snapshot snap;
+    uint32_t all[GPIO_MAX_BANKS];
+    uint32_t none[GPIO_MAX_BANKS];
+    unsigned int pin;             /* Changes every sample */
+    FILE *null;
+};
+
+struct bench
+{
+    const char *name;
+    void (*fn)(struct bench_ctx *ctx);
+    unsigned int ops;             /* Operations per timed sample */
+};
+
+static volatile int sink;
+
+static void bench_get_level(struct bench_ctx *ctx)
+{
+    sink = gpio_get_level(ctx->chip, ctx->pin);
+}
+
+/* The same read inlined, with no bounds check */
+static void bench_get_level_inline(struct bench_ctx *ctx)
+{
+    sink = gpio_pin_level(ctx->chip, ctx->pin);
+}
+
+static void bench_get_fsel(struct bench_ctx *ctx)
+{
+    sink = gpio_get_fsel(ctx->chip, ctx->pin);
+}
+
+static void bench_get_pull(struct bench_ctx *ctx)
+{
+    sink = gpio_get_pull(ctx->chip, ctx->pin);
+}
+
+static void bench_set_level(struct bench_ctx *ctx)
+{
+    gpio_set_level(ctx->chip, ctx->pin, 1);
+}
+
+static void bench_set_fsel(struct bench_ctx *ctx)
+{
+    gpio_set_fsel(ctx->chip, ctx->pin, FUNC_OP);
+}
+
+static void bench_set_pull(struct bench_ctx *ctx)
+{
+    gpio_set_pull(ctx->chip, ctx->pin, PULL_UP);
+}
+
+static void bench_read_levels(struct bench_ctx *ctx)
+{
+    uint32_t levels[GPIO_MAX_BANKS];
+
+    gpio_read_levels(ctx->chip, levels);
+    sink = levels[0] ^ levels[1];
+}
+
+static void bench_write_levels(struct bench_ctx *ctx)
+{
+    gpio_write_levels(ctx->chip, ctx->all, ctx->all);
+}
+
+static void bench_snapshot(struct bench_ctx *ctx)
+{
+    gpio_snapshot_take(ctx->chip, &ctx->snap);
+}
+
+static void bench_snapshot_all(struct bench_ctx *ctx)
+{
+    gpio_snapshot_take_all(ctx->chip, &ctx->snap);
+}
+
+static void bench_set_mask_fsel(struct bench_ctx *ctx)
+{
+    gpio_set_mask(ctx->chip, ctx->all, FUNC_OP, DRIVE_UNSET, PULL_UNSET);
+}
+
+static void bench_set_mask_pull(struct bench_ctx *ctx)
+{
+    gpio_set_mask(ctx->chip, ctx->all, FUNC_UNSET, DRIVE_UNSET, PULL_UP);
+}
+
+static void bench_format_get(struct bench_ctx *ctx)
+{
+    gpio_get(ctx->null, &ctx->snap, ctx->pin);
+}
+
+static void bench_format_get_all(struct bench_ctx *ctx)
+{
+    print_gpio_state(ctx->null, &ctx->snap, ctx->none);
+}
+
+static void bench_format_raw(struct bench_ctx *ctx)
+{
+    print_raw_gpio_regs(ctx->null, &ctx->snap);
+}
+
+static void bench_format_get_json(struct bench_ctx *ctx)
+{
+    format_gpio_state(ctx->null, FORMAT_JSON, &ctx->snap, ctx->none);
+}
+
+static void bench_format_get_bin(struct bench_ctx *ctx)
+{
+    format_gpio_state(ctx->null, FORMAT_BIN, &ctx->snap, ctx->none);
+}
+
+static void bench_format_raw_json(struct bench_ctx *ctx)
+{
+    format_raw_regs(ctx->null, FORMAT_JSON, &ctx->snap);
+}
+
+static void bench_parse_pin(struct bench_ctx *ctx)
+{
+    uint32_t mask[GPIO_MAX_BANKS] = { 0 };
+
+    sink = gpio_parse_pins(ctx->chip, "20", mask) != NULL;
+}
+
+static void bench_parse_list(struct bench_ctx *ctx)
+{
+    uint32_t mask[GPIO_MAX_BANKS] = { 0 };
+
+    sink = gpio_parse_pins(ctx->chip, "2,3,7-11,18-21,40,45-53", mask) != NULL;
+}
+
+/* The row-by-row scan of the alt names that find_alt replaces */
+static void bench_find_alt_scan(struct bench_ctx *ctx)
+{
+    unsigned int count = gpio_chip_gpio_count(ctx->chip);
+    unsigned int gpio;
+    int alt, n = 0;
+
+    for (gpio = 0; gpio < count; gpio++)
+    {
+        for (alt = 0; alt < gpio_chip_alt_count(ctx->chip); alt++)
+        {
+            const char *name = gpio_alt_name(ctx->chip, gpio, alt);
+            n += name && strcasecmp(name, "SPI0_MOSI") == 0;
+        }
+    }
+    sink = n;
+}
+
+static void bench_find_alt(struct bench_ctx *ctx)
+{
+    struct gpio_alt_ref refs[8];
+
+    sink = gpio_find_alt(ctx->chip, "SPI0_MOSI", 0, refs, 8);
+}
+
+static void bench_parse_name(struct bench_ctx *ctx)
+{
+    uint32_t mask[GPIO_MAX_BANKS] = { 0 };
+
+    sink = gpio_parse_pins(ctx->chip, "SPI0_MOSI,SPI0_MISO,SPI0_SCLK", mask) != NULL;
+}
+
+static const struct bench benches[] =
+{
+    { "get_level",        bench_get_level,        256 },
+    { "get_level_inline", bench_get_level_inline, 256 },
+    { "get_fsel",         bench_get_fsel,         256 },
+    { "get_pull",         bench_get_pull,         256 },
+    { "set_level",        bench_set_level,        256 },
+    { "set_fsel",         bench_set_fsel,         256 },
+    { "set_pull",         bench_set_pull,         16 },
+    { "read_levels",      bench_read_levels,      256 },
+    { "write_levels",     bench_write_levels,     256 },
+    { "snapshot",         bench_snapshot,         64 },
+    { "snapshot_all",     bench_snapshot_all,     64 },
+    { "set_mask_fsel",    bench_set_mask_fsel,    16 },
+    { "set_mask_pull",    bench_set_mask_pull,    16 },
+    { "format_get",       bench_format_get,       64 },
+    { "format_get_all",   bench_format_get_all,   4 },
+    { "format_raw",       bench_format_raw,       4 },
+    { "format_get_json",  bench_format_get_json,  4 },
+    { "format_get_bin",   bench_format_get_bin,   4 },
+    { "format_raw_json",  bench_format_raw_json,  4 },
+    { "parse_pin",        bench_parse_pin,        256 },
+    { "parse_list",       bench_parse_list,       64 },
+    { "find_alt_scan",    bench_find_alt_scan,    4 },
+    { "find_alt",         bench_find_alt,         64 },
+    { "parse_name",       bench_parse_name,       64 },
+};
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int bench_run(struct bench_ctx *ctx, const struct bench *b, unsigned int samples)
+{
+    double *ns = malloc(samples * sizeof(*ns));
+    uint64_t total = 0;
+    unsigned int s, i;
+
+    if (!ns)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    for (s = 0; s < BENCH_WARMUP + samples; s++)
+    {
+        uint64_t start, end;
+
+        ctx->pin = (s * 7) % ctx->chip->gpio_count;
+        start = bench_now_ns();
+        for (i = 0; i < b->ops; i++)
+            b->fn(ctx);
+        end = bench_now_ns();
+
+        if (s >= BENCH_WARMUP)
+        {
+            ns[s - BENCH_WARMUP] = (double)(end - start) / b->ops;
+            total += end - start;
+        }
+    }
+
+    qsort(ns, samples, sizeof(*ns), bench_cmp);
+    printf("%s\t%s\t%.1f\t%.1f\t%.1f\t%.0f\n", b->name, ctx->chip->name,
+           ns[samples / 2], ns[(samples * 99) / 100], ns[samples - 1],
+           total ? (double)samples * b->ops * 1e9 / total : 0.0);
+    free(ns);
+    return 0;
+}
+
+static int bench_chip(const char *name, unsigned int samples, unsigned long pud_delay,
+                      int nfilters, char *filters[])
+{
+    struct bench_ctx ctx;
+    uint32_t seed = 0x2835;
+    unsigned int i;
+    int ret = 0;
+    int f;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.chip = gpio_chip_new(name);
+    if (!ctx.chip)
+    {
+        printf("%s\n", gpio_last_error());
+        return 1;
+    }
+    ctx.chip->base = calloc(1, ctx.chip->reg_size);
+    if (!ctx.chip->base)
+    {
+        printf("Out of memory\n");
+        gpio_close(ctx.chip);
+        return 1;
+    }
+    gpio_chip_set_pud_delay(ctx.chip, pud_delay);
+
+    /* A fixed pseudo-random register state, so that the formatters see a
+       mix of functions, levels and pulls */
+    for (i = 0; i < ctx.chip->reg_size / 4; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        ctx.chip->base[i] = seed;
+    }
+    gpio_snapshot_take_all(ctx.chip, &ctx.snap);
+
+    gpio_mask_add_range(ctx.all, 0, ctx.chip->gpio_count - 1);
+
+    ctx.null = fopen("/dev/null", "w");
+    if (!ctx.null)
+    {
+        printf("Can't open /dev/null\n");
+        free((void *)ctx.chip->base);
+        ctx.chip->base = NULL;
+        gpio_close(ctx.chip);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        for (f = 0; f < nfilters; f++)
+        {
+            if (strstr(benches[i].name, filters[f]))
+                break;
+        }
+        if (nfilters && f == nfilters)
+            continue;
+        if ((ret = bench_run(&ctx, &benches[i], samples)) != 0)
+            break;
+        fflush(stdout);
+    }
+
+    fclose(ctx.null);
+    free((void *)ctx.chip->base);
+    ctx.chip->base = NULL;
+    gpio_close(ctx.chip);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *chips[] = { "bcm2835", "bcm2711" };
+    const char *only = NULL;
+    unsigned int samples = BENCH_SAMPLES;
+    unsigned long pud_delay = 0;
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            only = optarg;
+            break;
+        case 'n':
+            samples = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            pud_delay = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            printf("Use: %s [-c bcm2835|bcm2711] [-n samples] [-d pud_delay_ns] [name...]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+
+    if (samples < 1)
+        samples = 1;
+
+    /* The bcm2835 pull sequence spins for the setup/hold time, which would
+       swamp the software cost, so it is zero unless asked for */
+    printf("# samples=%u pud_delay_ns=%lu\n", samples, pud_delay);
+    printf("# bench\tchip\tp50_ns\tp99_ns\tmax_ns\tops_per_s\n");
+
+    for (i = 0; i < sizeof(chips) / sizeof(chips[0]); i++)
+    {
+        if (only && strcmp(only, chips[i]) != 0)
+            continue;
+        if (bench_chip(chips[i], samples, pud_delay, argc - optind, argv + optind))
+            return 1;
+    }
+
+    return 0;
+}
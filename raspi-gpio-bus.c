@@ -0,0 +1,896 @@
+/*
+  Bit-banged buses on any pins: SPI master (modes 0-3), I2C master, and
+  UART transmit and receive (8N1).
+
+  Each SPI or UART edge is one GPSET and one GPCLR write covering the
+  clock and the data out together, from masks worked out before the
+  transfer starts, and input is sampled straight from GPLEV. Edges are
+  timed against absolute deadlines, as in play, so that the bit rate
+  cannot drift; at a rate of 0 they go out as fast as the writes allow.
+  I2C's open-drain lines are pulled low by switching the pin to an output
+  with its latch cleared, and released by switching it back to an input,
+  waiting for devices that stretch the clock.
+
+  Parallel buses of up to 32 data pins, in any order, are written from a
+  lookup table per byte of the word giving the GPSET and GPCLR masks for
+  each of its values, worked out once; a word then costs a lookup per byte
+  and one write per bank, however its pins are scattered. Reads are a
+  GPLEV read and, for pins in ascending order, a shift and a mask.
+
+  The payload is read from a file or stdin and whatever comes back is
+  written to stdout, so errors and the throughput report go to stderr.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "raspigpio.h"
+#include "raspi-gpio-clock.h"
+#include "raspi-gpio-bus.h"
+
+#define BUS_SPIN_NS    100000      /* Spin, rather than sleep, this close to a deadline */
+#define BUS_MAX_INPUT  (16 << 20)
+#define BUS_STRETCH_NS 10000000    /* Longest an I2C device may hold SCL low */
+#define BUS_CHECK      1024        /* UART receive polls between clock/stop checks */
+#define BUS_MAX_PINS   4
+#define BUS_MAX_WIDTH  32          /* Data pins of a parallel bus */
+
+enum bus_type
+{
+    BUS_SPI,
+    BUS_I2C,
+    BUS_UART_TX,
+    BUS_UART_RX,
+};
+
+/* One write of the output latches */
+struct bus_edge
+{
+    uint32_t set[GPIO_MAX_BANKS];
+    uint32_t clr[GPIO_MAX_BANKS];
+};
+
+/* A parallel bus, with the writes for each value of each byte of a word */
+struct bus_stream
+{
+    unsigned int pins[BUS_MAX_WIDTH];   /* Bit 0 of the word first */
+    int width;
+    int bytes;                          /* Per word in the data, little-endian */
+    int strobe;                         /* GPIO, or -1 for none */
+    struct bus_edge lut[BUS_MAX_WIDTH / 8][256];
+};
+
+struct bus
+{
+    struct gpio_chip *chip;
+    const volatile uint32_t *lev;
+    double period_ns;           /* Between edges, 0 for as fast as possible */
+    uint64_t start;
+    uint64_t edges;             /* Deadlines passed */
+    uint64_t late_sum;          /* How far past them the edges went */
+    uint64_t late_max;
+};
+
+static volatile sig_atomic_t bus_stop;
+
+static void bus_signal(int sig)
+{
+    bus_stop = 1;
+}
+
+/* Waits for the next edge's deadline, noting how late it is reached */
+static void bus_wait(struct bus *b)
+{
+    uint64_t deadline, now;
+
+    if (b->period_ns == 0)
+        return;
+    deadline = b->start + (uint64_t)(++b->edges * b->period_ns);
+    now = clock_wait_until(deadline, BUS_SPIN_NS);
+    b->late_sum += now - deadline;
+    if (now - deadline > b->late_max)
+        b->late_max = now - deadline;
+}
+
+static inline int bus_read(const struct bus *b, unsigned int gpio)
+{
+    return (b->lev[gpio / 32] >> (gpio % 32)) & 1;
+}
+
+static inline void bus_write(const struct bus *b, const struct bus_edge *e)
+{
+    gpio_write_levels(b->chip, e->set, e->clr);
+}
+
+static void bus_edge_pin(struct bus_edge *e, unsigned int gpio, int level)
+{
+    if (level)
+        gpio_mask_add(e->set, gpio);
+    else
+        gpio_mask_add(e->clr, gpio);
+}
+
+/*
+  Parses "<gpio>,<gpio>..." into pins, in order, returning how many or -1.
+  A range "<from>-<to>" may run either way.
+*/
+static int bus_parse_pins(struct gpio_chip *chip, const char *list, unsigned int *pins, int max)
+{
+    const char *p = list;
+    int count = 0;
+
+    while (1)
+    {
+        char *end;
+        unsigned long from = strtoul(p, &end, 10);
+        unsigned long to = from;
+
+        if (end != p && *end == '-')
+        {
+            p = end + 1;
+            to = strtoul(p, &end, 10);
+        }
+        if (end == p || from >= gpio_chip_gpio_count(chip) ||
+            to >= gpio_chip_gpio_count(chip) || (*end && *end != ','))
+            return -1;
+
+        while (1)
+        {
+            if (count == max)
+                return -1;
+            pins[count++] = from;
+            if (from == to)
+                break;
+            from += from < to ? 1 : -1;
+        }
+        if (!*end)
+            return count;
+        p = end + 1;
+    }
+}
+
+/* Reads the whole of path (or stdin for NULL or "-") */
+static uint8_t *bus_load(const char *path, size_t *len)
+{
+    FILE *in = stdin;
+    uint8_t *buf = malloc(BUS_MAX_INPUT);
+
+    if (!buf)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+    if (path && strcmp(path, "-") != 0 && (in = fopen(path, "rb")) == NULL)
+    {
+        fprintf(stderr, "Can't open '%s'\n", path);
+        free(buf);
+        return NULL;
+    }
+
+    *len = fread(buf, 1, BUS_MAX_INPUT, in);
+    if (!feof(in))
+        fprintf(stderr, "Only the first %d bytes of input are sent\n", BUS_MAX_INPUT);
+    if (in != stdin)
+        fclose(in);
+    return buf;
+}
+
+/*
+  Full duplex, MSB first, with CS (if given) low throughout. Each bit is
+  two half periods: in the first the clock goes to its leading edge with
+  CPHA 1 (or stays idle with CPHA 0) and the data bit is set in the same
+  writes; MISO is sampled just before the second, which makes the other
+  edge.
+*/
+static int bus_spi(struct bus *b, const unsigned int *pins, int npins, int mode,
+                   const uint8_t *out, size_t len, uint8_t *in)
+{
+    unsigned int sclk = pins[0], mosi = pins[1], miso = pins[2];
+    int cpol = mode >> 1, cpha = mode & 1;
+    struct bus_edge first[2], second, idle, cs;
+    size_t i;
+    int d;
+
+    memset(first, 0, sizeof(first));
+    memset(&second, 0, sizeof(second));
+    memset(&idle, 0, sizeof(idle));
+    memset(&cs, 0, sizeof(cs));
+    for (d = 0; d < 2; d++)
+    {
+        bus_edge_pin(&first[d], sclk, cpha ? !cpol : cpol);
+        bus_edge_pin(&first[d], mosi, d);
+    }
+    bus_edge_pin(&second, sclk, cpha ? cpol : !cpol);
+    bus_edge_pin(&idle, sclk, cpol);
+    if (npins > 3)
+    {
+        bus_edge_pin(&idle, pins[3], 1);
+        bus_edge_pin(&cs, pins[3], 0);
+    }
+
+    /* Latch the idle levels before the pins become outputs */
+    bus_write(b, &idle);
+    gpio_set_fsel(b->chip, sclk, FUNC_OP);
+    gpio_set_fsel(b->chip, mosi, FUNC_OP);
+    gpio_set_fsel(b->chip, miso, FUNC_IP);
+    if (npins > 3)
+        gpio_set_fsel(b->chip, pins[3], FUNC_OP);
+
+    b->start = clock_ns(CLOCK_MONOTONIC);
+    bus_write(b, &cs);
+    bus_wait(b);
+
+    for (i = 0; i < len && !bus_stop; i++)
+    {
+        unsigned int byte = out[i];
+        unsigned int got = 0;
+        int bit;
+
+        for (bit = 7; bit >= 0; bit--)
+        {
+            bus_write(b, &first[(byte >> bit) & 1]);
+            bus_wait(b);
+            got = (got << 1) | bus_read(b, miso);
+            bus_write(b, &second);
+            bus_wait(b);
+        }
+        in[i] = got;
+    }
+
+    bus_write(b, &idle);
+    return i;
+}
+
+/* Pulls an open-drain I2C line low, or releases it */
+static void i2c_line(struct bus *b, unsigned int gpio, int level)
+{
+    gpio_set_fsel(b->chip, gpio, level ? FUNC_IP : FUNC_OP);
+}
+
+/* Releases SCL and waits out any clock stretching */
+static int i2c_scl_high(struct bus *b, unsigned int scl)
+{
+    uint64_t limit = clock_ns(CLOCK_MONOTONIC) + BUS_STRETCH_NS;
+
+    i2c_line(b, scl, 1);
+    while (!bus_read(b, scl))
+    {
+        if (clock_ns(CLOCK_MONOTONIC) > limit)
+        {
+            fprintf(stderr, "SCL held low\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Writes a bit, or reads one with bit 1, returning SDA in the high half */
+static int i2c_bit(struct bus *b, unsigned int scl, unsigned int sda, int bit)
+{
+    int got;
+
+    i2c_line(b, sda, bit);
+    bus_wait(b);
+    if (i2c_scl_high(b, scl))
+        return -1;
+    bus_wait(b);
+    got = bus_read(b, sda);
+    i2c_line(b, scl, 0);
+    return got;
+}
+
+/* Writes a byte, returning 0 if it was acknowledged */
+static int i2c_write_byte(struct bus *b, unsigned int scl, unsigned int sda, unsigned int byte)
+{
+    int bit;
+
+    for (bit = 7; bit >= 0; bit--)
+    {
+        if (i2c_bit(b, scl, sda, (byte >> bit) & 1) < 0)
+            return -1;
+    }
+    return i2c_bit(b, scl, sda, 1) != 0;
+}
+
+static int i2c_read_byte(struct bus *b, unsigned int scl, unsigned int sda, int ack)
+{
+    unsigned int byte = 0;
+    int bit, got;
+
+    for (bit = 0; bit < 8; bit++)
+    {
+        if ((got = i2c_bit(b, scl, sda, 1)) < 0)
+            return -1;
+        byte = (byte << 1) | got;
+    }
+    if (i2c_bit(b, scl, sda, !ack) < 0)
+        return -1;
+    return byte;
+}
+
+/* A start, or a repeated start with SCL low */
+static int i2c_start(struct bus *b, unsigned int scl, unsigned int sda)
+{
+    i2c_line(b, sda, 1);
+    bus_wait(b);
+    if (i2c_scl_high(b, scl))
+        return -1;
+    bus_wait(b);
+    i2c_line(b, sda, 0);
+    bus_wait(b);
+    i2c_line(b, scl, 0);
+    return 0;
+}
+
+static void i2c_stop(struct bus *b, unsigned int scl, unsigned int sda)
+{
+    i2c_line(b, sda, 0);
+    bus_wait(b);
+    i2c_scl_high(b, scl);
+    bus_wait(b);
+    i2c_line(b, sda, 1);
+    bus_wait(b);
+}
+
+/*
+  Writes out to device addr, then reads count bytes into in, with a
+  repeated start between. Returns the bytes moved or -1, leaving count
+  at the bytes actually read.
+*/
+static int bus_i2c(struct bus *b, const unsigned int *pins, unsigned int addr,
+                   const uint8_t *out, size_t len, uint8_t *in, size_t *count)
+{
+    unsigned int scl = pins[0], sda = pins[1];
+    struct bus_edge low;
+    size_t sent = 0, got = 0;
+    int ret = -1;
+
+    /* Both lines idle released, with the in-pad pull-ups helping */
+    memset(&low, 0, sizeof(low));
+    bus_edge_pin(&low, scl, 0);
+    bus_edge_pin(&low, sda, 0);
+    bus_write(b, &low);
+    gpio_set_pull(b->chip, scl, PULL_UP);
+    gpio_set_pull(b->chip, sda, PULL_UP);
+    i2c_line(b, scl, 1);
+    i2c_line(b, sda, 1);
+    if (!bus_read(b, scl) || !bus_read(b, sda))
+    {
+        fprintf(stderr, "I2C bus busy (SCL or SDA low)\n");
+        *count = 0;
+        return -1;
+    }
+
+    b->start = clock_ns(CLOCK_MONOTONIC);
+    if (len)
+    {
+        if (i2c_start(b, scl, sda) || i2c_write_byte(b, scl, sda, addr << 1))
+        {
+            fprintf(stderr, "No ACK from 0x%02x\n", addr);
+            goto stop;
+        }
+        for (sent = 0; sent < len && !bus_stop; sent++)
+        {
+            if (i2c_write_byte(b, scl, sda, out[sent]))
+            {
+                fprintf(stderr, "No ACK for byte %zu\n", sent);
+                goto stop;
+            }
+        }
+    }
+    if (*count && !bus_stop)
+    {
+        if (i2c_start(b, scl, sda) || i2c_write_byte(b, scl, sda, (addr << 1) | 1))
+        {
+            fprintf(stderr, "No ACK from 0x%02x\n", addr);
+            goto stop;
+        }
+        for (got = 0; got < *count && !bus_stop; got++)
+        {
+            int byte = i2c_read_byte(b, scl, sda, got + 1 < *count);
+
+            if (byte < 0)
+                goto stop;
+            in[got] = byte;
+        }
+    }
+    ret = sent + got;
+
+stop:
+    i2c_stop(b, scl, sda);
+    *count = got;
+    return ret;
+}
+
+/* Start bit, eight data bits LSB first and a stop bit, one write apiece */
+static int bus_uart_tx(struct bus *b, unsigned int tx, const uint8_t *out, size_t len)
+{
+    struct bus_edge level[2];
+    size_t i;
+
+    memset(level, 0, sizeof(level));
+    bus_edge_pin(&level[0], tx, 0);
+    bus_edge_pin(&level[1], tx, 1);
+    bus_write(b, &level[1]);
+    gpio_set_fsel(b->chip, tx, FUNC_OP);
+
+    b->start = clock_ns(CLOCK_MONOTONIC);
+    for (i = 0; i < len && !bus_stop; i++)
+    {
+        unsigned int frame = 0x200 | (out[i] << 1);
+        int bit;
+
+        for (bit = 0; bit < 10; bit++)
+        {
+            bus_write(b, &level[(frame >> bit) & 1]);
+            bus_wait(b);
+        }
+    }
+
+    return i;
+}
+
+/*
+  Receives for the given time (or until interrupted), timing each byte
+  from the falling edge of its start bit and sampling mid-bit.
+*/
+static int bus_uart_rx(struct bus *b, unsigned int rx, double seconds, uint8_t *in,
+                       uint64_t *framing)
+{
+    uint64_t end;
+    size_t count = 0;
+    int i;
+
+    gpio_set_fsel(b->chip, rx, FUNC_IP);
+    gpio_set_pull(b->chip, rx, PULL_UP);
+
+    b->start = clock_ns(CLOCK_MONOTONIC);
+    end = b->start + seconds * 1e9;
+    while (!bus_stop && count < BUS_MAX_INPUT)
+    {
+        uint64_t edge;
+        unsigned int byte = 0;
+        int bit;
+
+        for (i = 0; i < BUS_CHECK && bus_read(b, rx); i++)
+            ;
+        edge = clock_ns(CLOCK_MONOTONIC);
+        if (edge >= end)
+            break;
+        if (i == BUS_CHECK)
+            continue;
+
+        /* Sample mid-bit, from the middle of the start bit onwards */
+        for (bit = 0; bit < 10; bit++)
+        {
+            uint64_t deadline = edge + (uint64_t)((bit + 0.5) * b->period_ns);
+            uint64_t now = clock_wait_until(deadline, BUS_SPIN_NS);
+
+            b->edges++;
+            b->late_sum += now - deadline;
+            if (now - deadline > b->late_max)
+                b->late_max = now - deadline;
+            byte |= bus_read(b, rx) << bit;
+        }
+
+        if ((byte & 1) || !(byte & 0x200))
+            (*framing)++;
+        else
+            in[count++] = byte >> 1;
+
+        /* A framing error may leave the line low; wait for it to go idle */
+        while (!bus_read(b, rx) && !bus_stop && clock_ns(CLOCK_MONOTONIC) < end)
+            ;
+    }
+
+    return count;
+}
+
+static void bus_usage(void)
+{
+    fprintf(stderr, "Use: bus spi <SCLK>,<MOSI>,<MISO>[,<CS>] [-m 0-3] [-f Hz] [file|-]\n");
+    fprintf(stderr, "  or bus i2c <SCL>,<SDA> -a <addr> [-r count] [-f Hz] [file|-]\n");
+    fprintf(stderr, "  or bus uart-tx <TX> [-f baud] [file|-]\n");
+    fprintf(stderr, "  or bus uart-rx <RX> [-f baud] [-t seconds]\n");
+}
+
+/* argv[0] is "bus" */
+int run_bus(struct gpio_chip *chip, int argc, char *argv[])
+{
+    static const char *names[] = { "spi", "i2c", "uart-tx", "uart-rx" };
+    static const int min_pins[] = { 3, 2, 1, 1 };
+    static const int max_pins[] = { 4, 2, 1, 1 };
+    static const double default_hz[] = { 1e6, 1e5, 115200, 115200 };
+    unsigned int pins[BUS_MAX_PINS];
+    const char *file = NULL;
+    uint8_t *out = NULL, *in = NULL;
+    size_t len = 0, count = 0;
+    uint64_t framing = 0;
+    double seconds = 1;
+    double hz = -1;
+    long addr = -1;
+    int mode = 0;
+    int npins;
+    int moved;
+    int type;
+    uint64_t ns;
+    struct bus b;
+
+    if (argc < 3)
+    {
+        bus_usage();
+        return 1;
+    }
+    for (type = BUS_SPI; type <= BUS_UART_RX; type++)
+    {
+        if (strcmp(argv[1], names[type]) == 0)
+            break;
+    }
+    npins = type <= BUS_UART_RX ? bus_parse_pins(chip, argv[2], pins, BUS_MAX_PINS) : -1;
+    if (npins < 0 || npins < min_pins[type] || npins > max_pins[type])
+    {
+        bus_usage();
+        return 1;
+    }
+
+    for (argv += 3, argc -= 3; argc; argv++, argc--)
+    {
+        char *end = NULL;
+
+        if (argc > 1 && strcmp(*argv, "-f") == 0)
+            hz = strtod(*++argv, &end);
+        else if (argc > 1 && strcmp(*argv, "-m") == 0 && type == BUS_SPI)
+            mode = strtol(*++argv, &end, 0);
+        else if (argc > 1 && strcmp(*argv, "-a") == 0 && type == BUS_I2C)
+            addr = strtol(*++argv, &end, 0);
+        else if (argc > 1 && strcmp(*argv, "-r") == 0 && type == BUS_I2C)
+            count = strtoul(*++argv, &end, 0);
+        else if (argc > 1 && strcmp(*argv, "-t") == 0 && type == BUS_UART_RX)
+            seconds = strtod(*++argv, &end);
+        else if (argc == 1 && type != BUS_UART_RX && (**argv != '-' || !argv[0][1]))
+        {
+            file = *argv;
+            continue;
+        }
+        else
+        {
+            bus_usage();
+            return 1;
+        }
+        argc--;
+        if (*end)
+        {
+            fprintf(stderr, "Bad value \"%s\"\n", *argv);
+            return 1;
+        }
+    }
+
+    if (mode < 0 || mode > 3 || hz < -1 || seconds <= 0 || count > BUS_MAX_INPUT ||
+        (type == BUS_I2C && (addr < 0 || addr > 0x7f)) ||
+        (type >= BUS_UART_TX && hz == 0))
+    {
+        fprintf(stderr, "Bad %s settings\n", names[type]);
+        return 1;
+    }
+
+    /* An I2C read alone needs no input */
+    if (type != BUS_UART_RX && (type != BUS_I2C || file || !count))
+    {
+        if ((out = bus_load(file, &len)) == NULL)
+            return 1;
+    }
+    in = malloc(type == BUS_SPI ? len + 1 : type == BUS_I2C ? count + 1 : BUS_MAX_INPUT);
+    if (!in)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(out);
+        return 1;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.chip = chip;
+    b.lev = gpio_level_regs(chip);
+    if (hz < 0)
+        hz = default_hz[type];
+    if (hz > 0)
+        b.period_ns = 1e9 / hz / (type >= BUS_UART_TX ? 1 : 2);
+
+    signal(SIGINT, bus_signal);
+    signal(SIGTERM, bus_signal);
+
+    switch (type)
+    {
+    case BUS_SPI:
+        moved = bus_spi(&b, pins, npins, mode, out, len, in);
+        fwrite(in, 1, moved, stdout);
+        break;
+    case BUS_I2C:
+        moved = bus_i2c(&b, pins, addr, out, len, in, &count);
+        if (moved >= 0)
+            fwrite(in, 1, count, stdout);
+        break;
+    case BUS_UART_TX:
+        moved = bus_uart_tx(&b, pins[0], out, len);
+        break;
+    default:
+        moved = bus_uart_rx(&b, pins[0], seconds, in, &framing);
+        fwrite(in, 1, moved, stdout);
+        break;
+    }
+    fflush(stdout);
+    ns = clock_ns(CLOCK_MONOTONIC) - b.start;
+
+    if (moved >= 0)
+    {
+        fprintf(stderr, "%s: %d bytes in %.6f s (%.3f Mbit/s)", names[type], moved, ns / 1e9,
+                ns ? moved * 8e3 / ns : 0.0);
+        if (b.edges)
+            fprintf(stderr, ", timing error mean %.0f ns max %llu ns",
+                    (double)b.late_sum / b.edges, (unsigned long long)b.late_max);
+        if (framing)
+            fprintf(stderr, ", %llu framing errors", (unsigned long long)framing);
+        fprintf(stderr, "\n");
+    }
+
+    free(out);
+    free(in);
+    return moved < 0;
+}
+
+/* Sets the edges for every value of byte lane of a word */
+static void stream_lane(struct bus_stream *s, int lane)
+{
+    unsigned int value;
+    int bit;
+
+    for (value = 0; value < 256; value++)
+    {
+        struct bus_edge *e = &s->lut[lane][value];
+
+        for (bit = 0; bit < 8 && lane * 8 + bit < s->width; bit++)
+            bus_edge_pin(e, s->pins[lane * 8 + bit], (value >> bit) & 1);
+        if (lane == 0 && s->strobe >= 0)
+            bus_edge_pin(e, s->strobe, 0);
+    }
+}
+
+/*
+  Writes each word with its data pins and the strobe low together, then
+  raises the strobe, so the data is latched on the rising edge.
+*/
+static size_t stream_write(struct bus *b, const struct bus_stream *s, const uint8_t *data,
+                           size_t words)
+{
+    struct bus_edge strobe;
+    size_t i;
+    int bank;
+    int lane;
+
+    memset(&strobe, 0, sizeof(strobe));
+    if (s->strobe >= 0)
+        bus_edge_pin(&strobe, s->strobe, 1);
+
+    b->start = clock_ns(CLOCK_MONOTONIC);
+    if (s->bytes == 1)
+    {
+        /* One lookup per word */
+        for (i = 0; i < words && !bus_stop; i++)
+        {
+            bus_write(b, &s->lut[0][data[i]]);
+            if (s->strobe >= 0)
+                bus_write(b, &strobe);
+            bus_wait(b);
+        }
+        return i;
+    }
+
+    for (i = 0; i < words && !bus_stop; i++)
+    {
+        const uint8_t *word = data + i * s->bytes;
+        struct bus_edge e = s->lut[0][word[0]];
+
+        for (lane = 1; lane < s->bytes; lane++)
+        {
+            for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+            {
+                e.set[bank] |= s->lut[lane][word[lane]].set[bank];
+                e.clr[bank] |= s->lut[lane][word[lane]].clr[bank];
+            }
+        }
+        bus_write(b, &e);
+        if (s->strobe >= 0)
+            bus_write(b, &strobe);
+        bus_wait(b);
+    }
+    return i;
+}
+
+/*
+  Samples each word just after raising the strobe, lowering it again
+  afterwards. Pins in ascending order in one bank come out with a single
+  shift and mask; any others are gathered a pin at a time.
+*/
+static size_t stream_read(struct bus *b, const struct bus_stream *s, uint8_t *data, size_t words)
+{
+    struct bus_edge high, low;
+    unsigned int bank = s->pins[0] / 32, shift = s->pins[0] % 32;
+    uint32_t mask = s->width < 32 ? (1u << s->width) - 1 : ~0u;
+    int contiguous = shift + s->width <= 32;
+    size_t i;
+    int pin;
+
+    for (pin = 1; pin < s->width; pin++)
+        contiguous &= s->pins[pin] == s->pins[0] + pin;
+
+    memset(&high, 0, sizeof(high));
+    memset(&low, 0, sizeof(low));
+    if (s->strobe >= 0)
+    {
+        bus_edge_pin(&high, s->strobe, 1);
+        bus_edge_pin(&low, s->strobe, 0);
+    }
+
+    b->start = clock_ns(CLOCK_MONOTONIC);
+    for (i = 0; i < words && !bus_stop; i++)
+    {
+        uint32_t word = 0;
+        int byte;
+
+        if (s->strobe >= 0)
+            bus_write(b, &high);
+        if (contiguous)
+        {
+            word = (b->lev[bank] >> shift) & mask;
+        }
+        else
+        {
+            for (pin = 0; pin < s->width; pin++)
+                word |= (uint32_t)bus_read(b, s->pins[pin]) << pin;
+        }
+        if (s->strobe >= 0)
+            bus_write(b, &low);
+
+        for (byte = 0; byte < s->bytes; byte++)
+            data[i * s->bytes + byte] = word >> (byte * 8);
+        bus_wait(b);
+    }
+    return i;
+}
+
+static void stream_usage(void)
+{
+    fprintf(stderr, "Use: bus-write <GPIOs> [-s <strobe>] [-f words/s] [file|-]\n");
+    fprintf(stderr, "  or bus-read <GPIOs> -n <words> [-s <strobe>] [-f words/s]\n");
+}
+
+/* argv[0] is "bus-write" or "bus-read" */
+int run_bus_stream(struct gpio_chip *chip, int argc, char *argv[])
+{
+    static struct bus_stream s;
+    int writing = strcmp(argv[0], "bus-write") == 0;
+    const char *file = NULL;
+    uint8_t *data;
+    size_t len = 0, words = 0, moved;
+    double hz = 0;
+    long strobe = -1;
+    uint64_t ns;
+    struct bus b;
+    int pin;
+
+    memset(&s, 0, sizeof(s));
+    if (argc < 2 || (s.width = bus_parse_pins(chip, argv[1], s.pins, BUS_MAX_WIDTH)) < 0)
+    {
+        stream_usage();
+        return 1;
+    }
+    s.bytes = (s.width + 7) / 8;
+
+    for (argv += 2, argc -= 2; argc; argv++, argc--)
+    {
+        char *end = NULL;
+
+        if (argc > 1 && strcmp(*argv, "-f") == 0)
+            hz = strtod(*++argv, &end);
+        else if (argc > 1 && strcmp(*argv, "-s") == 0)
+        {
+            /* Negative is as out of range as past the last GPIO, not "no strobe" */
+            if ((strobe = strtol(*++argv, &end, 10)) < 0)
+                strobe = gpio_chip_gpio_count(chip);
+        }
+        else if (argc > 1 && strcmp(*argv, "-n") == 0 && !writing)
+            words = strtoul(*++argv, &end, 0);
+        else if (argc == 1 && writing && (**argv != '-' || !argv[0][1]))
+        {
+            file = *argv;
+            continue;
+        }
+        else
+        {
+            stream_usage();
+            return 1;
+        }
+        argc--;
+        if (*end)
+        {
+            fprintf(stderr, "Bad value \"%s\"\n", *argv);
+            return 1;
+        }
+    }
+
+    if (hz < 0 || strobe >= (long)gpio_chip_gpio_count(chip) ||
+        (!writing && (words == 0 || words > (size_t)(BUS_MAX_INPUT / s.bytes))))
+    {
+        fprintf(stderr, "Bad %s settings\n", writing ? "bus-write" : "bus-read");
+        return 1;
+    }
+    for (pin = 0; pin < s.width; pin++)
+    {
+        if (s.pins[pin] == strobe)
+        {
+            fprintf(stderr, "The strobe can't also be a data pin\n");
+            return 1;
+        }
+    }
+    s.strobe = strobe;
+
+    if (writing)
+    {
+        if ((data = bus_load(file, &len)) == NULL)
+            return 1;
+        words = len / s.bytes;
+        if (len % s.bytes)
+            fprintf(stderr, "Ignoring the last %zu bytes, not a whole word\n", len % s.bytes);
+        for (pin = 0; pin < s.bytes; pin++)
+            stream_lane(&s, pin);
+    }
+    else if ((data = malloc(words * s.bytes)) == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.chip = chip;
+    b.lev = gpio_level_regs(chip);
+    if (hz > 0)
+        b.period_ns = 1e9 / hz;
+
+    /* The strobe starts low, and the data pins are made outputs or inputs */
+    if (s.strobe >= 0)
+    {
+        gpio_set_level(chip, s.strobe, 0);
+        gpio_set_fsel(chip, s.strobe, FUNC_OP);
+    }
+    for (pin = 0; pin < s.width; pin++)
+        gpio_set_fsel(chip, s.pins[pin], writing ? FUNC_OP : FUNC_IP);
+
+    signal(SIGINT, bus_signal);
+    signal(SIGTERM, bus_signal);
+
+    if (writing)
+    {
+        moved = stream_write(&b, &s, data, words);
+    }
+    else
+    {
+        moved = stream_read(&b, &s, data, words);
+        fwrite(data, s.bytes, moved, stdout);
+        fflush(stdout);
+    }
+    ns = clock_ns(CLOCK_MONOTONIC) - b.start;
+
+    fprintf(stderr, "%s: %zu %d-bit words (%zu bytes) in %.6f s (%.3f MB/s)",
+            writing ? "bus-write" : "bus-read", moved, s.width, moved * s.bytes, ns / 1e9,
+            ns ? moved * s.bytes * 1e3 / ns : 0.0);
+    if (b.edges)
+        fprintf(stderr, ", timing error mean %.0f ns max %llu ns",
+                (double)b.late_sum / b.edges, (unsigned long long)b.late_max);
+    fprintf(stderr, "\n");
+
+    free(data);
+    return 0;
+}
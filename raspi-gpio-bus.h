@@ -0,0 +1,13 @@
+/*
+  raspi-gpio bit-banged SPI, I2C and UART, and parallel buses.
+*/
+
+#ifndef RASPI_GPIO_BUS_H
+#define RASPI_GPIO_BUS_H
+
+#include "raspigpio.h"
+
+int run_bus(struct gpio_chip *chip, int argc, char *argv[]);
+int run_bus_stream(struct gpio_chip *chip, int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+  Logic-analyser capture of GPLEV0/1, and conversion of captures to VCD.
+
+  The sampling thread busy-polls the level registers and only takes a
+  timestamp when a selected pin changes. Changes pass through a
+  single-producer single-consumer ring to a writer thread, so the sampler
+  never blocks on file I/O; if the ring fills, changes are dropped until
+  it has room again, and each such stall is counted as an overrun.
+
+  Capture file layout (host byte order):
+    struct capture_header
+    records, one per change:
+      varint  nanoseconds since the previous record (or the start)
+      varint  XOR of the new and previous levels, for each bank in the mask
+  Varints are LEB128: 7 bits per byte, least significant first, top bit
+  set on all but the last byte.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "raspigpio.h"
+#include "raspi-gpio-clock.h"
+#include "raspi-gpio-capture.h"
+
+#define CAPTURE_MAGIC      "RGPIOCAP"
+#define CAPTURE_VERSION    1
+#define CAPTURE_RING_SIZE  (1 << 16)   /* Changes; must be a power of 2 */
+#define CAPTURE_CHECK      1024        /* Samples between clock/stop checks */
+#define CAPTURE_IDLE_NS    50000       /* Writer sleep when the ring is empty */
+
+struct capture_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t gpio_count;
+    uint32_t mask[GPIO_MAX_BANKS];
+    uint32_t initial[GPIO_MAX_BANKS];  /* Levels at the start, masked */
+    uint64_t start_time_ns;            /* CLOCK_REALTIME at the start */
+    uint64_t duration_ns;
+    uint64_t samples;
+    uint64_t changes;                  /* Records in the file */
+    uint64_t overruns;                 /* Times changes were dropped with the ring full */
+};
+
+struct capture_event
+{
+    uint64_t ns;                       /* Since the start */
+    uint32_t levels[GPIO_MAX_BANKS];
+};
+
+struct capture_ring
+{
+    struct capture_event ev[CAPTURE_RING_SIZE];
+    unsigned int head;                 /* Written by the sampler only */
+    unsigned int tail;                 /* Written by the writer only */
+    int done;
+};
+
+struct capture_writer
+{
+    struct capture_ring *ring;
+    struct capture_header *hdr;
+    FILE *out;
+    int error;
+};
+
+static volatile sig_atomic_t capture_stop;
+
+static void capture_signal(int sig)
+{
+    capture_stop = 1;
+}
+
+static unsigned char *capture_put_varint(unsigned char *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static int capture_get_varint(FILE *in, uint64_t *v)
+{
+    int shift = 0;
+    int c;
+
+    *v = 0;
+    while ((c = getc(in)) != EOF)
+    {
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 0;
+        shift += 7;
+        if (shift >= 64)
+            break;
+    }
+    return -1;
+}
+
+static void *capture_writer_thread(void *arg)
+{
+    struct capture_writer *w = arg;
+    struct capture_ring *ring = w->ring;
+    uint32_t prev[GPIO_MAX_BANKS];
+    uint64_t prev_ns = 0;
+    unsigned int tail = ring->tail;
+    int bank;
+
+    memcpy(prev, w->hdr->initial, sizeof(prev));
+
+    while (1)
+    {
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (tail == head)
+        {
+            struct timespec idle = { 0, CAPTURE_IDLE_NS };
+
+            if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) &&
+                tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+                break;
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        while (tail != head)
+        {
+            const struct capture_event *ev = &ring->ev[tail & (CAPTURE_RING_SIZE - 1)];
+            unsigned char rec[10 * (1 + GPIO_MAX_BANKS)];
+            unsigned char *p = capture_put_varint(rec, ev->ns - prev_ns);
+
+            for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+            {
+                if (w->hdr->mask[bank])
+                    p = capture_put_varint(p, ev->levels[bank] ^ prev[bank]);
+                prev[bank] = ev->levels[bank];
+            }
+            prev_ns = ev->ns;
+            tail++;
+
+            if (fwrite(rec, p - rec, 1, w->out) != 1)
+                w->error = errno;
+            w->hdr->changes++;
+        }
+
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/*
+  The sampling loop, written so that the compiler specialises it for the
+  banks actually in use: a capture of bank 0 pins only reads GPLEV0.
+*/
+static inline void capture_poll(struct capture_ring *ring, struct capture_header *hdr,
+                                const volatile uint32_t *lev, uint64_t start, uint64_t end,
+                                int bank0, int bank1)
+{
+    uint32_t mask0 = hdr->mask[0], mask1 = hdr->mask[1];
+    uint32_t prev0 = hdr->initial[0], prev1 = hdr->initial[1];
+    unsigned int head = ring->head;
+    uint64_t samples = 0;
+    uint64_t now = start;
+    int stalled = 0;
+    int i;
+
+    while (!capture_stop && now < end)
+    {
+        for (i = 0; i < CAPTURE_CHECK; i++)
+        {
+            uint32_t l0 = bank0 ? lev[0] & mask0 : 0;
+            uint32_t l1 = bank1 ? lev[1] & mask1 : 0;
+
+            if ((l0 ^ prev0) | (l1 ^ prev1))
+            {
+                now = clock_ns(CLOCK_MONOTONIC);
+                if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) < CAPTURE_RING_SIZE)
+                {
+                    struct capture_event *ev = &ring->ev[head & (CAPTURE_RING_SIZE - 1)];
+
+                    ev->ns = now - start;
+                    ev->levels[0] = l0;
+                    ev->levels[1] = l1;
+                    head++;
+                    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+                    prev0 = l0;
+                    prev1 = l1;
+                    stalled = 0;
+                }
+                else if (!stalled)
+                {
+                    /* Leave prev alone so the change is retried next sample */
+                    hdr->overruns++;
+                    stalled = 1;
+                }
+            }
+        }
+        samples += CAPTURE_CHECK;
+        now = clock_ns(CLOCK_MONOTONIC);
+    }
+
+    hdr->samples = samples;
+    hdr->duration_ns = now - start;
+}
+
+/*
+  Samples the pins in gpiomask for the given number of seconds (or until
+  interrupted) and writes the changes to path.
+*/
+int run_capture(struct gpio_chip *chip, const uint32_t *gpiomask, double seconds,
+                const char *path)
+{
+    const volatile uint32_t *lev = gpio_level_regs(chip);
+    struct capture_header hdr;
+    struct capture_writer w;
+    struct capture_ring *ring;
+    pthread_t writer;
+    uint64_t start;
+    int bank;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CAPTURE_VERSION;
+    hdr.gpio_count = gpio_chip_gpio_count(chip);
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+    {
+        hdr.mask[bank] = gpiomask[bank];
+        hdr.initial[bank] = lev[bank] & gpiomask[bank];
+    }
+
+    memset(&w, 0, sizeof(w));
+    if ((w.out = fopen(path, "wb")) == NULL)
+    {
+        printf("Can't open '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+    {
+        printf("Out of memory\n");
+        fclose(w.out);
+        return 1;
+    }
+
+    /* The header is rewritten with the totals at the end */
+    fwrite(&hdr, sizeof(hdr), 1, w.out);
+    w.ring = ring;
+    w.hdr = &hdr;
+    if (pthread_create(&writer, NULL, capture_writer_thread, &w))
+    {
+        printf("Can't start writer thread\n");
+        fclose(w.out);
+        free(ring);
+        return 1;
+    }
+
+    signal(SIGINT, capture_signal);
+    signal(SIGTERM, capture_signal);
+
+    hdr.start_time_ns = clock_ns(CLOCK_REALTIME);
+    start = clock_ns(CLOCK_MONOTONIC);
+
+    if (hdr.mask[0] && hdr.mask[1])
+        capture_poll(ring, &hdr, lev, start, start + seconds * 1e9, 1, 1);
+    else if (hdr.mask[1])
+        capture_poll(ring, &hdr, lev, start, start + seconds * 1e9, 0, 1);
+    else
+        capture_poll(ring, &hdr, lev, start, start + seconds * 1e9, 1, 0);
+
+    __atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    free(ring);
+
+    if (!w.error)
+    {
+        rewind(w.out);
+        if (fwrite(&hdr, sizeof(hdr), 1, w.out) != 1)
+            w.error = errno;
+    }
+    if (fclose(w.out) != 0 && !w.error)
+        w.error = errno;
+    if (w.error)
+    {
+        printf("Error writing '%s': %s\n", path, strerror(w.error));
+        return 1;
+    }
+
+    printf("Captured %llu samples in %.3f s (%.3f MHz), %llu changes, %llu overruns\n",
+           (unsigned long long)hdr.samples, hdr.duration_ns / 1e9,
+           hdr.duration_ns ? hdr.samples * 1e3 / hdr.duration_ns : 0.0,
+           (unsigned long long)hdr.changes, (unsigned long long)hdr.overruns);
+
+    return hdr.overruns ? 1 : 0;
+}
+
+/* Converts the capture in path to a Value Change Dump on out */
+int run_vcd(const char *path, FILE *out)
+{
+    struct capture_header hdr;
+    uint32_t levels[GPIO_MAX_BANKS];
+    uint64_t ns = 0;
+    FILE *in;
+    int bank;
+    int gpio;
+
+    if ((in = fopen(path, "rb")) == NULL)
+    {
+        printf("Can't open '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+        memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != CAPTURE_VERSION || hdr.gpio_count > 32 * GPIO_MAX_BANKS)
+    {
+        printf("'%s' is not a raspi-gpio capture\n", path);
+        fclose(in);
+        return 1;
+    }
+
+    /* One wire per captured pin, with identifiers from '!' onwards */
+    fprintf(out, "$comment raspi-gpio capture, %llu samples, %llu overruns $end\n",
+            (unsigned long long)hdr.samples, (unsigned long long)hdr.overruns);
+    fprintf(out, "$timescale 1ns $end\n$scope module gpio $end\n");
+    gpio_mask_for_each(gpio, hdr.mask, GPIO_MASK_WORDS(hdr.gpio_count))
+        fprintf(out, "$var wire 1 %c GPIO%d $end\n", '!' + gpio, gpio);
+    fprintf(out, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+    gpio_mask_for_each(gpio, hdr.mask, GPIO_MASK_WORDS(hdr.gpio_count))
+        fprintf(out, "%d%c\n", gpio_mask_test(hdr.initial, gpio), '!' + gpio);
+    fprintf(out, "$end\n");
+
+    memcpy(levels, hdr.initial, sizeof(levels));
+    while (1)
+    {
+        uint32_t diff[GPIO_MAX_BANKS] = { 0 };
+        uint64_t v;
+
+        if (capture_get_varint(in, &v))
+            break;
+        ns += v;
+        for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+        {
+            if (hdr.mask[bank] && capture_get_varint(in, &v) == 0)
+                diff[bank] = v;
+            levels[bank] ^= diff[bank];
+        }
+
+        fprintf(out, "#%llu\n", (unsigned long long)ns);
+        gpio_mask_for_each(gpio, diff, GPIO_MASK_WORDS(hdr.gpio_count))
+            fprintf(out, "%d%c\n", gpio_mask_test(levels, gpio), '!' + gpio);
+    }
+    fprintf(out, "#%llu\n", (unsigned long long)hdr.duration_ns);
+
+    fclose(in);
+    return 0;
+}
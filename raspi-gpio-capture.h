@@ -0,0 +1,17 @@
+/*
+  raspi-gpio logic-analyser capture.
+*/
+
+#ifndef RASPI_GPIO_CAPTURE_H
+#define RASPI_GPIO_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "raspigpio.h"
+
+int run_capture(struct gpio_chip *chip, const uint32_t *gpiomask, double seconds,
+                const char *path);
+int run_vcd(const char *path, FILE *out);
+
+#endif
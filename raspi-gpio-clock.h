@@ -0,0 +1,45 @@
+/*
+  Monotonic clock helpers shared by the raspi-gpio timing modes.
+*/
+
+#ifndef RASPI_GPIO_CLOCK_H
+#define RASPI_GPIO_CLOCK_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+static inline uint64_t clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+  Waits until CLOCK_MONOTONIC reaches deadline: an absolute sleep, which
+  cannot accumulate drift, to within spin_ns of it, then a spin for the
+  remainder. Returns the time on leaving, which is never before deadline.
+*/
+static inline uint64_t clock_wait_until(uint64_t deadline, uint64_t spin_ns)
+{
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+
+    if (deadline > now + spin_ns)
+    {
+        struct timespec ts;
+        uint64_t wake = deadline - spin_ns;
+
+        ts.tv_sec = wake / 1000000000;
+        ts.tv_nsec = wake % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+    while ((now = clock_ns(CLOCK_MONOTONIC)) < deadline)
+        ;
+
+    return now;
+}
+
+#endif
@@ -0,0 +1,215 @@
+/*
+  Measurement of the signals on input pins: edge counts, frequency, duty
+  cycle and the shortest and longest high and low pulses of each, from
+  one pass over GPLEV0/1 polled as fast as possible.
+
+  Each sample is a whole level word per bank, XORed with the last to find
+  every pin that changed at once, so a sample with no edges costs the
+  same however many pins are measured. Only on a change is the clock read
+  and the pins that changed visited, a set bit at a time; the rising and
+  falling edges of all of them are counted with a popcount apiece.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "raspigpio.h"
+#include "raspi-gpio-clock.h"
+#include "raspi-gpio-measure.h"
+
+#define MEASURE_CHECK 1024   /* Samples between clock/stop checks */
+
+struct measure_pin
+{
+    uint64_t rising;
+    uint64_t falling;
+    uint64_t first_rise;         /* ns since the start of the first and last rising edges */
+    uint64_t last_rise;
+    uint64_t last_edge;
+    uint64_t high_ns;            /* Total of the complete pulses */
+    uint64_t low_ns;
+    uint64_t high_min, high_max;
+    uint64_t low_min, low_max;
+};
+
+struct measure
+{
+    uint32_t mask[GPIO_MAX_BANKS];
+    uint32_t initial[GPIO_MAX_BANKS];
+    uint32_t final[GPIO_MAX_BANKS];
+    uint64_t samples;
+    uint64_t duration_ns;
+    uint64_t rising;             /* Over all the pins */
+    uint64_t falling;
+    struct measure_pin pins[32 * GPIO_MAX_BANKS];
+};
+
+static volatile sig_atomic_t measure_stop;
+
+static void measure_signal(int sig)
+{
+    measure_stop = 1;
+}
+
+/* Accounts for the edges in changed, the new levels being levels, at time ns */
+static void measure_edges(struct measure *m, int bank, uint32_t changed, uint32_t levels,
+                          uint64_t ns)
+{
+    m->rising += __builtin_popcount(changed & levels);
+    m->falling += __builtin_popcount(changed & ~levels);
+
+    while (changed)
+    {
+        int bit = __builtin_ctz(changed);
+        struct measure_pin *pin = &m->pins[bank * 32 + bit];
+        uint64_t width = ns - pin->last_edge;
+
+        changed &= changed - 1;
+
+        /* The first pulse began before the start, so its width is unknown */
+        if (pin->rising + pin->falling)
+        {
+            if ((levels >> bit) & 1)
+            {
+                pin->low_ns += width;
+                if (!pin->low_min || width < pin->low_min)
+                    pin->low_min = width;
+                if (width > pin->low_max)
+                    pin->low_max = width;
+            }
+            else
+            {
+                pin->high_ns += width;
+                if (!pin->high_min || width < pin->high_min)
+                    pin->high_min = width;
+                if (width > pin->high_max)
+                    pin->high_max = width;
+            }
+        }
+
+        if ((levels >> bit) & 1)
+        {
+            if (!pin->rising++)
+                pin->first_rise = ns;
+            pin->last_rise = ns;
+        }
+        else
+        {
+            pin->falling++;
+        }
+        pin->last_edge = ns;
+    }
+}
+
+/* The sampling loop, specialised like capture's for the banks in use */
+static inline void measure_poll(struct measure *m, const volatile uint32_t *lev,
+                                uint64_t start, uint64_t end, int bank0, int bank1)
+{
+    uint32_t mask0 = m->mask[0], mask1 = m->mask[1];
+    uint32_t prev0 = m->initial[0], prev1 = m->initial[1];
+    uint64_t samples = 0;
+    uint64_t now = start;
+    int i;
+
+    while (!measure_stop && now < end)
+    {
+        for (i = 0; i < MEASURE_CHECK; i++)
+        {
+            uint32_t l0 = bank0 ? lev[0] & mask0 : 0;
+            uint32_t l1 = bank1 ? lev[1] & mask1 : 0;
+
+            if ((l0 ^ prev0) | (l1 ^ prev1))
+            {
+                uint64_t ns = clock_ns(CLOCK_MONOTONIC) - start;
+
+                if (l0 ^ prev0)
+                    measure_edges(m, 0, l0 ^ prev0, l0, ns);
+                if (l1 ^ prev1)
+                    measure_edges(m, 1, l1 ^ prev1, l1, ns);
+                prev0 = l0;
+                prev1 = l1;
+            }
+        }
+        samples += MEASURE_CHECK;
+        now = clock_ns(CLOCK_MONOTONIC);
+    }
+
+    m->final[0] = prev0;
+    m->final[1] = prev1;
+    m->samples = samples;
+    m->duration_ns = now - start;
+}
+
+static void measure_print(const struct measure *m, unsigned int gpio)
+{
+    const struct measure_pin *pin = &m->pins[gpio];
+    int level = gpio_mask_test(m->final, gpio);
+
+    printf("GPIO %d: level=%d edges=%llu", gpio, level,
+           (unsigned long long)(pin->rising + pin->falling));
+    if (pin->rising + pin->falling == 0)
+    {
+        printf(" duty=%d%%\n", level ? 100 : 0);
+        return;
+    }
+
+    printf(" rising=%llu", (unsigned long long)pin->rising);
+    if (pin->rising > 1)
+        printf(" freq=%.3f Hz",
+               (pin->rising - 1) * 1e9 / (pin->last_rise - pin->first_rise));
+    if (pin->high_ns + pin->low_ns)
+        printf(" duty=%.1f%%", pin->high_ns * 100.0 / (pin->high_ns + pin->low_ns));
+    if (pin->high_max)
+        printf(" high=%.3f-%.3f us", pin->high_min / 1e3, pin->high_max / 1e3);
+    if (pin->low_max)
+        printf(" low=%.3f-%.3f us", pin->low_min / 1e3, pin->low_max / 1e3);
+    printf("\n");
+}
+
+/*
+  Samples the pins in gpiomask for the given number of seconds (or until
+  interrupted), then prints the figures for each.
+*/
+int run_measure(struct gpio_chip *chip, const uint32_t *gpiomask, double seconds)
+{
+    static struct measure m;
+    const volatile uint32_t *lev = gpio_level_regs(chip);
+    uint64_t start;
+    int bank;
+    int gpio;
+
+    memset(&m, 0, sizeof(m));
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+    {
+        m.mask[bank] = gpiomask[bank];
+        m.initial[bank] = lev[bank] & gpiomask[bank];
+    }
+
+    signal(SIGINT, measure_signal);
+    signal(SIGTERM, measure_signal);
+
+    start = clock_ns(CLOCK_MONOTONIC);
+    if (m.mask[0] && m.mask[1])
+        measure_poll(&m, lev, start, start + seconds * 1e9, 1, 1);
+    else if (m.mask[1])
+        measure_poll(&m, lev, start, start + seconds * 1e9, 0, 1);
+    else
+        measure_poll(&m, lev, start, start + seconds * 1e9, 1, 0);
+
+    gpio_mask_for_each(gpio, m.mask, GPIO_MAX_BANKS)
+    {
+        if (gpio >= gpio_chip_gpio_count(chip))
+            break;
+        measure_print(&m, gpio);
+    }
+
+    printf("Measured %llu samples in %.3f s (%.3f MHz), %llu rising and %llu falling edges\n",
+           (unsigned long long)m.samples, m.duration_ns / 1e9,
+           m.duration_ns ? m.samples * 1e3 / m.duration_ns : 0.0,
+           (unsigned long long)m.rising, (unsigned long long)m.falling);
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+/*
+  raspi-gpio frequency, duty cycle and pulse width measurement.
+*/
+
+#ifndef RASPI_GPIO_MEASURE_H
+#define RASPI_GPIO_MEASURE_H
+
+#include <stdint.h>
+
+#include "raspigpio.h"
+
+int run_measure(struct gpio_chip *chip, const uint32_t *gpiomask, double seconds);
+
+#endif
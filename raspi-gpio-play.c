@@ -0,0 +1,183 @@
+/*
+  Deadline-scheduled waveform playback.
+
+  A waveform is a text file of steps, one per line:
+    <time> <set GPIO> <clear GPIO>
+  where time is in microseconds from the start (fractions allowed, never
+  decreasing) and each GPIO list is in the usual syntax, or "-" for none.
+  Blank lines and lines starting with '#' are ignored.
+
+  The whole file is compiled into per-bank GPSET/GPCLR masks before the
+  clock starts. Each step then sleeps until just before its deadline with
+  an absolute clock_nanosleep and spins the rest of the way, so that the
+  writes land as close to it as possible.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "raspigpio.h"
+#include "raspi-gpio-clock.h"
+#include "raspi-gpio-play.h"
+
+#define PLAY_SPIN_NS 100000  /* Spin, rather than sleep, this close to a deadline */
+
+struct play_step
+{
+    uint64_t ns;
+    uint32_t set[GPIO_MAX_BANKS];
+    uint32_t clr[GPIO_MAX_BANKS];
+};
+
+static int play_cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int play_parse_mask(struct gpio_chip *chip, const char *list, uint32_t *mask)
+{
+    if (strcmp(list, "-") == 0)
+        return 0;
+    return gpio_parse_pins(chip, list, mask) != NULL;
+}
+
+/* Reads the waveform in, returning the number of steps or -1 */
+static int play_load(struct gpio_chip *chip, FILE *in, struct play_step **steps)
+{
+    struct play_step *s = NULL;
+    char *line = NULL;
+    size_t size = 0;
+    int alloc = 0;
+    int count = 0;
+    int lineno = 0;
+
+    while (getline(&line, &size, in) >= 0)
+    {
+        char set[256], clr[256];
+        double us;
+        int n;
+
+        lineno++;
+        n = sscanf(line, " %lf %255s %255s", &us, set, clr);
+        if (n <= 0 && (sscanf(line, " %1s", set) != 1 || set[0] == '#'))
+            continue;
+
+        if (count == alloc)
+        {
+            struct play_step *more;
+
+            alloc = alloc ? alloc * 2 : 1024;
+            if ((more = realloc(s, alloc * sizeof(*s))) == NULL)
+            {
+                printf("Out of memory\n");
+                goto fail;
+            }
+            s = more;
+        }
+        memset(&s[count], 0, sizeof(s[count]));
+
+        if (n != 3 || us < 0 ||
+            play_parse_mask(chip, set, s[count].set) ||
+            play_parse_mask(chip, clr, s[count].clr))
+        {
+            printf("Line %d: expected <time> <set GPIO> <clear GPIO>\n", lineno);
+            goto fail;
+        }
+        s[count].ns = us * 1000 + 0.5;
+        if (count && s[count].ns < s[count - 1].ns)
+        {
+            printf("Line %d: time goes backwards\n", lineno);
+            goto fail;
+        }
+        count++;
+    }
+
+    free(line);
+    *steps = s;
+    return count;
+
+fail:
+    free(line);
+    free(s);
+    return -1;
+}
+
+int run_play(struct gpio_chip *chip, FILE *in)
+{
+    struct gpio_snapshot snap;
+    struct play_step *steps;
+    int64_t *err;
+    int64_t total = 0;
+    uint64_t start, end;
+    int count;
+    int gpio;
+    int bank;
+    int i;
+
+    count = play_load(chip, in, &steps);
+    if (count <= 0)
+    {
+        if (count == 0)
+            printf("Nothing to play\n");
+        return 1;
+    }
+
+    /* As with set, levels can only be driven on outputs */
+    gpio_snapshot_take(chip, &snap);
+    for (i = 0; i < count; i++)
+    {
+        uint32_t used[GPIO_MAX_BANKS];
+
+        for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+            used[bank] = steps[i].set[bank] | steps[i].clr[bank];
+        gpio_mask_for_each(gpio, used, GPIO_MAX_BANKS)
+        {
+            if (gpio_snapshot_fsel(&snap, gpio) != FUNC_OP)
+            {
+                printf("Can't play GPIO %d, not an output\n", gpio);
+                free(steps);
+                return 1;
+            }
+        }
+    }
+
+    if ((err = malloc(count * sizeof(*err))) == NULL)
+    {
+        printf("Out of memory\n");
+        free(steps);
+        return 1;
+    }
+
+    /* Page faults mid-waveform would cost far more than the timing budget */
+    mlockall(MCL_CURRENT | MCL_FUTURE);
+
+    start = clock_ns(CLOCK_MONOTONIC) + PLAY_SPIN_NS;
+    for (i = 0; i < count; i++)
+    {
+        uint64_t deadline = start + steps[i].ns;
+        uint64_t now = clock_wait_until(deadline, PLAY_SPIN_NS);
+
+        gpio_write_levels(chip, steps[i].set, steps[i].clr);
+        err[i] = now - deadline;
+        total += err[i];
+    }
+    end = clock_ns(CLOCK_MONOTONIC);
+
+    munlockall();
+
+    qsort(err, count, sizeof(*err), play_cmp);
+    printf("Played %d steps in %.6f s: timing error min %lld ns, mean %lld ns, "
+           "p99 %lld ns, max %lld ns\n",
+           count, (end - start) / 1e9, (long long)err[0], (long long)(total / count),
+           (long long)err[(count * 99) / 100], (long long)err[count - 1]);
+
+    free(err);
+    free(steps);
+    return 0;
+}
@@ -0,0 +1,14 @@
+/*
+  raspi-gpio waveform playback.
+*/
+
+#ifndef RASPI_GPIO_PLAY_H
+#define RASPI_GPIO_PLAY_H
+
+#include <stdio.h>
+
+#include "raspigpio.h"
+
+int run_play(struct gpio_chip *chip, FILE *in);
+
+#endif
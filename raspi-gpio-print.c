@@ -0,0 +1,701 @@
+/*
+  Output formatting shared by raspi-gpio and its benchmark.
+
+  The text output is printed piecemeal as it always has been. The JSON,
+  CSV and binary formats are instead built in one preallocated buffer with
+  hand-rolled integer formatting and handed to stdio with a single
+  fwrite(), so that pollers sampling at a high rate pay for no printf
+  format parsing. stdio passes a block that size straight to the kernel
+  when the stream has no room for it, yet batch mode's full buffering
+  still gathers the output of many commands into few writes.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "raspigpio.h"
+#include "raspi-gpio-print.h"
+
+#define OUT_BUF_SIZE 16384   /* Holds the largest output (JSON funcs) whole */
+#define OUT_MAX_ITEM 512     /* Most that one pin or register can add */
+
+static const char *event_names[GPIO_EVENT_TYPES] =
+{
+    "RISING", "FALLING", "HIGH", "LOW", "ARISING", "AFALLING"
+};
+
+void print_gpio_alts_info(FILE *out, struct gpio_chip *chip, int gpio)
+{
+    int alt;
+    fprintf(out, "%d, %s", gpio, gpio_pull_name(gpio_default_pull(chip, gpio)));
+    for (alt = 0; alt < 6; alt++)
+    {
+        const char *name = gpio_alt_name(chip, gpio, alt);
+        fprintf(out, ", %s", name ? name : "-");
+    }
+    fprintf(out, "\n");
+}
+
+void print_raw_gpio_regs(FILE *out, const struct gpio_snapshot *snap)
+{
+    struct gpio_chip *chip = snap->chip;
+    int i = -1;
+
+    while (1)
+    {
+        int new_i = gpio_next_reg(chip, i++);
+
+        if (new_i < 0)
+            break;
+        if (new_i != i)
+        {
+            /* Change rows if needed */
+            if ((i & ~3) != (new_i & ~3)) /* Not on the same row */
+            {
+                if (i & 3)                /* This row has been started */
+                    fprintf(out, "\n");
+                i = new_i & ~3;
+            }
+        }
+        if ((i & 3) == 0)
+            fprintf(out, "%02x:", i * 4);
+        if (new_i != i)
+        {
+            /* Insert padding if needed */
+            fprintf(out, "%*s", (new_i - i) * 9, "");
+            i = new_i;
+        }
+
+        fprintf(out, " %08x", snap->regs[i]);
+
+        if ((i & 3) == 3)
+            fprintf(out, "\n");
+    }
+    if (i & 3)
+        fprintf(out, "\n");
+}
+
+int gpio_get(FILE *out, const struct gpio_snapshot *snap, unsigned int gpio)
+{
+    const char *name;
+    int events;
+    int type;
+    int level;
+    int fsel;
+    int pull;
+
+    fsel = gpio_snapshot_fsel(snap, gpio);
+    name = gpio_fsel_to_namestr(snap->chip, gpio, fsel);
+    level = gpio_snapshot_level(snap, gpio);
+
+    fprintf(out, "GPIO %d: level=%d", gpio, level);
+
+    if (fsel >= FUNC_A0)
+        fprintf(out, " alt=%d", fsel - FUNC_A0);
+    fprintf(out, " func=%s", name);
+
+    pull = gpio_snapshot_pull(snap, gpio);
+    if (pull != PULL_UNSET)
+        fprintf(out, " pull=%s", gpio_pull_name(pull));
+
+    events = gpio_snapshot_events(snap, gpio);
+    for (type = 0; type < GPIO_EVENT_TYPES; type++)
+    {
+        if (events & (1 << type))
+            fprintf(out, "%s%s", events & ((1 << type) - 1) ? "," : " detect=", event_names[type]);
+    }
+    if (gpio_snapshot_event(snap, gpio))
+        fprintf(out, " event=1");
+    fprintf(out, "\n");
+    return 0;
+}
+
+void print_gpio_state(FILE *out, const struct gpio_snapshot *snap, const uint32_t *gpiomask)
+{
+    int all_pins = gpio_mask_empty(gpiomask, GPIO_MAX_BANKS);
+    int pin;
+
+    if (!all_pins)
+    {
+        gpio_mask_for_each(pin, gpiomask, GPIO_MAX_BANKS)
+            gpio_get(out, snap, pin);
+        return;
+    }
+
+    for (pin = 0; pin < gpio_chip_gpio_count(snap->chip); pin++)
+    {
+        if (pin==0) fprintf(out, "BANK0 (GPIO 0 to 27):\n");
+        if (pin==28) fprintf(out, "BANK1 (GPIO 28 to 45):\n");
+        if (pin==46) fprintf(out, "BANK2 (GPIO 46 to 53):\n");
+        gpio_get(out, snap, pin);
+    }
+}
+
+struct out_buf
+{
+    FILE *out;
+    char *p;
+    char buf[OUT_BUF_SIZE];
+};
+
+static struct out_buf out_buf;
+
+static void out_flush(struct out_buf *b)
+{
+    fwrite(b->buf, 1, b->p - b->buf, b->out);
+    b->p = b->buf;
+}
+
+static struct out_buf *out_start(FILE *out)
+{
+    out_buf.out = out;
+    out_buf.p = out_buf.buf;
+    return &out_buf;
+}
+
+/* Makes room for one more item, writing out what there is if need be */
+static void out_reserve(struct out_buf *b)
+{
+    if (b->p + OUT_MAX_ITEM > b->buf + OUT_BUF_SIZE)
+        out_flush(b);
+}
+
+static void out_str(struct out_buf *b, const char *s)
+{
+    size_t len = strlen(s);
+
+    memcpy(b->p, s, len);
+    b->p += len;
+}
+
+static void out_uint(struct out_buf *b, uint32_t v)
+{
+    char tmp[10];
+    int n = 0;
+
+    do
+    {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n)
+        *b->p++ = tmp[--n];
+}
+
+static void out_int(struct out_buf *b, int v)
+{
+    if (v < 0)
+    {
+        *b->p++ = '-';
+        out_uint(b, -(uint32_t)v);
+    }
+    else
+    {
+        out_uint(b, v);
+    }
+}
+
+static void out_hex(struct out_buf *b, uint32_t v, int digits)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    while (digits--)
+        *b->p++ = hex[(v >> (digits * 4)) & 0xf];
+}
+
+static void out_bytes(struct out_buf *b, const void *data, size_t len)
+{
+    memcpy(b->p, data, len);
+    b->p += len;
+}
+
+/* A JSON string, or null; every name in the tables is plain ASCII */
+static void out_json_str(struct out_buf *b, const char *s)
+{
+    if (!s)
+    {
+        out_str(b, "null");
+        return;
+    }
+    *b->p++ = '"';
+    out_str(b, s);
+    *b->p++ = '"';
+}
+
+static void out_detect(struct out_buf *b, int events, int json)
+{
+    int type;
+    int first = 1;
+
+    if (json)
+        *b->p++ = '[';
+    for (type = 0; type < GPIO_EVENT_TYPES; type++)
+    {
+        if (!(events & (1 << type)))
+            continue;
+        if (!first)
+            *b->p++ = json ? ',' : '|';
+        if (json)
+            out_json_str(b, event_names[type]);
+        else
+            out_str(b, event_names[type]);
+        first = 0;
+    }
+    if (json)
+        *b->p++ = ']';
+}
+
+/* The pins to print: those in gpiomask, or every pin if it is empty */
+static void pins_selected(const struct gpio_chip *chip, const uint32_t *gpiomask, uint32_t *sel)
+{
+    memcpy(sel, gpiomask, GPIO_MAX_BANKS * sizeof(*sel));
+    if (gpio_mask_empty(gpiomask, GPIO_MAX_BANKS))
+        gpio_mask_add_range(sel, 0, gpio_chip_gpio_count(chip) - 1);
+}
+
+void format_gpio_state(FILE *out, int format, const struct gpio_snapshot *snap,
+                       const uint32_t *gpiomask)
+{
+    struct gpio_chip *chip = snap->chip;
+    uint32_t sel[GPIO_MAX_BANKS];
+    struct out_buf *b;
+    int first = 1;
+    int gpio;
+
+    if (format == FORMAT_TEXT)
+    {
+        print_gpio_state(out, snap, gpiomask);
+        return;
+    }
+
+    b = out_start(out);
+    if (format == FORMAT_JSON)
+    {
+        out_str(b, "{\"chip\":");
+        out_json_str(b, gpio_chip_name(chip));
+        out_str(b, ",\"gpios\":[");
+    }
+    else if (format == FORMAT_CSV)
+    {
+        out_str(b, "gpio,level,func,alt,pull,detect,event\n");
+    }
+
+    pins_selected(chip, gpiomask, sel);
+    gpio_mask_for_each(gpio, sel, GPIO_MAX_BANKS)
+    {
+        struct gpio_pin_record rec;
+        const char *func;
+
+        out_reserve(b);
+        gpio_snapshot_record(snap, gpio, &rec);
+        if (format == FORMAT_BIN)
+        {
+            out_bytes(b, &rec, sizeof(rec));
+            continue;
+        }
+
+        func = gpio_fsel_to_namestr(chip, gpio, rec.fsel);
+        if (format == FORMAT_JSON)
+        {
+            out_str(b, first ? "{\"gpio\":" : ",{\"gpio\":");
+            out_int(b, gpio);
+            out_str(b, ",\"level\":");
+            out_int(b, rec.level);
+            out_str(b, ",\"func\":");
+            out_json_str(b, func);
+            out_str(b, ",\"alt\":");
+            if (rec.fsel >= FUNC_A0)
+                out_int(b, rec.fsel - FUNC_A0);
+            else
+                out_str(b, "null");
+            out_str(b, ",\"pull\":");
+            out_json_str(b, rec.pull == PULL_UNSET ? NULL : gpio_pull_name(rec.pull));
+            out_str(b, ",\"detect\":");
+            out_detect(b, rec.events, 1);
+            out_str(b, ",\"event\":");
+            out_int(b, rec.event);
+            *b->p++ = '}';
+        }
+        else
+        {
+            out_int(b, gpio);
+            *b->p++ = ',';
+            out_int(b, rec.level);
+            *b->p++ = ',';
+            out_str(b, func);
+            *b->p++ = ',';
+            if (rec.fsel >= FUNC_A0)
+                out_int(b, rec.fsel - FUNC_A0);
+            *b->p++ = ',';
+            if (rec.pull != PULL_UNSET)
+                out_str(b, gpio_pull_name(rec.pull));
+            *b->p++ = ',';
+            out_detect(b, rec.events, 0);
+            *b->p++ = ',';
+            out_int(b, rec.event);
+            *b->p++ = '\n';
+        }
+        first = 0;
+    }
+
+    if (format == FORMAT_JSON)
+        out_str(b, "]}\n");
+    out_flush(b);
+}
+
+/*
+  Room for the longest alt function name (16 characters) and at least one
+  NUL after it, rounded up to keep records 8-byte aligned.
+*/
+#define RECORD_NAME 24
+
+/*
+  The binary form of funcs is a struct gpio_funcs_record per pin. Each name
+  is NUL padded to RECORD_NAME bytes, so it is always terminated, and an
+  absent one is all NULs.
+*/
+struct gpio_funcs_record
+{
+    uint8_t gpio;
+    int8_t default_pull;
+    uint8_t reserved[6];
+    char alt[6][RECORD_NAME];
+};
+
+void format_gpio_funcs(FILE *out, int format, struct gpio_chip *chip, const uint32_t *gpiomask)
+{
+    uint32_t sel[GPIO_MAX_BANKS];
+    struct out_buf *b;
+    int first = 1;
+    int gpio;
+    int alt;
+
+    pins_selected(chip, gpiomask, sel);
+    if (format == FORMAT_TEXT || format == FORMAT_CSV)
+    {
+        /* The text form is already CSV */
+        fprintf(out, "GPIO, DEFAULT PULL, ALT0, ALT1, ALT2, ALT3, ALT4, ALT5\n");
+        gpio_mask_for_each(gpio, sel, GPIO_MAX_BANKS)
+            print_gpio_alts_info(out, chip, gpio);
+        return;
+    }
+
+    b = out_start(out);
+    if (format == FORMAT_JSON)
+    {
+        out_str(b, "{\"chip\":");
+        out_json_str(b, gpio_chip_name(chip));
+        out_str(b, ",\"gpios\":[");
+    }
+
+    gpio_mask_for_each(gpio, sel, GPIO_MAX_BANKS)
+    {
+        out_reserve(b);
+        if (format == FORMAT_BIN)
+        {
+            struct gpio_funcs_record rec;
+
+            memset(&rec, 0, sizeof(rec));
+            rec.gpio = gpio;
+            rec.default_pull = gpio_default_pull(chip, gpio);
+            for (alt = 0; alt < 6; alt++)
+            {
+                const char *name = gpio_alt_name(chip, gpio, alt);
+                if (name)
+                    strncpy(rec.alt[alt], name, sizeof(rec.alt[alt]) - 1);
+            }
+            out_bytes(b, &rec, sizeof(rec));
+            continue;
+        }
+
+        out_str(b, first ? "{\"gpio\":" : ",{\"gpio\":");
+        out_int(b, gpio);
+        out_str(b, ",\"default_pull\":");
+        out_json_str(b, gpio_pull_name(gpio_default_pull(chip, gpio)));
+        out_str(b, ",\"alts\":[");
+        for (alt = 0; alt < 6; alt++)
+        {
+            if (alt)
+                *b->p++ = ',';
+            out_json_str(b, gpio_alt_name(chip, gpio, alt));
+        }
+        out_str(b, "]}");
+        first = 0;
+    }
+
+    if (format == FORMAT_JSON)
+        out_str(b, "]}\n");
+    out_flush(b);
+}
+
+/*
+  The binary form of funcs --find is a struct gpio_find_record per match,
+  the name NUL padded as in funcs.
+*/
+struct gpio_find_record
+{
+    uint8_t gpio;
+    uint8_t alt;
+    uint8_t reserved[6];
+    char name[RECORD_NAME];
+};
+
+void format_alt_find(FILE *out, int format, struct gpio_chip *chip, const char *name)
+{
+    struct gpio_alt_ref refs[32 * GPIO_MAX_BANKS * 6];
+    struct out_buf *b;
+    int count;
+    int i;
+
+    count = gpio_find_alt(chip, name, 1, refs, sizeof(refs) / sizeof(refs[0]));
+    if (count > sizeof(refs) / sizeof(refs[0]))
+        count = sizeof(refs) / sizeof(refs[0]);
+
+    if (format == FORMAT_TEXT || format == FORMAT_CSV)
+    {
+        fprintf(out, "GPIO, ALT, FUNCTION\n");
+        for (i = 0; i < count; i++)
+            fprintf(out, "%d, %d, %s\n", refs[i].gpio, refs[i].alt, refs[i].name);
+        return;
+    }
+
+    b = out_start(out);
+    if (format == FORMAT_JSON)
+    {
+        out_str(b, "{\"chip\":");
+        out_json_str(b, gpio_chip_name(chip));
+        out_str(b, ",\"matches\":[");
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        out_reserve(b);
+        if (format == FORMAT_BIN)
+        {
+            struct gpio_find_record rec;
+
+            memset(&rec, 0, sizeof(rec));
+            rec.gpio = refs[i].gpio;
+            rec.alt = refs[i].alt;
+            strncpy(rec.name, refs[i].name, sizeof(rec.name) - 1);
+            out_bytes(b, &rec, sizeof(rec));
+            continue;
+        }
+
+        out_str(b, i ? ",{\"gpio\":" : "{\"gpio\":");
+        out_int(b, refs[i].gpio);
+        out_str(b, ",\"alt\":");
+        out_int(b, refs[i].alt);
+        out_str(b, ",\"func\":");
+        out_json_str(b, refs[i].name);
+        *b->p++ = '}';
+    }
+
+    if (format == FORMAT_JSON)
+        out_str(b, "]}\n");
+    out_flush(b);
+}
+
+/* The binary form of raw is a pair of uint32 (byte offset, value) per register */
+void format_raw_regs(FILE *out, int format, const struct gpio_snapshot *snap)
+{
+    struct gpio_chip *chip = snap->chip;
+    struct out_buf *b;
+    int reg;
+
+    if (format == FORMAT_TEXT)
+    {
+        print_raw_gpio_regs(out, snap);
+        return;
+    }
+
+    b = out_start(out);
+    if (format == FORMAT_JSON)
+    {
+        out_str(b, "{\"chip\":");
+        out_json_str(b, gpio_chip_name(chip));
+        out_str(b, ",\"regs\":[");
+    }
+    else if (format == FORMAT_CSV)
+    {
+        out_str(b, "offset,value\n");
+    }
+
+    for (reg = gpio_next_reg(chip, -1); reg >= 0; reg = gpio_next_reg(chip, reg))
+    {
+        uint32_t pair[2] = { reg * 4, snap->regs[reg] };
+
+        out_reserve(b);
+        if (format == FORMAT_BIN)
+        {
+            out_bytes(b, pair, sizeof(pair));
+        }
+        else if (format == FORMAT_JSON)
+        {
+            out_str(b, reg ? ",{\"offset\":" : "{\"offset\":");
+            out_int(b, reg * 4);
+            out_str(b, ",\"value\":");
+            out_uint(b, snap->regs[reg]);
+            *b->p++ = '}';
+        }
+        else
+        {
+            out_str(b, "0x");
+            out_hex(b, reg * 4, 2);
+            out_str(b, ",0x");
+            out_hex(b, snap->regs[reg], 8);
+            *b->p++ = '\n';
+        }
+    }
+
+    if (format == FORMAT_JSON)
+        out_str(b, "]}\n");
+    out_flush(b);
+}
+
+/* The upper bound of the histogram bucket holding the given fraction of calls */
+static uint64_t stats_percentile(const struct gpio_op_stats *op, double fraction)
+{
+    uint64_t want = op->calls * fraction;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < GPIO_STATS_BUCKETS - 1; i++)
+    {
+        seen += op->hist[i];
+        if (seen > want)
+            break;
+    }
+    return (uint64_t)2 << i;
+}
+
+/*
+  Statistics are printed with stdio, being written once at exit. Only the
+  registers and calls used appear, except in the binary form, which is
+  the struct gpio_stats itself.
+*/
+void format_stats(FILE *out, int format, struct gpio_chip *chip, const struct gpio_stats *stats)
+{
+    uint64_t total_ns = 0;
+    const char *sep = "";
+    int reg;
+    int op;
+    int i;
+
+    if (format == FORMAT_BIN)
+    {
+        fwrite(stats, sizeof(*stats), 1, out);
+        return;
+    }
+
+    if (format == FORMAT_JSON)
+        fprintf(out, "{\"chip\":\"%s\",\"regs\":[", gpio_chip_name(chip));
+    else if (format == FORMAT_CSV)
+        fprintf(out, "kind,name,count,total_ns,min_ns,max_ns\n");
+    else
+        fprintf(out, "%-10s %6s %10s %10s\n", "register", "offset", "reads", "writes");
+
+    for (reg = gpio_next_reg(chip, -1); reg >= 0; reg = gpio_next_reg(chip, reg))
+    {
+        const char *name = gpio_reg_name(reg);
+        char unnamed[16];
+
+        if (!stats->reads[reg] && !stats->writes[reg])
+            continue;
+        if (!name)
+        {
+            snprintf(unnamed, sizeof(unnamed), "0x%02x", reg * 4);
+            name = unnamed;
+        }
+
+        if (format == FORMAT_JSON)
+        {
+            fprintf(out, "%s{\"name\":\"%s\",\"offset\":%d,\"reads\":%llu,\"writes\":%llu}",
+                    sep, name, reg * 4, (unsigned long long)stats->reads[reg],
+                    (unsigned long long)stats->writes[reg]);
+            sep = ",";
+        }
+        else if (format == FORMAT_CSV)
+        {
+            if (stats->reads[reg])
+                fprintf(out, "read,%s,%llu,,,\n", name, (unsigned long long)stats->reads[reg]);
+            if (stats->writes[reg])
+                fprintf(out, "write,%s,%llu,,,\n", name, (unsigned long long)stats->writes[reg]);
+        }
+        else
+        {
+            fprintf(out, "%-10s   0x%02x %10llu %10llu\n", name, reg * 4,
+                    (unsigned long long)stats->reads[reg], (unsigned long long)stats->writes[reg]);
+        }
+    }
+
+    if (format == FORMAT_JSON)
+        fprintf(out, "],\"ops\":[");
+    else if (format == FORMAT_TEXT)
+        fprintf(out, "%-12s %8s %10s %9s %9s %9s %9s %9s\n", "call", "calls", "total us",
+                "mean ns", "min ns", "max ns", "p50 ns", "p99 ns");
+
+    sep = "";
+    for (op = 0; op < GPIO_OPS; op++)
+    {
+        const struct gpio_op_stats *s = &stats->ops[op];
+
+        if (!s->calls)
+            continue;
+        total_ns += s->total_ns;
+
+        if (format == FORMAT_JSON)
+        {
+            fprintf(out, "%s{\"name\":\"%s\",\"calls\":%llu,\"total_ns\":%llu,\"min_ns\":%llu,"
+                    "\"max_ns\":%llu,\"hist\":[", sep, gpio_op_name(op),
+                    (unsigned long long)s->calls, (unsigned long long)s->total_ns,
+                    (unsigned long long)s->min_ns, (unsigned long long)s->max_ns);
+            for (i = 0; i < GPIO_STATS_BUCKETS; i++)
+                fprintf(out, i ? ",%llu" : "%llu", (unsigned long long)s->hist[i]);
+            fprintf(out, "]}");
+            sep = ",";
+        }
+        else if (format == FORMAT_CSV)
+        {
+            fprintf(out, "call,%s,%llu,%llu,%llu,%llu\n", gpio_op_name(op),
+                    (unsigned long long)s->calls, (unsigned long long)s->total_ns,
+                    (unsigned long long)s->min_ns, (unsigned long long)s->max_ns);
+        }
+        else
+        {
+            char p50[24], p99[24];
+
+            /* Percentiles are known only to within their power-of-two bucket */
+            snprintf(p50, sizeof(p50), "<%llu", (unsigned long long)stats_percentile(s, 0.5));
+            snprintf(p99, sizeof(p99), "<%llu", (unsigned long long)stats_percentile(s, 0.99));
+            fprintf(out, "%-12s %8llu %10.1f %9llu %9llu %9llu %9s %9s\n",
+                    gpio_op_name(op), (unsigned long long)s->calls, s->total_ns / 1e3,
+                    (unsigned long long)(s->total_ns / s->calls),
+                    (unsigned long long)s->min_ns, (unsigned long long)s->max_ns, p50, p99);
+        }
+    }
+
+    if (format == FORMAT_JSON)
+    {
+        fprintf(out, "],\"delays\":%llu,\"delay_ns\":%llu,\"lock_wait_ns\":%llu}\n",
+                (unsigned long long)stats->delays, (unsigned long long)stats->delay_ns,
+                (unsigned long long)stats->lock_wait_ns);
+    }
+    else if (format == FORMAT_CSV)
+    {
+        fprintf(out, "delay,pull,%llu,%llu,,\n", (unsigned long long)stats->delays,
+                (unsigned long long)stats->delay_ns);
+        fprintf(out, "wait,lock,,%llu,,\n", (unsigned long long)stats->lock_wait_ns);
+    }
+    else
+    {
+        /* Pull delays and lock waits happen inside the calls, so are part of their time */
+        uint64_t waiting = stats->delay_ns + stats->lock_wait_ns;
+
+        fprintf(out, "%.1f us in calls: %.1f us in %llu pull delays, %.1f us waiting for the lock,"
+                " %.1f us working\n", total_ns / 1e3, stats->delay_ns / 1e3,
+                (unsigned long long)stats->delays, stats->lock_wait_ns / 1e3,
+                (total_ns > waiting ? total_ns - waiting : 0) / 1e3);
+    }
+}
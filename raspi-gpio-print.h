@@ -0,0 +1,34 @@
+/*
+  raspi-gpio output formatting.
+*/
+
+#ifndef RASPI_GPIO_PRINT_H
+#define RASPI_GPIO_PRINT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "raspigpio.h"
+
+enum out_format
+{
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_CSV,
+    FORMAT_BIN,
+};
+
+void print_gpio_alts_info(FILE *out, struct gpio_chip *chip, int gpio);
+void print_raw_gpio_regs(FILE *out, const struct gpio_snapshot *snap);
+int gpio_get(FILE *out, const struct gpio_snapshot *snap, unsigned int gpio);
+void print_gpio_state(FILE *out, const struct gpio_snapshot *snap, const uint32_t *gpiomask);
+
+/* The same in any enum out_format; all but text are written in one go */
+void format_gpio_state(FILE *out, int format, const struct gpio_snapshot *snap,
+                       const uint32_t *gpiomask);
+void format_gpio_funcs(FILE *out, int format, struct gpio_chip *chip, const uint32_t *gpiomask);
+void format_alt_find(FILE *out, int format, struct gpio_chip *chip, const char *name);
+void format_raw_regs(FILE *out, int format, const struct gpio_snapshot *snap);
+void format_stats(FILE *out, int format, struct gpio_chip *chip, const struct gpio_stats *stats);
+
+#endif
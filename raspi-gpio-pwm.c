@@ -0,0 +1,259 @@
+/*
+  Software PWM on any number of output GPIOs from a single thread.
+
+  Each channel is a set of pins sharing a frequency and duty cycle. The
+  channels' next edges are kept in a min-heap; at each edge time every
+  channel due within PWM_MERGE_NS is popped, its transition added to one
+  set of per-bank GPSET/GPCLR masks, and the masks written together. A
+  channel changes at most once per write, so its pins are never in both
+  masks; after a late wakeup it takes the level it should have by then,
+  skipping whole missed periods rather than replaying each edge. The
+  cost per edge time is a heap operation per channel due plus a fixed two
+  stores per bank, whatever the number of pins, and channels at the same
+  frequency share their edges entirely.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "raspigpio.h"
+#include "raspi-gpio-clock.h"
+#include "raspi-gpio-pwm.h"
+
+#define PWM_SPIN_NS  50000  /* Spin, rather than sleep, this close to an edge */
+#define PWM_MERGE_NS 1000   /* Edges this close together are written at once */
+#define PWM_MIN_NS   (2 * PWM_MERGE_NS) /* Shortest high or low time */
+
+struct pwm_channel
+{
+    uint32_t mask[GPIO_MAX_BANKS];
+    uint64_t period_ns;
+    uint64_t high_ns;
+    uint64_t next_ns;           /* Time of the next edge, from the start */
+    uint64_t write;             /* The write it was last rescheduled for */
+    int high;                   /* Level the pins are driving now */
+};
+
+static volatile sig_atomic_t pwm_stop;
+
+static void pwm_signal(int sig)
+{
+    pwm_stop = 1;
+}
+
+/* A binary min-heap of channel indices ordered by next_ns */
+static void pwm_heap_down(const struct pwm_channel *ch, int *heap, int n, int i)
+{
+    while (1)
+    {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        int tmp;
+
+        if (l < n && ch[heap[l]].next_ns < ch[heap[min]].next_ns)
+            min = l;
+        if (r < n && ch[heap[r]].next_ns < ch[heap[min]].next_ns)
+            min = r;
+        if (min == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/*
+  Parses "<GPIO>:<frequency Hz>:<duty %>" into ch. Returns 0 on success,
+  else reports the problem and returns 1.
+*/
+static int pwm_parse(struct gpio_chip *chip, const char *spec, struct pwm_channel *ch)
+{
+    char pins[256];
+    double freq, duty;
+    const char *p;
+    int len;
+
+    memset(ch, 0, sizeof(*ch));
+    if (sscanf(spec, "%255[^:]:%lf:%lf%n", pins, &freq, &duty, &len) != 3 || spec[len])
+    {
+        printf("Expected <GPIO>:<frequency>:<duty> not \"%s\"\n", spec);
+        return 1;
+    }
+    if ((p = gpio_parse_pins(chip, pins, ch->mask)) != NULL)
+    {
+        printf("Unknown GPIO \"%s\"\n", p);
+        return 1;
+    }
+    if (freq <= 0 || freq > 1e6 || duty < 0 || duty > 100)
+    {
+        printf("Frequency or duty out of range in \"%s\"\n", spec);
+        return 1;
+    }
+
+    ch->period_ns = 1e9 / freq + 0.5;
+    ch->high_ns = ch->period_ns * duty / 100 + 0.5;
+
+    /* Shorter pulses would fall within one merged write, with both edges in it */
+    if ((ch->high_ns && ch->high_ns < PWM_MIN_NS) ||
+        (ch->high_ns < ch->period_ns && ch->period_ns - ch->high_ns < PWM_MIN_NS))
+    {
+        printf("High or low time under %d ns in \"%s\"\n", PWM_MIN_NS, spec);
+        return 1;
+    }
+    return 0;
+}
+
+int run_pwm(struct gpio_chip *chip, int nspecs, char *specs[], double seconds)
+{
+    uint32_t set[GPIO_MAX_BANKS] = { 0 }, clr[GPIO_MAX_BANKS] = { 0 };
+    uint32_t used[GPIO_MAX_BANKS] = { 0 };
+    struct gpio_snapshot snap;
+    struct pwm_channel *ch;
+    uint64_t writes = 0, edges = 0;
+    uint64_t err_total = 0, err_max = 0;
+    uint64_t start, end, now;
+    int *heap;
+    int gpio;
+    int bank;
+    int n = 0;
+    int i;
+
+    ch = calloc(nspecs, sizeof(*ch));
+    heap = calloc(nspecs, sizeof(*heap));
+    if (!ch || !heap)
+    {
+        printf("Out of memory\n");
+        goto fail;
+    }
+
+    gpio_snapshot_take(chip, &snap);
+    for (i = 0; i < nspecs; i++)
+    {
+        if (pwm_parse(chip, specs[i], &ch[i]))
+            goto fail;
+
+        gpio_mask_for_each(gpio, ch[i].mask, GPIO_MAX_BANKS)
+        {
+            if (gpio_mask_test(used, gpio))
+            {
+                printf("GPIO %d is in more than one channel\n", gpio);
+                goto fail;
+            }
+            if (gpio_snapshot_fsel(&snap, gpio) != FUNC_OP)
+            {
+                printf("Can't drive GPIO %d, not an output\n", gpio);
+                goto fail;
+            }
+            gpio_mask_add(used, gpio);
+        }
+
+        /* Every channel starts high together; 0% and 100% never change */
+        ch[i].high = ch[i].high_ns != 0;
+        if (ch[i].high_ns && ch[i].high_ns < ch[i].period_ns)
+        {
+            ch[i].next_ns = ch[i].high_ns;
+            heap[n++] = i;
+        }
+        for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+        {
+            if (ch[i].high)
+                set[bank] |= ch[i].mask[bank];
+            else
+                clr[bank] |= ch[i].mask[bank];
+        }
+    }
+
+    for (i = n / 2 - 1; i >= 0; i--)
+        pwm_heap_down(ch, heap, n, i);
+
+    signal(SIGINT, pwm_signal);
+    signal(SIGTERM, pwm_signal);
+    mlockall(MCL_CURRENT | MCL_FUTURE);
+
+    start = clock_ns(CLOCK_MONOTONIC);
+    end = seconds > 0 ? start + (uint64_t)(seconds * 1e9) : UINT64_MAX;
+    gpio_write_levels(chip, set, clr);
+    writes++;
+
+    while (n && !pwm_stop)
+    {
+        uint64_t due = ch[heap[0]].next_ns;
+        uint64_t late;
+
+        if (start + due >= end)
+            break;
+        now = clock_wait_until(start + due, PWM_SPIN_NS);
+
+        memset(set, 0, sizeof(set));
+        memset(clr, 0, sizeof(clr));
+
+        /*
+          Gather every edge due now (or about to be), once per channel,
+          rescheduling each from where in its period it has got to. Periods
+          start high at multiples of period_ns from the start.
+        */
+        while (ch[heap[0]].next_ns <= now - start + PWM_MERGE_NS && ch[heap[0]].write != writes)
+        {
+            struct pwm_channel *c = &ch[heap[0]];
+            uint64_t t = c->next_ns > now - start ? c->next_ns : now - start;
+            uint64_t phase = t % c->period_ns;
+            int high = phase < c->high_ns;
+
+            if (high != c->high)
+            {
+                c->high = high;
+                for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+                {
+                    if (high)
+                        set[bank] |= c->mask[bank];
+                    else
+                        clr[bank] |= c->mask[bank];
+                }
+                edges++;
+            }
+            c->next_ns = t - phase + (high ? c->high_ns : c->period_ns);
+            c->write = writes;
+            pwm_heap_down(ch, heap, n, 0);
+        }
+
+        gpio_write_levels(chip, set, clr);
+        writes++;
+
+        late = now - (start + due);
+        err_total += late;
+        if (late > err_max)
+            err_max = late;
+    }
+
+    /* With only 0% and 100% channels there is nothing to do but wait */
+    while (!n && !pwm_stop && clock_ns(CLOCK_MONOTONIC) < end)
+    {
+        struct timespec idle = { 0, 10000000 };
+        nanosleep(&idle, NULL);
+    }
+
+    /* Leave every pin low */
+    gpio_write_levels(chip, NULL, used);
+    now = clock_ns(CLOCK_MONOTONIC);
+    munlockall();
+
+    printf("Ran %d channels for %.3f s: %llu edges in %llu writes, "
+           "timing error mean %llu ns, max %llu ns\n",
+           nspecs, (now - start) / 1e9, (unsigned long long)edges,
+           (unsigned long long)writes,
+           (unsigned long long)(writes > 1 ? err_total / (writes - 1) : 0),
+           (unsigned long long)err_max);
+
+    free(heap);
+    free(ch);
+    return 0;
+
+fail:
+    free(heap);
+    free(ch);
+    return 1;
+}
@@ -0,0 +1,12 @@
+/*
+  raspi-gpio software PWM.
+*/
+
+#ifndef RASPI_GPIO_PWM_H
+#define RASPI_GPIO_PWM_H
+
+#include "raspigpio.h"
+
+int run_pwm(struct gpio_chip *chip, int nspecs, char *specs[], double seconds);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+  Saving pin state to a file, and comparing or reconciling the pins with it.
+
+  A state file is a struct state_header followed by one struct
+  gpio_pin_record per pin, the same records --format=bin get writes. Pulls
+  can only be read back on chips with GPPUPPDN registers; on the bcm2835
+  they are saved as unknown and left alone by diff and restore.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "raspigpio.h"
+#include "raspi-gpio-state.h"
+
+#define STATE_MAGIC   "RGPIOSAV"
+#define STATE_VERSION 1
+
+struct state_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;         /* Records following */
+    char chip[16];
+};
+
+int run_save(struct gpio_chip *chip, const char *path)
+{
+    struct gpio_pin_record rec;
+    struct gpio_snapshot snap;
+    struct state_header hdr;
+    unsigned int gpio;
+    FILE *out;
+    int err = 0;
+
+    if ((out = fopen(path, "wb")) == NULL)
+    {
+        printf("Can't open '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+    hdr.version = STATE_VERSION;
+    hdr.count = gpio_chip_gpio_count(chip);
+    strncpy(hdr.chip, gpio_chip_name(chip), sizeof(hdr.chip) - 1);
+
+    gpio_snapshot_take(chip, &snap);
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+        err = errno;
+    for (gpio = 0; !err && gpio < hdr.count; gpio++)
+    {
+        gpio_snapshot_record(&snap, gpio, &rec);
+        if (fwrite(&rec, sizeof(rec), 1, out) != 1)
+            err = errno;
+    }
+
+    if (fclose(out) != 0 && !err)
+        err = errno;
+    if (err)
+    {
+        printf("Error writing '%s': %s\n", path, strerror(err));
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Reads a state file saved from the same kind of chip, returning the count or -1 */
+static int state_load(struct gpio_chip *chip, const char *path, struct gpio_pin_record **recs)
+{
+    struct state_header hdr;
+    FILE *in;
+
+    if ((in = fopen(path, "rb")) == NULL)
+    {
+        printf("Can't open '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+        memcmp(hdr.magic, STATE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != STATE_VERSION || hdr.count > 32 * GPIO_MAX_BANKS)
+    {
+        printf("'%s' is not a raspi-gpio state file\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    hdr.chip[sizeof(hdr.chip) - 1] = '\0';
+    if (strcmp(hdr.chip, gpio_chip_name(chip)) != 0)
+    {
+        printf("'%s' was saved from a %s, not a %s\n", path, hdr.chip, gpio_chip_name(chip));
+        fclose(in);
+        return -1;
+    }
+
+    *recs = calloc(hdr.count, sizeof(**recs));
+    if (!*recs && hdr.count)
+    {
+        printf("Out of memory\n");
+        fclose(in);
+        return -1;
+    }
+    if (fread(*recs, sizeof(**recs), hdr.count, in) != hdr.count)
+    {
+        printf("'%s' is truncated\n", path);
+        free(*recs);
+        fclose(in);
+        return -1;
+    }
+
+    fclose(in);
+    return hdr.count;
+}
+
+/* Prints the fields in which each pin differs; returns 1 if any do */
+int run_diff(struct gpio_chip *chip, const char *path)
+{
+    struct gpio_pin_record *recs;
+    struct gpio_snapshot snap;
+    int differ = 0;
+    int count;
+    int i;
+
+    if ((count = state_load(chip, path, &recs)) < 0)
+        return 2;
+
+    gpio_snapshot_take(chip, &snap);
+    for (i = 0; i < count; i++)
+    {
+        const struct gpio_pin_record *want = &recs[i];
+        struct gpio_pin_record have;
+        int diff;
+
+        if (want->gpio >= gpio_chip_gpio_count(chip))
+            continue;
+        gpio_snapshot_record(&snap, want->gpio, &have);
+        if ((diff = gpio_record_diff(want, &have)) == 0)
+            continue;
+
+        printf("GPIO %d:", want->gpio);
+        if (diff & GPIO_DIFF_FSEL)
+            printf(" func=%s->%s", gpio_fsel_to_namestr(chip, want->gpio, want->fsel),
+                   gpio_fsel_to_namestr(chip, want->gpio, have.fsel));
+        if (diff & GPIO_DIFF_LEVEL)
+            printf(" level=%d->%d", want->level, have.level);
+        if (diff & GPIO_DIFF_PULL)
+            printf(" pull=%s->%s", gpio_pull_name(want->pull), gpio_pull_name(have.pull));
+        if (diff & GPIO_DIFF_EVENTS)
+            printf(" detect=0x%02x->0x%02x", want->events, have.events);
+        printf("\n");
+        differ = 1;
+    }
+
+    free(recs);
+    return differ;
+}
+
+int run_restore(struct gpio_chip *chip, const char *path)
+{
+    struct gpio_pin_record *recs;
+    struct gpio_snapshot snap;
+    struct gpio_plan plan;
+    int count;
+    int ret = 0;
+
+    if ((count = state_load(chip, path, &recs)) < 0)
+        return 1;
+
+    /* The registers mustn't change between the comparison and the update */
+    gpio_lock(chip);
+    gpio_snapshot_take(chip, &snap);
+    gpio_plan_init(&plan);
+    if (gpio_plan_restore(chip, &plan, &snap, recs, count) && gpio_plan_commit(chip, &plan))
+    {
+        printf("%s\n", gpio_last_error());
+        ret = 1;
+    }
+    gpio_unlock(chip);
+
+    free(recs);
+    return ret;
+}
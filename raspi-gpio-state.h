@@ -0,0 +1,14 @@
+/*
+  raspi-gpio pin state save, diff and restore.
+*/
+
+#ifndef RASPI_GPIO_STATE_H
+#define RASPI_GPIO_STATE_H
+
+#include "raspigpio.h"
+
+int run_save(struct gpio_chip *chip, const char *path);
+int run_diff(struct gpio_chip *chip, const char *path);
+int run_restore(struct gpio_chip *chip, const char *path);
+
+#endif
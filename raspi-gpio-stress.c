@@ -0,0 +1,246 @@
+/*
+  Stress test for concurrent updates: a number of writer processes share
+  one simulated register image, each switching its own pins between input
+  and output, with the pins of all the writers interleaved so that every
+  GPFSEL register is shared. After each update a writer checks that its
+  other pins still hold what it last wrote; a pin that doesn't has lost
+  an update to another writer's read-modify-write, and is counted and
+  set again.
+
+  Each mode is run in turn: without protection, with write-then-verify
+  only, with the lock only, and with both (see gpio_chip_set_safe). One
+  tab-separated line per mode gives the lost updates, the pins wrong at
+  the end, the contention counters summed over the writers and the total
+  updates per second.
+
+  Verify alone narrows the window but can't close it: another writer's
+  read-modify-write may still land after the read back has passed, so
+  updates can be lost, and pins left wrong at the end, in that mode too.
+  Only the modes with the lock must lose nothing, and any loss in them
+  makes the exit status 1. If no updates are lost without protection
+  either, the writers never met and the run proves nothing; the exit
+  status is then 2, and more writers or updates are needed.
+
+  Use: raspi-gpio-stress [-c bcm2835|bcm2711] [-w writers] [-n updates] [-i image]
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "raspigpio.h"
+
+#define STRESS_MAX_WRITERS 16
+#define STRESS_PINS        30    /* GPFSEL0-2 */
+
+struct stress_mode
+{
+    const char *name;
+    int lock;
+    unsigned int retries;
+};
+
+static const struct stress_mode modes[] =
+{
+    { "none",        0, 0 },
+    { "verify",      0, 3 },
+    { "lock",        1, 0 },
+    { "lock+verify", 1, 3 },
+};
+
+/* Shared with the writers */
+struct stress_result
+{
+    uint64_t lost;
+    struct gpio_contention contention;
+    int8_t want[STRESS_PINS];    /* The function each pin was last set to */
+};
+
+static uint64_t stress_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int stress_writer(const char *chip_name, const char *image, const char *lock_file,
+                         const struct stress_mode *mode, unsigned int id, unsigned int writers,
+                         unsigned int updates, struct stress_result *res)
+{
+    struct gpio_chip *chip = gpio_chip_new(chip_name);
+    unsigned int i;
+    int gpio;
+
+    if (!chip || gpio_chip_map_sim(chip, image) ||
+        gpio_chip_set_safe(chip, mode->lock ? lock_file : NULL, mode->retries))
+    {
+        printf("%s\n", gpio_last_error());
+        return 1;
+    }
+
+    for (i = 0; i < updates; i++)
+    {
+        unsigned int pin = id + (i % (STRESS_PINS / writers)) * writers;
+
+        res->want[pin] = res->want[pin] == FUNC_OP ? FUNC_IP : FUNC_OP;
+        gpio_set_fsel(chip, pin, res->want[pin]);
+
+        for (gpio = id; gpio < STRESS_PINS; gpio += writers)
+        {
+            if (gpio_get_fsel(chip, gpio) != res->want[gpio])
+            {
+                res->lost++;
+                gpio_set_fsel(chip, gpio, res->want[gpio]);
+            }
+        }
+    }
+
+    gpio_get_contention(chip, &res->contention);
+    gpio_close(chip);
+    return 0;
+}
+
+/* Runs one mode, setting errors to the lost updates plus the pins wrong at the end */
+static int stress_mode(const char *chip_name, const char *image, const struct stress_mode *mode,
+                       unsigned int writers, unsigned int updates, uint64_t *errors)
+{
+    struct stress_result *res;
+    struct gpio_contention total;
+    struct gpio_chip *chip;
+    char lock_file[256];
+    uint64_t lost = 0;
+    uint64_t start, ns;
+    unsigned int w;
+    int wrong = 0;
+    int failed = 0;
+    int gpio;
+
+    res = mmap(NULL, writers * sizeof(*res), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (res == MAP_FAILED)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+    memset(res, 0, writers * sizeof(*res));
+    memset(&total, 0, sizeof(total));
+    snprintf(lock_file, sizeof(lock_file), "%s.lock", image);
+
+    /* A fresh image with every pin an input */
+    unlink(image);
+    chip = gpio_chip_new(chip_name);
+    if (!chip || gpio_chip_map_sim(chip, image))
+    {
+        printf("%s\n", gpio_last_error());
+        return 1;
+    }
+
+    start = stress_now_ns();
+    for (w = 0; w < writers; w++)
+    {
+        if (fork() == 0)
+            _exit(stress_writer(chip_name, image, lock_file, mode, w, writers, updates, &res[w]));
+    }
+    for (w = 0; w < writers; w++)
+    {
+        int status;
+
+        wait(&status);
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+    ns = stress_now_ns() - start;
+
+    for (gpio = 0; gpio < STRESS_PINS; gpio++)
+        wrong += gpio_get_fsel(chip, gpio) != res[gpio % writers].want[gpio];
+    for (w = 0; w < writers; w++)
+    {
+        lost += res[w].lost;
+        total.lock_waits += res[w].contention.lock_waits;
+        total.retries += res[w].contention.retries;
+        total.failures += res[w].contention.failures;
+    }
+
+    printf("%s\t%s\t%u\t%u\t%llu\t%d\t%llu\t%llu\t%llu\t%.0f\n", mode->name, chip_name,
+           writers, updates, (unsigned long long)lost, wrong,
+           (unsigned long long)total.lock_waits, (unsigned long long)total.retries,
+           (unsigned long long)total.failures, (double)writers * updates * 1e9 / ns);
+
+    gpio_close(chip);
+    munmap(res, writers * sizeof(*res));
+    unlink(lock_file);
+    *errors = lost + wrong;
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *chip_name = "bcm2711";
+    const char *image = "/dev/shm/raspi-gpio-stress";
+    unsigned int writers = 4;
+    unsigned int updates = 100000;
+    uint64_t errors;
+    int unproven = 0;
+    int failed = 0;
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:w:n:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            chip_name = optarg;
+            break;
+        case 'w':
+            writers = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            updates = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            image = optarg;
+            break;
+        default:
+            printf("Use: %s [-c bcm2835|bcm2711] [-w writers] [-n updates] [-i image]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+
+    if (writers < 1 || writers > STRESS_MAX_WRITERS)
+    {
+        printf("Between 1 and %d writers\n", STRESS_MAX_WRITERS);
+        return 1;
+    }
+
+    printf("# mode\tchip\twriters\tupdates\tlost\twrong\tlock_waits\tretries\tfailures\tupdates_per_s\n");
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+        fflush(stdout);
+        if (stress_mode(chip_name, image, &modes[i], writers, updates, &errors))
+            return 1;
+        if (modes[i].lock && errors)
+        {
+            printf("# %s lost updates\n", modes[i].name);
+            failed = 1;
+        }
+        if (!modes[i].lock && !modes[i].retries && !errors)
+            unproven = 1;
+    }
+
+    unlink(image);
+    if (failed)
+        return 1;
+    if (unproven)
+    {
+        printf("# No updates lost without protection - try more writers or updates\n");
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+  Replay of the register traces recorded with --trace (see
+  gpio_chip_set_trace in raspigpio.h).
+
+  The writes are issued again in the order recorded, each at its time
+  from the first record, divided by the speed-up given (0 for no waiting
+  at all), against absolute deadlines as play does. With checking on the
+  reads are made too, at their times, and any value differing from the
+  one recorded is reported, so that a replay onto a register image taken
+  from the same starting state reproduces the trace byte for byte. A
+  trace can also just be listed.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "raspigpio.h"
+#include "raspi-gpio-clock.h"
+#include "raspi-gpio-trace.h"
+
+#define REPLAY_SPIN_NS     100000  /* Spin, rather than sleep, this close to a deadline */
+#define REPLAY_MAX_REPORTS 10      /* Mismatched reads reported individually */
+
+/* Maps a trace file read-only, returning NULL (having said why) if it isn't one */
+static struct gpio_trace_header *trace_map(const char *path, size_t *size)
+{
+    struct gpio_trace_header *trace;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0)
+    {
+        printf("Can't open '%s'\n", path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    trace = *size >= sizeof(*trace) ?
+            mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (trace == MAP_FAILED)
+    {
+        printf("'%s' is not a trace\n", path);
+        return NULL;
+    }
+    if (trace->magic != GPIO_TRACE_MAGIC || trace->version != GPIO_TRACE_VERSION ||
+        !trace->capacity ||
+        trace->capacity > (SIZE_MAX - sizeof(*trace)) / sizeof(struct gpio_trace_record) ||
+        *size != sizeof(*trace) + trace->capacity * sizeof(struct gpio_trace_record))
+    {
+        printf("'%s' is not a trace\n", path);
+        munmap(trace, *size);
+        return NULL;
+    }
+
+    return trace;
+}
+
+/*
+  Time from the first record to rec. Processes appending to one trace can
+  take their timestamps a little out of order, so this never goes back.
+*/
+static uint64_t trace_elapsed(const struct gpio_trace_record *rec, uint64_t first_ns,
+                              uint64_t *last)
+{
+    if (rec->ns > first_ns && rec->ns - first_ns > *last)
+        *last = rec->ns - first_ns;
+    return *last;
+}
+
+static void trace_print(const struct gpio_trace_record *rec, uint64_t elapsed)
+{
+    const char *name = gpio_reg_name(rec->offset / 4);
+
+    printf("%14.6f %-5s 0x%02x %-9s 0x%08x", elapsed / 1e9,
+           rec->op == GPIO_TRACE_WRITE ? "write" : "read", rec->offset, name ? name : "",
+           rec->value);
+    if (rec->op == GPIO_TRACE_WRITE && rec->mask != ~0u)
+        printf(" mask 0x%08x", rec->mask);
+    printf("\n");
+}
+
+int run_replay(struct gpio_chip *chip, const char *path, double speed, int check, int list)
+{
+    struct gpio_trace_header *trace;
+    struct gpio_trace_record *recs;
+    uint64_t valid = 0;          /* Registers of this chip, by number */
+    uint64_t writes = 0, reads = 0, mismatches = 0;
+    uint64_t late_sum = 0, late_max = 0;
+    uint64_t first, n, start = 0, end;
+    uint64_t first_ns, elapsed = 0;
+    size_t size;
+    char name[sizeof(trace->chip) + 1];
+    int reg;
+
+    if ((trace = trace_map(path, &size)) == NULL)
+        return 1;
+    recs = gpio_trace_records(trace);
+    memcpy(name, trace->chip, sizeof(trace->chip));
+    name[sizeof(trace->chip)] = '\0';
+
+    first = trace->count > trace->capacity ? trace->count - trace->capacity : 0;
+    first_ns = recs[first % trace->capacity].ns;
+    if (first)
+        printf("The oldest %llu records were overwritten - replaying the last %llu\n",
+               (unsigned long long)first, (unsigned long long)trace->capacity);
+
+    if (list)
+    {
+        printf("# %s trace of %llu records\n", name, (unsigned long long)(trace->count - first));
+        for (n = first; n < trace->count; n++)
+            trace_print(&recs[n % trace->capacity],
+                        trace_elapsed(&recs[n % trace->capacity], first_ns, &elapsed));
+        munmap(trace, size);
+        return 0;
+    }
+
+    if (strcmp(name, gpio_chip_name(chip)) != 0)
+    {
+        printf("Trace is of a %s, not a %s\n", name, gpio_chip_name(chip));
+        munmap(trace, size);
+        return 1;
+    }
+    for (reg = gpio_next_reg(chip, -1); reg >= 0; reg = gpio_next_reg(chip, reg))
+        valid |= (uint64_t)1 << reg;
+
+    for (n = first; n < trace->count; n++)
+    {
+        const struct gpio_trace_record *rec = &recs[n % trace->capacity];
+        uint64_t now;
+        uint32_t value;
+
+        reg = rec->offset / 4;
+        if ((rec->offset & 3) || reg >= 64 || !(valid & ((uint64_t)1 << reg)))
+        {
+            printf("Record %llu: no register at 0x%02x\n", (unsigned long long)n, rec->offset);
+            munmap(trace, size);
+            return 1;
+        }
+        if (rec->op != GPIO_TRACE_WRITE && !check)
+            continue;
+
+        if (!start)
+            start = clock_ns(CLOCK_MONOTONIC) + (speed > 0 ? REPLAY_SPIN_NS : 0);
+        if (speed > 0)
+        {
+            uint64_t deadline = start + trace_elapsed(rec, first_ns, &elapsed) / speed;
+
+            now = clock_wait_until(deadline, REPLAY_SPIN_NS);
+            late_sum += now - deadline;
+            if (now - deadline > late_max)
+                late_max = now - deadline;
+        }
+
+        if (rec->op == GPIO_TRACE_WRITE)
+        {
+            gpio_write_reg(chip, rec->offset, rec->value);
+            writes++;
+            continue;
+        }
+
+        reads++;
+        if ((value = gpio_read_reg(chip, rec->offset)) != rec->value)
+        {
+            if (mismatches++ < REPLAY_MAX_REPORTS)
+                printf("Record %llu: %s read 0x%08x, traced 0x%08x\n", (unsigned long long)n,
+                       gpio_reg_name(reg) ? gpio_reg_name(reg) : "register", value, rec->value);
+        }
+    }
+    end = clock_ns(CLOCK_MONOTONIC);
+
+    printf("Replayed %llu writes", (unsigned long long)writes);
+    if (check)
+        printf(" and checked %llu reads (%llu differing)", (unsigned long long)reads,
+               (unsigned long long)mismatches);
+    printf(" in %.6f s", start ? (end - start) / 1e9 : 0.0);
+    if (speed > 0 && writes + reads)
+        printf(": timing error mean %llu ns, max %llu ns",
+               (unsigned long long)(late_sum / (writes + reads)), (unsigned long long)late_max);
+    printf("\n");
+
+    munmap(trace, size);
+    return mismatches != 0;
+}
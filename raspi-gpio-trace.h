@@ -0,0 +1,12 @@
+/*
+  raspi-gpio register trace replay.
+*/
+
+#ifndef RASPI_GPIO_TRACE_H
+#define RASPI_GPIO_TRACE_H
+
+#include "raspigpio.h"
+
+int run_replay(struct gpio_chip *chip, const char *path, double speed, int check, int list);
+
+#endif
@@ -4,392 +4,126 @@
   Author: James Adams
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
-#include <sys/mman.h>
-#include <time.h>
-
-#define GPIO_BASE_OFFSET 0x00200000
-
-#define DRIVE_UNSET -1
-#define DRIVE_LOW    0
-#define DRIVE_HIGH   1
-
-#define PULL_UNSET  -1
-#define PULL_NONE    0
-#define PULL_DOWN    1
-#define PULL_UP      2
-
-#define FUNC_UNSET  -1
-#define FUNC_IP      0
-#define FUNC_OP      1
-#define FUNC_ALT(x)  (2 + (x))
-#define FUNC_A0      FUNC_ALT(0)
-#define FUNC_A1      FUNC_ALT(1)
-#define FUNC_A2      FUNC_ALT(2)
-#define FUNC_A3      FUNC_ALT(3)
-#define FUNC_A4      FUNC_ALT(4)
-#define FUNC_A5      FUNC_ALT(5)
-
-/* 2835 register offsets */
-#define GPFSEL0      0
-#define GPFSEL1      1
-#define GPFSEL2      2
-#define GPFSEL3      3
-#define GPFSEL4      4
-#define GPFSEL5      5
-#define GPSET0       7
-#define GPSET1       8
-#define GPCLR0       10
-#define GPCLR1       11
-#define GPLEV0       13
-#define GPLEV1       14
-#define GPPUD        37
-#define GPPUDCLK0    38
-#define GPPUDCLK1    39
-
-/* 2711 has a different mechanism for pin pull-up/down/enable  */
-#define GPPUPPDN0    57        /* Pin pull-up/down for pins 15:0  */
-#define GPPUPPDN1    58        /* Pin pull-up/down for pins 31:16 */
-#define GPPUPPDN2    59        /* Pin pull-up/down for pins 47:32 */
-#define GPPUPPDN3    60        /* Pin pull-up/down for pins 57:48 */
-
-struct gpio_chip
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "raspigpio.h"
+#include "raspi-gpio-print.h"
+#include "raspi-gpio-capture.h"
+#include "raspi-gpio-measure.h"
+#include "raspi-gpio-bus.h"
+#include "raspi-gpio-trace.h"
+#include "raspi-gpio-play.h"
+#include "raspi-gpio-pwm.h"
+#include "raspi-gpio-state.h"
+#include "raspi-gpio-clock.h"
+
+static struct gpio_chip *chip;  /* The chip the command is for */
+
+/* Chip 0 is the SoC (or --sim); chip <n> is added_chips[n - 1] */
+#define MAX_ADDED_CHIPS 8
+
+struct added_chip
 {
     const char *name;
-    uint32_t reg_base;
-    uint32_t reg_size;
-    unsigned int gpio_count;
-    unsigned int fsel_count;
-    const char *info_header;
-    const char **alt_names;
-    const int *default_pulls;
-
-    int (*get_level)(struct gpio_chip *chip, unsigned int gpio);
-    int (*get_fsel)(struct gpio_chip *chip, unsigned int gpio);
-    int (*get_pull)(struct gpio_chip *chip, unsigned int gpio);
-    int (*set_level)(struct gpio_chip *chip, unsigned int gpio, int level);
-    int (*set_fsel)(struct gpio_chip *chip, unsigned int gpio, int fsel);
-    int (*set_pull)(struct gpio_chip *chip, unsigned int gpio, int pull);
-    int (*next_reg)(int reg);
-
-    volatile uint32_t *base;
-};
-
-static int bcm2835_get_level(struct gpio_chip *chip, unsigned int gpio);
-static int bcm2835_get_fsel(struct gpio_chip *chip, unsigned int gpio);
-static int bcm2835_get_pull(struct gpio_chip *chip, unsigned int gpio);
-static int bcm2835_set_level(struct gpio_chip *chip, unsigned int gpio, int level);
-static int bcm2835_set_fsel(struct gpio_chip *chip, unsigned int gpio, int fsel);
-static int bcm2835_set_pull(struct gpio_chip *chip, unsigned int gpio, int pull);
-static int bcm2835_next_reg(int reg);
-
-static int bcm2711_get_pull(struct gpio_chip *chip, unsigned int gpio);
-static int bcm2711_set_pull(struct gpio_chip *chip, unsigned int gpio, int pull);
-static int bcm2711_next_reg(int reg);
-
-static const char *gpio_alt_names_2835[54*6] =
-{
-    "SDA0"      , "SA5"        , "PCLK"      , "AVEOUT_VCLK"   , "AVEIN_VCLK" , 0           ,
-    "SCL0"      , "SA4"        , "DE"        , "AVEOUT_DSYNC"  , "AVEIN_DSYNC", 0           ,
-    "SDA1"      , "SA3"        , "LCD_VSYNC" , "AVEOUT_VSYNC"  , "AVEIN_VSYNC", 0           ,
-    "SCL1"      , "SA2"        , "LCD_HSYNC" , "AVEOUT_HSYNC"  , "AVEIN_HSYNC", 0           ,
-    "GPCLK0"    , "SA1"        , "DPI_D0"    , "AVEOUT_VID0"   , "AVEIN_VID0" , "ARM_TDI"   ,
-    "GPCLK1"    , "SA0"        , "DPI_D1"    , "AVEOUT_VID1"   , "AVEIN_VID1" , "ARM_TDO"   ,
-    "GPCLK2"    , "SOE_N_SE"   , "DPI_D2"    , "AVEOUT_VID2"   , "AVEIN_VID2" , "ARM_RTCK"  ,
-    "SPI0_CE1_N", "SWE_N_SRW_N", "DPI_D3"    , "AVEOUT_VID3"   , "AVEIN_VID3" , 0           ,
-    "SPI0_CE0_N", "SD0"        , "DPI_D4"    , "AVEOUT_VID4"   , "AVEIN_VID4" , 0           ,
-    "SPI0_MISO" , "SD1"        , "DPI_D5"    , "AVEOUT_VID5"   , "AVEIN_VID5" , 0           ,
-    "SPI0_MOSI" , "SD2"        , "DPI_D6"    , "AVEOUT_VID6"   , "AVEIN_VID6" , 0           ,
-    "SPI0_SCLK" , "SD3"        , "DPI_D7"    , "AVEOUT_VID7"   , "AVEIN_VID7" , 0           ,
-    "PWM0"      , "SD4"        , "DPI_D8"    , "AVEOUT_VID8"   , "AVEIN_VID8" , "ARM_TMS"   ,
-    "PWM1"      , "SD5"        , "DPI_D9"    , "AVEOUT_VID9"   , "AVEIN_VID9" , "ARM_TCK"   ,
-    "TXD0"      , "SD6"        , "DPI_D10"   , "AVEOUT_VID10"  , "AVEIN_VID10", "TXD1"      ,
-    "RXD0"      , "SD7"        , "DPI_D11"   , "AVEOUT_VID11"  , "AVEIN_VID11", "RXD1"      ,
-    "FL0"       , "SD8"        , "DPI_D12"   , "CTS0"          , "SPI1_CE2_N" , "CTS1"      ,
-    "FL1"       , "SD9"        , "DPI_D13"   , "RTS0"          , "SPI1_CE1_N" , "RTS1"      ,
-    "PCM_CLK"   , "SD10"       , "DPI_D14"   , "I2CSL_SDA_MOSI", "SPI1_CE0_N" , "PWM0"      ,
-    "PCM_FS"    , "SD11"       , "DPI_D15"   , "I2CSL_SCL_SCLK", "SPI1_MISO"  , "PWM1"      ,
-    "PCM_DIN"   , "SD12"       , "DPI_D16"   , "I2CSL_MISO"    , "SPI1_MOSI"  , "GPCLK0"    ,
-    "PCM_DOUT"  , "SD13"       , "DPI_D17"   , "I2CSL_CE_N"    , "SPI1_SCLK"  , "GPCLK1"    ,
-    "SD0_CLK"   , "SD14"       , "DPI_D18"   , "SD1_CLK"       , "ARM_TRST"   , 0           ,
-    "SD0_CMD"   , "SD15"       , "DPI_D19"   , "SD1_CMD"       , "ARM_RTCK"   , 0           ,
-    "SD0_DAT0"  , "SD16"       , "DPI_D20"   , "SD1_DAT0"      , "ARM_TDO"    , 0           ,
-    "SD0_DAT1"  , "SD17"       , "DPI_D21"   , "SD1_DAT1"      , "ARM_TCK"    , 0           ,
-    "SD0_DAT2"  , "TE0"        , "DPI_D22"   , "SD1_DAT2"      , "ARM_TDI"    , 0           ,
-    "SD0_DAT3"  , "TE1"        , "DPI_D23"   , "SD1_DAT3"      , "ARM_TMS"    , 0           ,
-    "SDA0"      , "SA5"        , "PCM_CLK"   , "FL0"           , 0            , 0           ,
-    "SCL0"      , "SA4"        , "PCM_FS"    , "FL1"           , 0            , 0           ,
-    "TE0"       , "SA3"        , "PCM_DIN"   , "CTS0"          , 0            , "CTS1"      ,
-    "FL0"       , "SA2"        , "PCM_DOUT"  , "RTS0"          , 0            , "RTS1"      ,
-    "GPCLK0"    , "SA1"        , "RING_OCLK" , "TXD0"          , 0            , "TXD1"      ,
-    "FL1"       , "SA0"        , "TE1"       , "RXD0"          , 0            , "RXD1"      ,
-    "GPCLK0"    , "SOE_N_SE"   , "TE2"       , "SD1_CLK"       , 0            , 0           ,
-    "SPI0_CE1_N", "SWE_N_SRW_N", 0           , "SD1_CMD"       , 0            , 0           ,
-    "SPI0_CE0_N", "SD0"        , "TXD0"      , "SD1_DAT0"      , 0            , 0           ,
-    "SPI0_MISO" , "SD1"        , "RXD0"      , "SD1_DAT1"      , 0            , 0           ,
-    "SPI0_MOSI" , "SD2"        , "RTS0"      , "SD1_DAT2"      , 0            , 0           ,
-    "SPI0_SCLK" , "SD3"        , "CTS0"      , "SD1_DAT3"      , 0            , 0           ,
-    "PWM0"      , "SD4"        , 0           , "SD1_DAT4"      , "SPI2_MISO"  , "TXD1"      ,
-    "PWM1"      , "SD5"        , "TE0"       , "SD1_DAT5"      , "SPI2_MOSI"  , "RXD1"      ,
-    "GPCLK1"    , "SD6"        , "TE1"       , "SD1_DAT6"      , "SPI2_SCLK"  , "RTS1"      ,
-    "GPCLK2"    , "SD7"        , "TE2"       , "SD1_DAT7"      , "SPI2_CE0_N" , "CTS1"      ,
-    "GPCLK1"    , "SDA0"       , "SDA1"      , "TE0"           , "SPI2_CE1_N" , 0           ,
-    "PWM1"      , "SCL0"       , "SCL1"      , "TE1"           , "SPI2_CE2_N" , 0           ,
-    "SDA0"      , "SDA1"       , "SPI0_CE0_N", 0               , 0            , "SPI2_CE1_N",
-    "SCL0"      , "SCL1"       , "SPI0_MISO" , 0               , 0            , "SPI2_CE0_N",
-    "SD0_CLK"   , "FL0"        , "SPI0_MOSI" , "SD1_CLK"       , "ARM_TRST"   , "SPI2_SCLK" ,
-    "SD0_CMD"   , "GPCLK0"     , "SPI0_SCLK" , "SD1_CMD"       , "ARM_RTCK"   , "SPI2_MOSI" ,
-    "SD0_DAT0"  , "GPCLK1"     , "PCM_CLK"   , "SD1_DAT0"      , "ARM_TDO"    , 0           ,
-    "SD0_DAT1"  , "GPCLK2"     , "PCM_FS"    , "SD1_DAT1"      , "ARM_TCK"    , 0           ,
-    "SD0_DAT2"  , "PWM0"       , "PCM_DIN"   , "SD1_DAT2"      , "ARM_TDI"    , 0           ,
-    "SD0_DAT3"  , "PWM1"       , "PCM_DOUT"  , "SD1_DAT3"      , "ARM_TMS"    , 0
-};
-
-static const char *gpio_alt_names_2711[54*6] =
-{
-    "SDA0"      , "SA5"        , "PCLK"      , "SPI3_CE0_N"    , "TXD2"            , "SDA6"        ,
-    "SCL0"      , "SA4"        , "DE"        , "SPI3_MISO"     , "RXD2"            , "SCL6"        ,
-    "SDA1"      , "SA3"        , "LCD_VSYNC" , "SPI3_MOSI"     , "CTS2"            , "SDA3"        ,
-    "SCL1"      , "SA2"        , "LCD_HSYNC" , "SPI3_SCLK"     , "RTS2"            , "SCL3"        ,
-    "GPCLK0"    , "SA1"        , "DPI_D0"    , "SPI4_CE0_N"    , "TXD3"            , "SDA3"        ,
-    "GPCLK1"    , "SA0"        , "DPI_D1"    , "SPI4_MISO"     , "RXD3"            , "SCL3"        ,
-    "GPCLK2"    , "SOE_N_SE"   , "DPI_D2"    , "SPI4_MOSI"     , "CTS3"            , "SDA4"        ,
-    "SPI0_CE1_N", "SWE_N_SRW_N", "DPI_D3"    , "SPI4_SCLK"     , "RTS3"            , "SCL4"        ,
-    "SPI0_CE0_N", "SD0"        , "DPI_D4"    , "I2CSL_CE_N"    , "TXD4"            , "SDA4"        ,
-    "SPI0_MISO" , "SD1"        , "DPI_D5"    , "I2CSL_SDI_MISO", "RXD4"            , "SCL4"        ,
-    "SPI0_MOSI" , "SD2"        , "DPI_D6"    , "I2CSL_SDA_MOSI", "CTS4"            , "SDA5"        ,
-    "SPI0_SCLK" , "SD3"        , "DPI_D7"    , "I2CSL_SCL_SCLK", "RTS4"            , "SCL5"        ,
-    "PWM0_0"    , "SD4"        , "DPI_D8"    , "SPI5_CE0_N"    , "TXD5"            , "SDA5"        ,
-    "PWM0_1"    , "SD5"        , "DPI_D9"    , "SPI5_MISO"     , "RXD5"            , "SCL5"        ,
-    "TXD0"      , "SD6"        , "DPI_D10"   , "SPI5_MOSI"     , "CTS5"            , "TXD1"        ,
-    "RXD0"      , "SD7"        , "DPI_D11"   , "SPI5_SCLK"     , "RTS5"            , "RXD1"        ,
-    0           , "SD8"        , "DPI_D12"   , "CTS0"          , "SPI1_CE2_N"      , "CTS1"        ,
-    0           , "SD9"        , "DPI_D13"   , "RTS0"          , "SPI1_CE1_N"      , "RTS1"        ,
-    "PCM_CLK"   , "SD10"       , "DPI_D14"   , "SPI6_CE0_N"    , "SPI1_CE0_N"      , "PWM0_0"      ,
-    "PCM_FS"    , "SD11"       , "DPI_D15"   , "SPI6_MISO"     , "SPI1_MISO"       , "PWM0_1"      ,
-    "PCM_DIN"   , "SD12"       , "DPI_D16"   , "SPI6_MOSI"     , "SPI1_MOSI"       , "GPCLK0"      ,
-    "PCM_DOUT"  , "SD13"       , "DPI_D17"   , "SPI6_SCLK"     , "SPI1_SCLK"       , "GPCLK1"      ,
-    "SD0_CLK"   , "SD14"       , "DPI_D18"   , "SD1_CLK"       , "ARM_TRST"        , "SDA6"        ,
-    "SD0_CMD"   , "SD15"       , "DPI_D19"   , "SD1_CMD"       , "ARM_RTCK"        , "SCL6"        ,
-    "SD0_DAT0"  , "SD16"       , "DPI_D20"   , "SD1_DAT0"      , "ARM_TDO"         , "SPI3_CE1_N"  ,
-    "SD0_DAT1"  , "SD17"       , "DPI_D21"   , "SD1_DAT1"      , "ARM_TCK"         , "SPI4_CE1_N"  ,
-    "SD0_DAT2"  , 0            , "DPI_D22"   , "SD1_DAT2"      , "ARM_TDI"         , "SPI5_CE1_N"  ,
-    "SD0_DAT3"  , 0            , "DPI_D23"   , "SD1_DAT3"      , "ARM_TMS"         , "SPI6_CE1_N"  ,
-    "SDA0"      , "SA5"        , "PCM_CLK"   , 0               , "MII_A_RX_ERR"    , "RGMII_MDIO"  ,
-    "SCL0"      , "SA4"        , "PCM_FS"    , 0               , "MII_A_TX_ERR"    , "RGMII_MDC"   ,
-    0           , "SA3"        , "PCM_DIN"   , "CTS0"          , "MII_A_CRS"       , "CTS1"        ,
-    0           , "SA2"        , "PCM_DOUT"  , "RTS0"          , "MII_A_COL"       , "RTS1"        ,
-    "GPCLK0"    , "SA1"        , 0           , "TXD0"          , "SD_CARD_PRES"    , "TXD1"        ,
-    0           , "SA0"        , 0           , "RXD0"          , "SD_CARD_WRPROT"  , "RXD1"        ,
-    "GPCLK0"    , "SOE_N_SE"   , 0           , "SD1_CLK"       , "SD_CARD_LED"     , "RGMII_IRQ"   ,
-    "SPI0_CE1_N", "SWE_N_SRW_N", 0           , "SD1_CMD"       , "RGMII_START_STOP", 0             ,
-    "SPI0_CE0_N", "SD0"        , "TXD0"      , "SD1_DAT0"      , "RGMII_RX_OK"     , "MII_A_RX_ERR",
-    "SPI0_MISO" , "SD1"        , "RXD0"      , "SD1_DAT1"      , "RGMII_MDIO"      , "MII_A_TX_ERR",
-    "SPI0_MOSI" , "SD2"        , "RTS0"      , "SD1_DAT2"      , "RGMII_MDC"       , "MII_A_CRS"   ,
-    "SPI0_SCLK" , "SD3"        , "CTS0"      , "SD1_DAT3"      , "RGMII_IRQ"       , "MII_A_COL"   ,
-    "PWM1_0"    , "SD4"        , 0           , "SD1_DAT4"      , "SPI0_MISO"       , "TXD1"        ,
-    "PWM1_1"    , "SD5"        , 0           , "SD1_DAT5"      , "SPI0_MOSI"       , "RXD1"        ,
-    "GPCLK1"    , "SD6"        , 0           , "SD1_DAT6"      , "SPI0_SCLK"       , "RTS1"        ,
-    "GPCLK2"    , "SD7"        , 0           , "SD1_DAT7"      , "SPI0_CE0_N"      , "CTS1"        ,
-    "GPCLK1"    , "SDA0"       , "SDA1"      , 0               , "SPI0_CE1_N"      , "SD_CARD_VOLT",
-    "PWM0_1"    , "SCL0"       , "SCL1"      , 0               , "SPI0_CE2_N"      , "SD_CARD_PWR0",
-    "SDA0"      , "SDA1"       , "SPI0_CE0_N", 0               , 0                 , "SPI2_CE1_N"  ,
-    "SCL0"      , "SCL1"       , "SPI0_MISO" , 0               , 0                 , "SPI2_CE0_N"  ,
-    "SD0_CLK"   , 0            , "SPI0_MOSI" , "SD1_CLK"       , "ARM_TRST"        , "SPI2_SCLK"   ,
-    "SD0_CMD"   , "GPCLK0"     , "SPI0_SCLK" , "SD1_CMD"       , "ARM_RTCK"        , "SPI2_MOSI"   ,
-    "SD0_DAT0"  , "GPCLK1"     , "PCM_CLK"   , "SD1_DAT0"      , "ARM_TDO"         , "SPI2_MISO"   ,
-    "SD0_DAT1"  , "GPCLK2"     , "PCM_FS"    , "SD1_DAT1"      , "ARM_TCK"         , "SD_CARD_LED" ,
-    "SD0_DAT2"  , "PWM0_0"     , "PCM_DIN"   , "SD1_DAT2"      , "ARM_TDI"         , 0             ,
-    "SD0_DAT3"  , "PWM0_1"     , "PCM_DOUT"  , "SD1_DAT3"      , "ARM_TMS"         , 0             ,
-};
-
-static const char *gpio_pull_names[4] =
-{
-    "NONE", "DOWN", "UP", "?"
-};
-
-/* 0 = none, 1 = down, 2 = up */
-static const int gpio_default_pullstate_2835[54] =
-{
-    2,2,2,2,2,2,2,2,2, /*GPIO0-8 UP*/
-    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, /*GPIO9-27 DOWN*/
-    0,0, /*GPIO28-29 NONE*/
-    1,1,1,1, /*GPIO30-33 DOWN*/
-    2,2,2, /*GPIO34-36 UP*/
-    1,1,1,1,1,1,1, /*GPIO37-43 DOWN*/
-    0,0, /*GPIO44-45 NONE*/
-    2,2,2,2,2,2,2,2 /*GPIO46-53 UP*/
-};
-
-struct gpio_chip gpio_chip_2835 =
-{
-    "bcm2835",
-    0x00200000,
-    0x1000,
-    54,
-    6,
-    "GPIO, DEFAULT PULL, ALT0, ALT1, ALT2, ALT3, ALT4, ALT5",
-    gpio_alt_names_2835,
-    gpio_default_pullstate_2835,
-    bcm2835_get_level,
-    bcm2835_get_fsel,
-    bcm2835_get_pull,
-    bcm2835_set_level,
-    bcm2835_set_fsel,
-    bcm2835_set_pull,
-    bcm2835_next_reg,
-};
-
-struct gpio_chip gpio_chip_2711 =
-{
-    "bcm2711",
-    0x00200000,
-    0x1000,
-    54,
-    6,
-    "GPIO, DEFAULT PULL, ALT0, ALT1, ALT2, ALT3, ALT4, ALT5",
-    gpio_alt_names_2711,
-    gpio_default_pullstate_2835,
-    bcm2835_get_level,
-    bcm2835_get_fsel,
-    bcm2711_get_pull,
-    bcm2835_set_level,
-    bcm2835_set_fsel,
-    bcm2711_set_pull,
-    bcm2711_next_reg,
+    const char *image;
 };
 
-struct gpio_chip *chip;
-
-void print_gpio_alts_info(struct gpio_chip *chip, int gpio)
+static struct added_chip added_chips[MAX_ADDED_CHIPS];
+static int added_count;
+static int chip_index;
+
+/* Global options, also settable from the environment */
+static const char *chip_name;   /* --chip / RASPI_GPIO_CHIP */
+static const char *sim_image;   /* --sim / RASPI_GPIO_SIM */
+static const char *sim_loops;   /* --loop / RASPI_GPIO_SIM_LOOP */
+static int out_format;          /* --format, an enum out_format */
+static int no_notice;           /* --no-notice / RASPI_GPIO_NO_NOTICE */
+static int timing;              /* --timing / RASPI_GPIO_TIMING */
+static const char *safe_lock;   /* --safe / RASPI_GPIO_SAFE */
+static int stats_format = -1;   /* --stats / RASPI_GPIO_STATS, an enum out_format or -1 */
+static const char *trace_file;  /* --trace / RASPI_GPIO_TRACE */
+static unsigned long trace_records = 65536; /* --trace-records, 1.5MB of ring */
+static int batch_line;          /* Line of the batch being run, 0 outside one */
+
+#define SAFE_LOCK_FILE "/run/lock/raspi-gpio.lock"
+#define SAFE_RETRIES   3
+/* With --timing, when each phase of the run ended, reported at exit */
+#define TIMING_MARKS 8
+
+static uint64_t timing_start;
+static const char *timing_phase[TIMING_MARKS];
+static uint64_t timing_ns[TIMING_MARKS];
+static int timing_count;
+
+static void timing_mark(const char *phase)
 {
-    int alt;
-    printf("%d, %s", gpio, gpio_pull_names[chip->default_pulls[gpio]]);
-    for (alt = 0; alt < 6; alt++)
+    if (timing && timing_count < TIMING_MARKS)
     {
-        const char *name = chip->alt_names[gpio * chip->fsel_count + alt];
-        printf(", %s", name ? name : "-");
+        timing_phase[timing_count] = phase;
+        timing_ns[timing_count++] = clock_ns(CLOCK_MONOTONIC);
     }
-    printf("\n");
 }
 
-struct gpio_chip *get_gpio_chip(void)
+/* To stderr, so as not to get mixed up with the command's output */
+static void timing_report(void)
 {
-    struct gpio_chip *chip;
-    const char *revision_file = "/proc/device-tree/system/linux,revision";
-    uint8_t revision[4] = { 0 };
-    uint32_t cpu = 0;
-    FILE *fd;
+    uint64_t prev = timing_start;
+    int i;
 
-    if ((fd = fopen(revision_file, "rb")) == NULL)
-    {
-        printf("Can't open '%s'\n", revision_file);
-    }
-    else
+    timing_mark("run");
+    fprintf(stderr, "timing:");
+    for (i = 0; i < timing_count; i++)
     {
-        if (fread(revision, 1, sizeof(revision), fd) == 4)
-            cpu = (revision[2] >> 4) & 0xf;
-        else
-            printf("Revision data too short\n");
-
-        fclose(fd);
+        fprintf(stderr, " %s %.1f us", timing_phase[i], (timing_ns[i] - prev) / 1e3);
+        prev = timing_ns[i];
     }
+    fprintf(stderr, ", total %.1f us\n", (prev - timing_start) / 1e3);
 
-    switch (cpu)
+    if (safe_lock && chip)
     {
-    case 0: /* BCM2835 */
-        chip = &gpio_chip_2835;
-        chip->reg_base = 0x20000000 + GPIO_BASE_OFFSET;
-        break;
-    case 1: /* BCM2836 */
-    case 2: /* BCM2837 */
-        chip = &gpio_chip_2835;
-        chip->reg_base = 0x3f000000 + GPIO_BASE_OFFSET;
-        break;
-    case 3: /* BCM2711 */
-        chip = &gpio_chip_2711;
-        chip->reg_base = 0xfe000000 + GPIO_BASE_OFFSET;
-        break;
-    case 4: /* BCM2712 */
-        printf("raspi-gpio is not supported on Pi 5 - use `pinctrl`\n");
-        exit(1);
-    default:
-        printf("Unrecognised revision code\n");
-        exit(1);
-    }
+        struct gpio_contention c;
 
-    return chip;
+        gpio_get_contention(chip, &c);
+        fprintf(stderr, "contention: %llu lock waits, %llu retries, %llu failures\n",
+                (unsigned long long)c.lock_waits, (unsigned long long)c.retries,
+                (unsigned long long)c.failures);
+    }
 }
 
-const char *gpio_fsel_to_namestr(unsigned int gpio, int fsel)
+/* With --stats, to stderr like the timing */
+static void stats_report(void)
 {
-    const char *name = NULL;
-    static char alt_str[16];
-
-    if (gpio >= chip->gpio_count)
-        return NULL;
-
-    if (fsel == FUNC_IP)
-        return "INPUT";
-    else if (fsel == FUNC_OP)
-        return "OUTPUT";
-
-    fsel -= FUNC_A0;
-    if (fsel >= 0 && fsel < chip->fsel_count)
-        name = chip->alt_names[gpio * chip->fsel_count + fsel];
-    if (!name)
-    {
-        sprintf(alt_str, "alt%d", fsel);
-        name = alt_str;
-    }
+    struct gpio_stats stats;
 
-    return name;
+    if (chip && gpio_get_stats(chip, &stats) == 0)
+        format_stats(stderr, stats_format, chip, &stats);
 }
 
-void print_raw_gpio_regs(struct gpio_chip *chip)
+/* The format for --stats[=<format>], or -1 */
+static int stats_arg(const char *arg)
 {
-    int i = -1;
-
-    while (1)
-    {
-        int new_i = chip->next_reg(i++);
-
-        if (new_i < 0)
-            break;
-        if (new_i != i)
-        {
-            /* Change rows if needed */
-            if ((i & ~3) != (new_i & ~3)) /* Not on the same row */
-            {
-                if (i & 3)                /* This row has been started */
-                    printf("\n");
-                i = new_i & ~3;
-            }
-        }
-        if ((i & 3) == 0)
-            printf("%02x:", i * 4);
-        if (new_i != i)
-        {
-            /* Insert padding if needed */
-            printf("%*s", (new_i - i) * 9, "");
-            i = new_i;
-        }
-
-        printf(" %08x", chip->base[i]);
-
-        if ((i & 3) == 3)
-            printf("\n");
-    }
-    if (i & 3)
-        printf("\n");
+    if (!*arg || strcmp(arg, "1") == 0 || strcmp(arg, "text") == 0)
+        return FORMAT_TEXT;
+    else if (strcmp(arg, "json") == 0)
+        return FORMAT_JSON;
+    else if (strcmp(arg, "csv") == 0)
+        return FORMAT_CSV;
+    return -1;
 }
 
 void print_help()
@@ -407,20 +141,127 @@ void print_help()
     printf("and can be used to set the function, pulls and value of a GPIO.\n");
     printf("%s must be run as root.\n", name);
     printf("Use:\n");
-    printf("  %s [<n>] get [GPIO]\n", name);
+    printf("  %s [options] [<n>] get [GPIO]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] set <GPIO> [options]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] funcs [GPIO]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] funcs --find <function>\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] raw\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] events [GPIO]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] group [-f] <peripheral> [GPIO] [pu|pd|pn]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] stats [reset]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] batch [-l] [file|-]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] serve <socket>\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] capture <GPIO> <seconds> <file>\n", name);
+    printf("OR\n");
+    printf("  %s vcd <capture file> [<vcd file>]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] measure <GPIO> <seconds>\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] bus <spi|i2c|uart-tx|uart-rx> <GPIOs> [bus options] [file|-]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] bus-write <GPIOs> [-s <strobe>] [-f <words/s>] [file|-]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] bus-read <GPIOs> -n <words> [-s <strobe>] [-f <words/s>]\n", name);
+    printf("OR\n");
+    printf("  %s [options] [<n>] replay [-l] [-c] [-s <speed>] <trace>\n", name);
     printf("OR\n");
-    printf("  %s [<n>] set <GPIO> [options]\n", name);
+    printf("  %s [options] [<n>] play <file|->\n", name);
     printf("OR\n");
-    printf("  %s [<n>] funcs [GPIO]\n", name);
+    printf("  %s [options] [<n>] pwm [-t <seconds>] <GPIO>:<Hz>:<duty%%> ...\n", name);
     printf("OR\n");
-    printf("  %s [<n>] raw\n", name);
+    printf("  %s [options] [<n>] save|diff|restore <file>\n", name);
+    printf("OR\n");
+    printf("  %s [options] chips\n", name);
     printf("\n");
-    printf("<n> is an option GPIO chip index (default 0)\n");
+    printf("<n> is an optional GPIO chip index (default 0, the SoC); chips after 0\n");
+    printf("are added with --add-chip, and %s chips lists them all\n", name);
+    printf("Valid [options] before the command are:\n");
+    printf("  --chip=bcm2835|bcm2711  skip SoC detection\n");
+    printf("  --sim=<image>           use a simulated GPIO block kept in <image> (a file,\n");
+    printf("                          or e.g. /dev/shm/<name> to share it between processes)\n");
+    printf("  --loop=<out>:<in>[,...] with --sim, wire output GPIO <out> to input GPIO <in>\n");
+    printf("  --add-chip=<chip>:<image>\n");
+    printf("                          add a simulated bcm2835|bcm2711 kept in <image> as the\n");
+    printf("                          next chip <n>; may be repeated\n");
+    printf("  --format=text|json|csv|bin\n");
+    printf("                          output format for get, funcs and raw; bin is a fixed\n");
+    printf("                          8-byte struct gpio_pin_record per GPIO (see raspigpio.h)\n");
+    printf("  --no-notice             don't check whether to print the deprecation notice\n");
+    printf("  --timing                report how long detection, mapping and the command\n");
+    printf("                          took, and with --safe the contention met, on stderr\n");
+    printf("  --safe[=<lock file>]    for other processes changing pins too: hold a lock\n");
+    printf("                          (default %s) over every update,\n", SAFE_LOCK_FILE);
+    printf("                          and read each update back, redoing lost ones\n");
+    printf("  --stats[=text|json|csv] count every register read and write, and time each\n");
+    printf("                          library call, the pull delays and lock waits; printed\n");
+    printf("                          on stderr at exit, and by the stats command\n");
+    printf("  --trace=<file>          record every register read and write, with the time,\n");
+    printf("                          in a ring in <file>, appending to a trace already there\n");
+    printf("                          from this boot\n");
+    printf("  --trace-records=<n>     size of a new trace ring (default 65536 records)\n");
     printf("GPIO is a comma-separated list of pin numbers or ranges (without spaces),\n");
-    printf("e.g. 4 or 18-21 or 7,9-11\n");
+    printf("e.g. 4 or 18-21 or 7,9-11, or function names such as SPI0_MOSI standing\n");
+    printf("for every GPIO with that alt function\n");
     printf("Note that omitting [GPIO] from %s get prints all GPIOs.\n", name);
     printf("%s funcs will dump all the possible GPIO alt funcions in CSV format\n", name);
-    printf("or if [GPIO] is specified the alternate funcs just for that specific GPIO.\n");
+    printf("or if [GPIO] is specified the alternate funcs just for that specific GPIO;\n");
+    printf("with --find it lists the GPIOs and alts of functions beginning <function>.\n");
+    printf("%s events prints (and clears) the latched edge/level events, of\n", name);
+    printf("all GPIOs with an event or just those in [GPIO].\n");
+    printf("%s group switches all the GPIOs of a peripheral (e.g. I2C1, SPI0, UART0, PCM)\n", name);
+    printf("to their alt functions at once, each signal on its lowest GPIO or on those in\n");
+    printf("[GPIO] (which also places UART flow control and extra SPI chip selects), with\n");
+    printf("an optional pull; it won't take GPIOs used as outputs or other alts without -f.\n");
+    printf("%s stats prints the --stats figures so far in the --format given (bin being\n", name);
+    printf("struct gpio_stats), then with reset clears them; for batch and serve.\n");
+    printf("%s batch reads get/set/funcs/raw/events/group/stats commands (without the %s prefix),\n", name, name);
+    printf("one per line, from a file or stdin and runs them all in one process.\n");
+    printf("Output is written when the batch ends, or after every line with -l.\n");
+    printf("%s serve accepts the same commands from any number of clients on a\n", name);
+    printf("Unix domain socket; each reply ends with an \"OK\" or \"ERR\" line.\n");
+    printf("%s capture samples the GPIOs as fast as possible for the given time\n", name);
+    printf("(or until interrupted), recording only changes to a compact binary file,\n");
+    printf("and reports the sample rate achieved; %s vcd converts that file to a\n", name);
+    printf("Value Change Dump for a waveform viewer such as GTKWave.\n");
+    printf("%s measure samples the GPIOs the same way and prints the edges, frequency,\n", name);
+    printf("duty cycle and shortest and longest high and low pulses of each, and the\n");
+    printf("sample rate achieved; measuring many GPIOs costs no more than one.\n");
+    printf("%s bus bit-bangs a bus on any GPIOs, given as pin numbers in this order:\n", name);
+    printf("  spi <SCLK>,<MOSI>,<MISO>[,<CS>] [-m 0-3] [-f Hz]   (default 1 MHz, mode 0)\n");
+    printf("  i2c <SCL>,<SDA> -a <addr> [-r count] [-f Hz]      (default 100 kHz)\n");
+    printf("  uart-tx <TX> [-f baud]                            (default 115200, 8N1)\n");
+    printf("  uart-rx <RX> [-f baud] [-t seconds]               (default 1 s)\n");
+    printf("sending the file or stdin and writing what comes back to stdout; i2c writes\n");
+    printf("then, with -r, reads after a repeated start. -f 0 runs SPI and I2C as fast as\n");
+    printf("possible. The throughput and timing error achieved are reported on stderr.\n");
+    printf("%s bus-write and bus-read move words of up to 32 bits between a file or\n", name);
+    printf("stdin/stdout (little-endian, a whole number of bytes each) and the GPIOs,\n");
+    printf("listed from bit 0 up (e.g. 8-15, or 15-8 reversed), as fast as possible or\n");
+    printf("at the given rate; with -s each word is latched by a rising edge of <strobe>,\n");
+    printf("after the data is written or before it is read. MB/s is reported on stderr.\n");
+    printf("%s replay issues the register writes of a --trace again, at their recorded\n", name);
+    printf("times or -s times faster (0 for no waiting); with -c it also makes the reads and\n");
+    printf("reports any value that differs, and with -l it just lists the trace.\n");
+    printf("%s play drives output GPIOs from a waveform of \"<time> <set GPIO> <clear GPIO>\"\n", name);
+    printf("lines, time in microseconds from the start and \"-\" for no GPIOs, each step\n");
+    printf("timed against an absolute deadline, and reports the timing error achieved.\n");
+    printf("%s pwm drives each channel of output GPIOs at its own frequency and duty\n", name);
+    printf("cycle (in percent) from one thread, for the given time or until interrupted,\n");
+    printf("writing all the edges due at once together and leaving the GPIOs low. High\n");
+    printf("and low times must each be at least 2us.\n");
+    printf("%s save records the function, level, pull and detects of every GPIO;\n", name);
+    printf("diff lists the GPIOs that now differ, as <saved>-><now>, exiting with 1 if\n");
+    printf("any do; restore writes only the registers needed to put them back.\n");
     printf("Valid [options] for %s set are:\n", name);
     printf("  ip      set GPIO as input\n");
     printf("  op      set GPIO as output\n");
@@ -430,6 +271,24 @@ void print_help()
     printf("  pn      set GPIO pull none (no pull)\n");
     printf("  dh      set GPIO to drive to high (1) level (only valid if set to be an output)\n");
     printf("  dl      set GPIO to drive low (0) level (only valid if set to be an output)\n");
+    printf("  er      detect rising edges       ef      detect falling edges\n");
+    printf("  eh      detect high level         el      detect low level\n");
+    printf("  ear     detect async rising edges eaf     detect async falling edges\n");
+    printf("  en      detect nothing (the e options given replace any detects set before)\n");
+    printf("All the GPIOs in a set are updated together, with one write per register.\n");
+    printf("Environment:\n");
+    printf("  RASPI_GPIO_REGS=<file>          use a file-backed register image instead of the hardware\n");
+    printf("  RASPI_GPIO_CHIP=bcm2835|bcm2711 as --chip\n");
+    printf("  RASPI_GPIO_SIM=<image>          as --sim\n");
+    printf("  RASPI_GPIO_SIM_LOOP=<list>      as --loop\n");
+    printf("  RASPI_GPIO_ADD_CHIPS=<list>     as --add-chip, for each <chip>:<image> in the list\n");
+    printf("  RASPI_GPIO_PUD_DELAY=<ns>       bcm2835 pull setup/hold time (default 1000, a fixed\n");
+    printf("                                  bound on 150 cycles of any core clock from 150MHz)\n");
+    printf("  RASPI_GPIO_NO_NOTICE=1          as --no-notice\n");
+    printf("  RASPI_GPIO_TIMING=1             as --timing\n");
+    printf("  RASPI_GPIO_SAFE=1|<lock file>   as --safe\n");
+    printf("  RASPI_GPIO_STATS=1|json|csv     as --stats\n");
+    printf("  RASPI_GPIO_TRACE=<file>         as --trace\n");
     printf("Examples:\n");
     printf("  %s get              Prints state of all GPIOs one per line\n", name);
     printf("  %s get 20           Prints state of GPIO20\n", name);
@@ -442,175 +301,304 @@ void print_help()
     printf("  %s set 20 ip pd     Set GPIO20 to input with pull down\n", name);
     printf("  %s set 35 a0 pu     Set GPIO35 to ALT0 function (SPI_CE1_N) with pull up\n", name);
     printf("  %s set 20 op pn dh  Set GPIO20 to ouput with no pull and driving high\n", name);
+    printf("  %s set 17 ip er ef  Latch both edges of GPIO17, then %s events 17\n", name, name);
+    printf("  %s pwm 18:1000:25 20-23:50:50  PWM GPIO18 at 1kHz 25%%, GPIO20-23 at 50Hz 50%%\n", name);
 }
 
-int gpio_get(unsigned int gpio)
+/* Adds the chips in "<chip>:<image>[,...]" after any already added */
+static int add_chips(const char *list)
 {
-    const char *name;
-    int level;
-    int fsel;
-    int pull;
-
-    fsel = chip->get_fsel(chip, gpio);
-    name = gpio_fsel_to_namestr(gpio, fsel);
-    level = chip->get_level(chip, gpio);
+    char *p = strdup(list);
 
-    printf("GPIO %d: level=%d", gpio, level);
+    if (!p)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+    while (p && *p)
+    {
+        char *next = strchr(p, ',');
+        char *image;
 
-    if (fsel >= FUNC_A0)
-        printf(" alt=%d", fsel - FUNC_A0);
-    printf(" func=%s", name);
+        if (next)
+            *next++ = '\0';
+        image = strchr(p, ':');
+        if (!image || image == p || !image[1])
+        {
+            printf("Expected <chip>:<image> not \"%s\"\n", p);
+            return 1;
+        }
+        if (added_count == MAX_ADDED_CHIPS)
+        {
+            printf("Too many chips, at most %d can be added\n", MAX_ADDED_CHIPS);
+            return 1;
+        }
+        *image++ = '\0';
+        added_chips[added_count].name = p;
+        added_chips[added_count++].image = image;
+        p = next;
+    }
 
-    pull = chip->get_pull(chip, gpio);
-    if (pull != PULL_UNSET)
-        printf(" pull=%s", gpio_pull_names[pull & 3]);
-    printf("\n");
     return 0;
 }
 
-int gpio_set(unsigned int gpio, int fsparam, int drive, int pull)
+/* Creates chip n, detecting the SoC for chip 0 unless told what it is */
+static struct gpio_chip *new_chip(int n)
 {
-    if (fsparam != FUNC_UNSET)
-        chip->set_fsel(chip, gpio, fsparam);
+    if (n)
+        return gpio_chip_new(added_chips[n - 1].name);
+    return gpio_chip_new(chip_name);
+}
+
+/* Lists the chips that <n> can select */
+static int run_chips(void)
+{
+    int n;
 
-    if (drive != DRIVE_UNSET)
+    for (n = 0; n <= added_count; n++)
     {
-        if (chip->get_fsel(chip, gpio) == FUNC_OP)
+        struct gpio_chip *c = n == chip_index ? chip : new_chip(n);
+        const char *image = n ? added_chips[n - 1].image : sim_image;
+
+        if (!c)
         {
-            chip->set_level(chip, gpio, drive);
+            printf("%d: %s\n", n, gpio_last_error());
+            continue;
         }
+        printf("%d: %s, %u GPIOs, ", n, gpio_chip_name(c), gpio_chip_gpio_count(c));
+        if (image)
+            printf("simulated in %s\n", image);
+        else if (getenv("RASPI_GPIO_REGS"))
+            printf("register image %s\n", getenv("RASPI_GPIO_REGS"));
         else
+            printf("hardware\n");
+        if (c != chip)
+            gpio_close(c);
+    }
+
+    return 0;
+}
+
+/*
+  Maps the hardware, the simulator if one was asked for, or the plain
+  register image named by RASPI_GPIO_REGS. Added chips are always
+  simulated, and loopbacks only apply to chip 0.
+*/
+int map_chip(void)
+{
+    const char *image = chip_index ? added_chips[chip_index - 1].image : sim_image;
+    const char *p = chip_index ? NULL : sim_loops;
+
+    if (image)
+    {
+        if (gpio_chip_map_sim(chip, image))
+        {
+            printf("%s\n", gpio_last_error());
+            return 1;
+        }
+    }
+    else if (gpio_chip_map(chip, getenv("RASPI_GPIO_REGS")))
+    {
+        printf("%s\n", gpio_last_error());
+        return 1;
+    }
+    timing_mark("map");
+
+    /* Loopbacks are "<from>:<to>[,...]", each wiring an output to an input */
+    while (image && p && *p)
+    {
+        unsigned int from, to;
+        int len;
+
+        if (sscanf(p, "%u:%u%n", &from, &to, &len) != 2 || gpio_sim_loop(chip, from, to))
         {
-            printf("Can't set pin value, not an output\n");
+            printf("Bad loopback \"%s\"\n", p);
             return 1;
         }
+        p += len;
+        if (*p == ',')
+            p++;
     }
 
-    if (pull != PULL_UNSET)
-        return chip->set_pull(chip, gpio, pull);
+    /* Counting and tracing start with the command, not the setting up of a new image */
+    if (trace_file && gpio_chip_set_trace(chip, trace_file, trace_records))
+    {
+        printf("%s\n", gpio_last_error());
+        return 1;
+    }
+    if (stats_format >= 0)
+    {
+        if (gpio_chip_set_stats(chip, 1))
+        {
+            printf("%s\n", gpio_last_error());
+            return 1;
+        }
+        atexit(stats_report);
+    }
 
     return 0;
 }
 
-int main(int argc, char *argv[])
+enum gpio_cmd_type
 {
-    int fd;
-    int ret;
+    CMD_GET,
+    CMD_SET,
+    CMD_FUNCS,
+    CMD_RAW,
+    CMD_EVENTS,
+    CMD_GROUP,
+    CMD_STATS,
+};
+
+struct gpio_cmd
+{
+    enum gpio_cmd_type type;
+    int pull;
+    int fsparam;
+    int drive;
+    int events;
+    const char *find;       /* funcs --find */
+    const char *group;      /* group peripheral */
+    int force;              /* group -f */
+    int reset;              /* stats reset */
+    uint32_t gpiomask[GPIO_MAX_BANKS];
+};
+
+/* The EVENT_* bit for a set option, 0 for "en", or EVENT_UNSET */
+static int event_arg(const char *arg)
+{
+    static const char *names[GPIO_EVENT_TYPES] = { "er", "ef", "eh", "el", "ear", "eaf" };
+    int type;
 
-    /* arg parsing */
+    if (strcmp(arg, "en") == 0)
+        return 0;
+    for (type = 0; type < GPIO_EVENT_TYPES; type++)
+    {
+        if (strcmp(arg, names[type]) == 0)
+            return 1 << type;
+    }
+    return EVENT_UNSET;
+}
 
-    int set = 0;
-    int get = 0;
-    int funcs = 0;
-    int raw = 0;
-    int pull = PULL_UNSET;
-    int fsparam = FUNC_UNSET;
-    int drive = DRIVE_UNSET;
-    uint32_t gpiomask[2] = { 0, 0 }; /* Enough for 0-53 */
-    int all_pins = 0;
+/* Reports why a command failed, in a batch naming the line it was on */
+static void cmd_error(FILE *out, const char *fmt, ...)
+{
+    va_list ap;
 
-    const char *cmd;
+    if (batch_line)
+        fprintf(out, "Line %d: ", batch_line);
+    va_start(ap, fmt);
+    vfprintf(out, fmt, ap);
+    va_end(ap);
+}
 
-    argv++;
+/*
+  Parses "get|set|funcs|raw|events [GPIO] [options]", "funcs --find <name>",
+  "group [-f] <peripheral> [GPIO] [pull]" or "stats [reset]" (argv[0] being the command)
+  into cmd. Returns 0 on success, else reports the problem to out and
+  returns 1.
+*/
+int parse_cmd(FILE *out, int argc, char *argv[], struct gpio_cmd *cmd)
+{
+    const char *name;
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->pull = PULL_UNSET;
+    cmd->fsparam = FUNC_UNSET;
+    cmd->drive = DRIVE_UNSET;
+    cmd->events = EVENT_UNSET;
+
+    name = *(argv++);
     argc--;
 
-    if (!argc)
+    /* argc 2 or greater, next arg must be set, get or help */
+    if (strcmp(name, "get") == 0)
+        cmd->type = CMD_GET;
+    else if (strcmp(name, "set") == 0)
+        cmd->type = CMD_SET;
+    else if (strcmp(name, "funcs") == 0)
+        cmd->type = CMD_FUNCS;
+    else if (strcmp(name, "raw") == 0)
+        cmd->type = CMD_RAW;
+    else if (strcmp(name, "events") == 0)
+        cmd->type = CMD_EVENTS;
+    else if (strcmp(name, "group") == 0)
+        cmd->type = CMD_GROUP;
+    else if (strcmp(name, "stats") == 0)
+        cmd->type = CMD_STATS;
+    else
     {
-        printf("No arguments given - try \"raspi-gpio help\"\n");
+        cmd_error(out, "Unknown argument \"%s\" try \"raspi-gpio help\"\n", name);
         return 1;
     }
 
-    cmd = *(argv++);
-    argc--;
-
-    if (strcmp(cmd, "help") == 0)
+    if (cmd->type == CMD_FUNCS && argc && strcmp(*argv, "--find") == 0)
     {
-        print_help();
+        if (argc != 2)
+        {
+            cmd_error(out, argc < 2 ? "Need a function name to find\n" : "Too many arguments\n");
+            return 1;
+        }
+        cmd->find = argv[1];
         return 0;
     }
 
-    chip = get_gpio_chip();
+    if (cmd->type == CMD_STATS)
+    {
+        if (argc > 1 || (argc && strcmp(*argv, "reset") != 0))
+        {
+            cmd_error(out, "Unknown argument \"%s\"\n", *argv);
+            return 1;
+        }
+        cmd->reset = argc;
+        return 0;
+    }
 
-    /* argc 2 or greater, next arg must be set, get or help */
-    get = strcmp(cmd, "get") == 0;
-    set = strcmp(cmd, "set") == 0;
-    funcs = strcmp(cmd, "funcs") == 0;
-    raw = strcmp(cmd, "raw") == 0;
-    if (!set && !get && !funcs && !raw)
+    if (cmd->type == CMD_GROUP)
     {
-        printf("Unknown argument \"%s\" try \"raspi-gpio help\"\n", cmd);
-        return 1;
+        if (argc && strcmp(*argv, "-f") == 0)
+        {
+            cmd->force = 1;
+            argv++;
+            argc--;
+        }
+        if (!argc)
+        {
+            cmd_error(out, "Need a peripheral to set up\n");
+            return 1;
+        }
+        cmd->group = *(argv++);
+        argc--;
     }
 
-    if ((get || funcs) && (argc > 1))
+    if ((cmd->type == CMD_GET || cmd->type == CMD_FUNCS || cmd->type == CMD_EVENTS) && (argc > 1))
     {
-        printf("Too many arguments\n");
+        cmd_error(out, "Too many arguments\n");
         return 1;
     }
 
-    if (!argc && set)
+    if (!argc && cmd->type == CMD_SET)
     {
-        printf("Need GPIO number to set\n");
+        cmd_error(out, "Need GPIO number to set\n");
         return 1;
     }
 
-    if (argc) /* expect pin number(s) next */
+    /* expect pin number(s) next, though a group may go straight to its pull */
+    if (argc && (cmd->type != CMD_GROUP || isdigit((unsigned char)**argv)))
     {
-        char *p = *(argv++);
+        const char *p = gpio_parse_pins(chip, *(argv++), cmd->gpiomask);
         argc--;
 
-        while (p)
-        {
-            int pin, pin2, len;
-            ret = sscanf(p, "%d%n", &pin, &len);
-            if (ret != 1 || pin >= chip->gpio_count)
-                break;
-            p += len;
-
-            if (*p == '-')
-            {
-                p++;
-                ret = sscanf(p, "%d%n", &pin2, &len);
-                if (ret != 1 || pin2 >= chip->gpio_count)
-                    break;
-                if (pin2 < pin)
-                {
-                    int tmp = pin2;
-                    pin2 = pin;
-                    pin = tmp;
-                }
-                p += len;
-            }
-            else
-            {
-                pin2 = pin;
-            }
-            while (pin <= pin2)
-            {
-                gpiomask[pin/32] |= (1 << (pin % 32));
-                pin++;
-            }
-            if (*p == '\0')
-            {
-                p = NULL;
-            }
-            else
-            {
-                if (*p != ',')
-                    break;
-                p++;
-            }
-        }
         if (p)
         {
-            printf("Unknown GPIO \"%s\"\n", p);
+            cmd_error(out, "Unknown GPIO \"%s\"\n", p);
             return 1;
         }
     }
 
-    if (set && !argc)
+    if (cmd->type == CMD_SET && !argc)
     {
-        printf("Nothing to set\n");
+        cmd_error(out, "Nothing to set\n");
         return 1;
     }
 
@@ -618,301 +606,1104 @@ int main(int argc, char *argv[])
     while (argc)
     {
         const char *arg = *(argv++);
+        int event;
         argc--;
 
         if (strcmp(arg, "dh") == 0)
-            drive = DRIVE_HIGH;
+            cmd->drive = DRIVE_HIGH;
         else if (strcmp(arg, "dl") == 0)
-            drive = DRIVE_LOW;
+            cmd->drive = DRIVE_LOW;
         else if (strcmp(arg, "ip") == 0)
-            fsparam = FUNC_IP;
+            cmd->fsparam = FUNC_IP;
         else if (strcmp(arg, "op") == 0)
-            fsparam = FUNC_OP;
+            cmd->fsparam = FUNC_OP;
         else if (strcmp(arg, "a0") == 0)
-            fsparam = FUNC_A0;
+            cmd->fsparam = FUNC_A0;
         else if (strcmp(arg, "a1") == 0)
-            fsparam = FUNC_A1;
+            cmd->fsparam = FUNC_A1;
         else if (strcmp(arg, "a2") == 0)
-            fsparam = FUNC_A2;
+            cmd->fsparam = FUNC_A2;
         else if (strcmp(arg, "a3") == 0)
-            fsparam = FUNC_A3;
+            cmd->fsparam = FUNC_A3;
         else if (strcmp(arg, "a4") == 0)
-            fsparam = FUNC_A4;
+            cmd->fsparam = FUNC_A4;
         else if (strcmp(arg, "a5") == 0)
-            fsparam = FUNC_A5;
+            cmd->fsparam = FUNC_A5;
         else if (strcmp(arg, "pu") == 0)
-            pull = PULL_UP;
+            cmd->pull = PULL_UP;
         else if (strcmp(arg, "pd") == 0)
-            pull = PULL_DOWN;
+            cmd->pull = PULL_DOWN;
         else if (strcmp(arg, "pn") == 0)
-            pull = PULL_NONE;
+            cmd->pull = PULL_NONE;
+        else if ((event = event_arg(arg)) != EVENT_UNSET)
+            cmd->events = (cmd->events == EVENT_UNSET ? 0 : cmd->events) | event;
         else
         {
-            printf("Unknown argument \"%s\"\n", arg);
+            cmd_error(out, "Unknown argument \"%s\"\n", arg);
             return 1;
         }
     }
 
-    if (fsparam >= FUNC_A0 && (fsparam - FUNC_A0) >= chip->fsel_count)
+    if (cmd->fsparam >= FUNC_A0 && (cmd->fsparam - FUNC_A0) >= gpio_chip_alt_count(chip))
+    {
+        cmd_error(out, "Alt function a%d out of range\n", cmd->fsparam - FUNC_A0);
+        return 1;
+    }
+
+    if (cmd->type == CMD_GROUP &&
+        (cmd->fsparam != FUNC_UNSET || cmd->drive != DRIVE_UNSET || cmd->events != EVENT_UNSET))
     {
-        printf("Alt function a%d out of range\n", fsparam - FUNC_A0);
+        cmd_error(out, "Only a pull can be given with a group\n");
         return 1;
     }
-    /* end arg parsing */
 
-    all_pins = !(gpiomask[0] | gpiomask[1]);
+    return 0;
+}
+
+/*
+  Switches every pin of a peripheral to its alt function together, one
+  write per GPFSEL register, with any pull in the same commit. Pins in use
+  as outputs or other alt functions are reported, and left alone unless
+  forced.
+*/
+static int run_group(FILE *out, const struct gpio_cmd *cmd)
+{
+    struct gpio_alt_ref refs[32 * GPIO_MAX_BANKS];
+    struct gpio_snapshot snap;
+    struct gpio_plan plan;
+    int conflicts = 0;
+    int count;
+    int i;
+
+    count = gpio_find_group(chip, cmd->group, cmd->gpiomask, refs, sizeof(refs) / sizeof(refs[0]));
+    if (count < 0)
+    {
+        cmd_error(out, "%s\n", gpio_last_error());
+        return 1;
+    }
 
-    if (funcs)
+    /* The pins must still be free when they are taken */
+    gpio_lock(chip);
+    gpio_snapshot_take(chip, &snap);
+    gpio_plan_init(&plan);
+    for (i = 0; i < count; i++)
     {
-        int pin;
+        unsigned int gpio = refs[i].gpio;
+        int fsel = gpio_plan_fsel_after(&plan, &snap, gpio);
 
-        printf("GPIO, DEFAULT PULL, ALT0, ALT1, ALT2, ALT3, ALT4, ALT5\n");
-        for (pin = 0; pin < chip->gpio_count; pin++)
+        if (fsel != FUNC_IP && fsel != FUNC_A0 + refs[i].alt)
         {
-            if (all_pins || gpiomask[pin / 32] & (1 << (pin % 32)))
-                print_gpio_alts_info(chip, pin);
+            cmd_error(out, "GPIO %d is in use as %s, not free for %s\n",
+                    gpio, gpio_fsel_to_namestr(chip, gpio, fsel), refs[i].name);
+            conflicts++;
         }
-        goto deprecation_check;
+        gpio_plan_fsel(&plan, gpio, FUNC_A0 + refs[i].alt);
+        if (cmd->pull != PULL_UNSET)
+            gpio_plan_pull(&plan, gpio, cmd->pull);
     }
 
-    /* Check for /dev/gpiomem, else we need root access for /dev/mem */
-    if ((fd = open ("/dev/gpiomem", O_RDWR | O_SYNC | O_CLOEXEC) ) >= 0)
+    if (conflicts && !cmd->force)
     {
-        chip->base = (uint32_t *)mmap(0, chip->reg_size,
-                                      PROT_READ|PROT_WRITE, MAP_SHARED,
-                                      fd, 0);
+        gpio_unlock(chip);
+        cmd_error(out, "Nothing changed - use group -f to take over the pins\n");
+        return 1;
     }
-    else
+
+    if (gpio_plan_commit(chip, &plan))
+    {
+        gpio_unlock(chip);
+        cmd_error(out, "%s\n", gpio_last_error());
+        return 1;
+    }
+    gpio_unlock(chip);
+    for (i = 0; i < count; i++)
+        fprintf(out, "GPIO %d: a%d %s\n", refs[i].gpio, refs[i].alt, refs[i].name);
+
+    return 0;
+}
+
+/* Runs a parsed command. Everything but funcs needs the chip mapped. */
+int run_cmd(FILE *out, const struct gpio_cmd *cmd)
+{
+    static const uint32_t all_mask[GPIO_MAX_BANKS] = { ~0u, ~0u };
+    int all_pins = gpio_mask_empty(cmd->gpiomask, GPIO_MAX_BANKS);
+    uint32_t events[GPIO_MAX_BANKS];
+    struct gpio_snapshot snap;
+    struct gpio_stats stats;
+    struct gpio_plan plan;
+    int pin;
+
+    switch (cmd->type)
     {
-        if (geteuid())
+    case CMD_FUNCS:
+        if (cmd->find)
+            format_alt_find(out, out_format, chip, cmd->find);
+        else
+            format_gpio_funcs(out, out_format, chip, cmd->gpiomask);
+        break;
+
+    case CMD_SET:
+        gpio_plan_init(&plan);
+        if (cmd->drive != DRIVE_UNSET && cmd->fsparam == FUNC_UNSET)
+            gpio_snapshot_take(chip, &snap);
+        if (gpio_plan_set(chip, &plan, &snap, cmd->gpiomask, cmd->fsparam, cmd->drive, cmd->pull))
         {
-            printf("Must be root\n");
+            cmd_error(out, "Can't set pin value, not an output\n");
             return 1;
         }
-
-        if ((fd = open ("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC) ) < 0)
+        if (cmd->events != EVENT_UNSET)
+            gpio_plan_set_events(chip, &plan, cmd->gpiomask, cmd->events);
+        if (gpio_plan_commit(chip, &plan))
         {
-            printf("Unable to open /dev/mem: %s\n", strerror (errno));
+            cmd_error(out, "%s\n", gpio_last_error());
             return 1;
         }
+        break;
 
-        chip->base = (uint32_t *)mmap(0, chip->reg_size,
-                                      PROT_READ|PROT_WRITE, MAP_SHARED,
-                                      fd, chip->reg_base);
-    }
+    case CMD_GROUP:
+        return run_group(out, cmd);
 
-    if (chip->base == (uint32_t *)-1)
-    {
-        printf("mmap (GPIO) failed: %s\n", strerror (errno));
-        return 1;
-    }
+    case CMD_GET:
+        gpio_snapshot_take(chip, &snap);
+        format_gpio_state(out, out_format, &snap, cmd->gpiomask);
+        break;
 
-    if (set || get)
-    {
-        int pin;
-        for (pin = 0; pin < chip->gpio_count; pin++)
+    case CMD_RAW:
+        gpio_snapshot_take_all(chip, &snap);
+        format_raw_regs(out, out_format, &snap);
+        break;
+
+    case CMD_EVENTS:
+        /* Each bank is read and cleared with one access apiece */
+        gpio_read_events(chip, events, all_pins ? all_mask : cmd->gpiomask);
+        gpio_mask_for_each(pin, all_pins ? events : cmd->gpiomask, GPIO_MAX_BANKS)
         {
-            if (all_pins)
-            {
-                if (pin==0) printf("BANK0 (GPIO 0 to 27):\n");
-                if (pin==28) printf("BANK1 (GPIO 28 to 45):\n");
-                if (pin==46) printf("BANK2 (GPIO 46 to 53):\n");
-            }
-            else if (!(gpiomask[pin / 32] & (1 << (pin % 32))))
-            {
-                continue;
-            }
-            if (get)
-            {
-                if (gpio_get(pin))
-                    return 1;
-            }
-            else
-            {
-                if (gpio_set(pin, fsparam, drive, pull))
-                    return 1;
-            }
+            if (pin >= gpio_chip_gpio_count(chip))
+                break;
+            fprintf(out, "GPIO %d: event=%d\n", pin, gpio_mask_test(events, pin));
         }
-    }
-
-    if (raw)
-        print_raw_gpio_regs(chip);
+        break;
 
-  deprecation_check:
-    if (isatty(STDOUT_FILENO))
-    {
-        fd = open("/tmp/raspi-gpio-deprecated", O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-        if (fd >= 0)
+    case CMD_STATS:
+        if (gpio_get_stats(chip, &stats))
         {
-            printf("[ raspi-gpio is deprecated - try `pinctrl` instead ]\n");
-            close(fd);
+            cmd_error(out, "Statistics are off - use --stats\n");
+            return 1;
         }
+        format_stats(out, out_format, chip, &stats);
+        if (cmd->reset)
+            gpio_reset_stats(chip);
+        break;
     }
 
     return 0;
 }
 
-static int bcm2835_get_level(struct gpio_chip *chip, unsigned int gpio)
-{
-    if (gpio >= chip->gpio_count)
-        return -1;
-
-    return (chip->base[GPLEV0 + (gpio / 32)] >> (gpio % 32)) & 1;
-}
+#define BATCH_MAX_ARGS 16
 
-static int bcm2835_get_fsel(struct gpio_chip *chip, unsigned int gpio)
+/*
+  Runs get/set/funcs/raw/events/group/stats commands, one per line, against the already
+  mapped chip. Blank lines and lines starting with '#' are ignored. Each
+  failing line is reported with its number and the rest of the batch still runs.
+*/
+int run_batch(FILE *in, int flush_lines)
 {
-    /* GPFSEL0-5 with 10 sels per reg, 3 bits per sel (so bits 0:29 used) */
-    uint32_t reg = GPFSEL0 + (gpio / 10);
-    uint32_t lsb = (gpio % 10) * 3;
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+    int failed = 0;
 
-    if (gpio < chip->gpio_count)
+    while (getline(&line, &size, in) >= 0)
     {
-        switch ((chip->base[reg] >> lsb) & 7)
+        char *args[BATCH_MAX_ARGS];
+        struct gpio_cmd cmd;
+        char *saveptr;
+        int nargs = 0;
+        char *tok;
+
+        lineno++;
+        for (tok = strtok_r(line, " \t\r\n", &saveptr);
+             tok && nargs < BATCH_MAX_ARGS;
+             tok = strtok_r(NULL, " \t\r\n", &saveptr))
+            args[nargs++] = tok;
+
+        if (!nargs || args[0][0] == '#')
+            continue;
+
+        batch_line = lineno;
+        if (tok)
+        {
+            cmd_error(stdout, "Too many arguments\n");
+            failed = 1;
+        }
+        else if (parse_cmd(stdout, nargs, args, &cmd) || run_cmd(stdout, &cmd))
         {
-        case 0: return FUNC_IP;
-        case 1: return FUNC_OP;
-        case 2: return FUNC_A5;
-        case 3: return FUNC_A4;
-        case 4: return FUNC_A0;
-        case 5: return FUNC_A1;
-        case 6: return FUNC_A2;
-        case 7: return FUNC_A3;
+            failed = 1;
         }
+
+        if (flush_lines)
+            fflush(stdout);
     }
 
-    return -1;
+    batch_line = 0;
+    free(line);
+    return failed;
 }
 
-static int bcm2835_get_pull(struct gpio_chip *chip, unsigned int gpio)
-{
-    /* This is a write-only mechanism */
-    return PULL_UNSET;
-}
+#define SERVE_LINE_MAX   1024
+#define SERVE_MAX_EVENTS 64
 
-static int bcm2835_set_level(struct gpio_chip *chip, unsigned int gpio, int level)
+/* A set's status, known only once the plan it went into is committed */
+struct serve_held
 {
-    if (gpio >= chip->gpio_count)
-        return -1;
-
-    chip->base[(level ? GPSET0 : GPCLR0) + (gpio / 32)] = (1 << (gpio % 32));
-
-    return 0;
-}
+    size_t offset;            /* Where in the reply the status goes */
+    unsigned int commit;      /* Which of the round's commits carries it */
+};
 
-static int bcm2835_set_fsel(struct gpio_chip *chip, unsigned int gpio, int fsel)
+/* A commit of the round that failed, failing every set in it */
+struct serve_failure
 {
-    /* GPFSEL0-5 with 10 sels per reg, 3 bits per sel (so bits 0:29 used) */
-    uint32_t reg = GPFSEL0 + (gpio / 10);
-    uint32_t lsb = (gpio % 10) * 3;
+    unsigned int commit;
+    char *status;             /* The error and "ERR" */
+};
 
-    switch (fsel)
+struct serve_client
+{
+    int fd;
+    int closing;              /* Peer has shut down its side */
+    size_t inlen;
+    char in[SERVE_LINE_MAX];
+    char *out;                /* Reply data not yet sent */
+    size_t outlen;
+    size_t outsent;
+    FILE *reply;              /* Replies built during the current round */
+    char *reply_buf;
+    size_t reply_len;
+    struct serve_held *held;  /* Sets in the reply still waiting for OK or ERR */
+    int nheld;
+    int maxheld;
+};
+
+/*
+  Requests arriving in the same epoll round share register transactions:
+  consecutive sets are merged into one plan, which is only committed when
+  a later request needs to observe it (or the round ends), and all the
+  gets in between decode the same snapshot. The loop is single threaded,
+  so register read-modify-writes can never interleave between clients.
+  A set is only answered once the round is over, with OK or ERR from the
+  commit that carried it.
+*/
+struct serve_round
+{
+    struct gpio_plan plan;
+    struct gpio_snapshot snap;
+    int plan_pending;
+    int snap_valid;
+    unsigned int commits;
+    struct serve_failure *failed;
+    int nfailed;
+};
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig)
+{
+    serve_stop = 1;
+}
+
+static void serve_commit(struct serve_round *round)
+{
+    if (round->plan_pending)
     {
-    case FUNC_IP: fsel = 0; break;
-    case FUNC_OP: fsel = 1; break;
-    case FUNC_A0: fsel = 4; break;
-    case FUNC_A1: fsel = 5; break;
-    case FUNC_A2: fsel = 6; break;
-    case FUNC_A3: fsel = 7; break;
-    case FUNC_A4: fsel = 3; break;
-    case FUNC_A5: fsel = 2; break;
-    default:
-        return -1;
+        if (gpio_plan_commit(chip, &round->plan))
+        {
+            struct serve_failure *failed;
+
+            failed = realloc(round->failed, (round->nfailed + 1) * sizeof(*failed));
+            if (failed)
+            {
+                const char *error = gpio_last_error();
+                char *status = malloc(strlen(error) + sizeof("\nERR\n"));
+
+                if (status)
+                    sprintf(status, "%s\nERR\n", error);
+                round->failed = failed;
+                failed[round->nfailed].commit = round->commits;
+                failed[round->nfailed].status = status;
+                round->nfailed++;
+            }
+        }
+        round->commits++;
+        gpio_plan_init(&round->plan);
+        round->plan_pending = 0;
+        round->snap_valid = 0;
+    }
+}
+
+/* The reply lines for the sets of a commit */
+static const char *serve_status(const struct serve_round *round, unsigned int commit)
+{
+    int i;
+
+    for (i = 0; i < round->nfailed; i++)
+        if (round->failed[i].commit == commit)
+            return round->failed[i].status ? round->failed[i].status : "ERR\n";
+    return "OK\n";
+}
+
+static void serve_sample(struct serve_round *round)
+{
+    if (!round->snap_valid)
+    {
+        gpio_snapshot_take_all(chip, &round->snap);
+        round->snap_valid = 1;
     }
+}
 
-    if (gpio < chip->gpio_count)
+static int serve_cmd(FILE *out, struct serve_round *round, const struct gpio_cmd *cmd)
+{
+    switch (cmd->type)
     {
-        chip->base[reg] = (chip->base[reg] & ~(0x7 << lsb)) | (fsel << lsb);
+    case CMD_SET:
+        if (cmd->drive != DRIVE_UNSET && cmd->fsparam == FUNC_UNSET)
+            serve_sample(round);
+        if (gpio_plan_set(chip, &round->plan, &round->snap, cmd->gpiomask,
+                          cmd->fsparam, cmd->drive, cmd->pull))
+        {
+            fprintf(out, "Can't set pin value, not an output\n");
+            return 1;
+        }
+        if (cmd->events != EVENT_UNSET)
+            gpio_plan_set_events(chip, &round->plan, cmd->gpiomask, cmd->events);
+        round->plan_pending = 1;
         return 0;
+
+    case CMD_STATS:
+        /* Count the writes still pending */
+        serve_commit(round);
+        return run_cmd(out, cmd);
+
+    case CMD_EVENTS:
+    case CMD_GROUP:
+        /* Clearing events or switching a group changes registers under the snapshot */
+        serve_commit(round);
+        round->snap_valid = 0;
+        return run_cmd(out, cmd);
+
+    case CMD_GET:
+        serve_commit(round);
+        serve_sample(round);
+        format_gpio_state(out, out_format, &round->snap, cmd->gpiomask);
+        return 0;
+
+    case CMD_RAW:
+        serve_commit(round);
+        serve_sample(round);
+        format_raw_regs(out, out_format, &round->snap);
+        return 0;
+
+    default:
+        return run_cmd(out, cmd);
     }
+}
 
-    return -1;
+/* Leaves a gap in the reply for a set's status, or answers it now if there's no room to */
+static void serve_hold(struct serve_client *c, struct serve_round *round)
+{
+    if (c->nheld == c->maxheld)
+    {
+        int max = c->maxheld ? 2 * c->maxheld : 16;
+        struct serve_held *held = realloc(c->held, max * sizeof(*held));
+
+        if (!held)
+        {
+            serve_commit(round);
+            fputs(serve_status(round, round->commits - 1), c->reply);
+            return;
+        }
+        c->held = held;
+        c->maxheld = max;
+    }
+
+    c->held[c->nheld].offset = ftell(c->reply);
+    c->held[c->nheld].commit = round->commits;
+    c->nheld++;
 }
 
-static int bcm2835_set_pull(struct gpio_chip *chip, unsigned int gpio, int pull)
+/* Runs every complete line buffered for the client, replying to each */
+static void serve_lines(struct serve_client *c, struct serve_round *round)
 {
-    int clkreg = GPPUDCLK0 + (gpio / 32);
-    int clkbit = 1 << (gpio % 32);
+    char *line = c->in;
+    char *end;
 
-    if (gpio >= chip->gpio_count)
-        return -1;
+    while ((end = memchr(line, '\n', c->inlen - (line - c->in))) != NULL)
+    {
+        char *args[BATCH_MAX_ARGS];
+        struct gpio_cmd cmd;
+        char *saveptr;
+        int nargs = 0;
+        char *tok;
+
+        *end = '\0';
+        for (tok = strtok_r(line, " \t\r", &saveptr);
+             tok && nargs < BATCH_MAX_ARGS;
+             tok = strtok_r(NULL, " \t\r", &saveptr))
+            args[nargs++] = tok;
+        line = end + 1;
+
+        if (!nargs || args[0][0] == '#')
+            continue;
+
+        if (tok)
+            fprintf(c->reply, "Too many arguments\nERR\n");
+        else if (parse_cmd(c->reply, nargs, args, &cmd) ||
+                 serve_cmd(c->reply, round, &cmd))
+            fprintf(c->reply, "ERR\n");
+        else if (cmd.type == CMD_SET && round->plan_pending)
+            serve_hold(c, round);
+        else
+            fprintf(c->reply, "OK\n");
+    }
+
+    c->inlen -= line - c->in;
+    memmove(c->in, line, c->inlen);
+}
 
-    if (pull < 0 || pull > 2) return -1;
+/* Returns 0 once everything queued has been sent */
+static int serve_flush(struct serve_client *c)
+{
+    while (c->outsent < c->outlen)
+    {
+        ssize_t n = send(c->fd, c->out + c->outsent, c->outlen - c->outsent, MSG_NOSIGNAL);
 
-    chip->base[GPPUD] = pull;
-    usleep(10);
-    chip->base[clkreg] = clkbit;
-    usleep(10);
-    chip->base[GPPUD] = 0;
-    usleep(10);
-    chip->base[clkreg] = 0;
-    usleep(10);
+        if (n < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        c->outsent += n;
+    }
 
+    c->outlen = c->outsent = 0;
     return 0;
 }
 
-static int bcm2835_next_reg(int reg)
+static void serve_close(int epfd, struct serve_client *c)
 {
-    if (reg < 0)
-        return 0;
-    else if (reg == GPPUDCLK1)
-        return -1;
-    return reg + 1;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->out);
+    free(c->held);
+    free(c);
 }
 
-static int bcm2711_get_pull(struct gpio_chip *chip, unsigned int gpio)
+/* Queues the round's replies for sending, with the held sets' statuses filled in */
+static int serve_queue(struct serve_client *c, const struct serve_round *round)
 {
-    int reg = GPPUPPDN0 + (gpio / 16);
-    int lsb = (gpio % 16) * 2;
-
-    if (gpio >= chip->gpio_count)
+    size_t len = c->reply_len;
+    size_t from = 0;
+    char *out;
+    int i;
+
+    for (i = 0; i < c->nheld; i++)
+        len += strlen(serve_status(round, c->held[i].commit));
+    if (!len)
+        return 0;
+    if ((out = realloc(c->out, c->outlen + len)) == NULL)
+    {
+        c->nheld = 0;
         return -1;
+    }
+    c->out = out;
 
-    switch ((chip->base[reg] >> lsb) & 3)
+    for (i = 0; i <= c->nheld; i++)
     {
-    case 0: return PULL_NONE;
-    case 1: return PULL_UP;
-    case 2: return PULL_DOWN;
+        size_t to = i < c->nheld ? c->held[i].offset : c->reply_len;
+
+        memcpy(c->out + c->outlen, c->reply_buf + from, to - from);
+        c->outlen += to - from;
+        from = to;
+        if (i < c->nheld)
+        {
+            const char *status = serve_status(round, c->held[i].commit);
+
+            memcpy(c->out + c->outlen, status, strlen(status));
+            c->outlen += strlen(status);
+        }
     }
-    return -1;
+    c->nheld = 0;
+    return 0;
 }
 
-static int bcm2711_set_pull(struct gpio_chip *chip, unsigned int gpio, int pull)
+/*
+  Serves get/set/funcs/raw/events/group/stats requests, one per line in the batch syntax, to
+  any number of clients connected to a Unix domain socket. Each request is
+  answered with its output followed by "OK" or "ERR" on a line of its own.
+*/
+int run_serve(const char *path)
 {
-    int reg = GPPUPPDN0 + (gpio / 16);
-    int lsb = (gpio % 16) * 2;
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    struct serve_client *ready[SERVE_MAX_EVENTS];
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+    struct stat st;
+    int listenfd;
+    int epfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("Socket path too long\n");
+        return 1;
+    }
 
-    if (gpio >= chip->gpio_count)
-        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
 
-    switch (pull)
+    /* Replace a stale socket left by a previous server */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenfd < 0 ||
+        bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, SOMAXCONN) < 0)
     {
-    case PULL_NONE:
-        pull = 0;
-        break;
-    case PULL_UP:
-        pull = 1;
-        break;
-    case PULL_DOWN:
-        pull = 2;
-        break;
-    default:
-        return -1;
+        printf("Unable to listen on %s: %s\n", path, strerror(errno));
+        return 1;
     }
 
-    chip->base[reg] = (chip->base[reg] & ~(3 << lsb)) | (pull << lsb);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+    {
+        printf("epoll failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    signal(SIGINT, serve_signal);
+    signal(SIGTERM, serve_signal);
+
+    while (!serve_stop)
+    {
+        struct serve_round round;
+        int nready = 0;
+        int n, i;
+
+        n = epoll_wait(epfd, events, SERVE_MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            struct serve_client *c = events[i].data.ptr;
+
+            if (!c)
+            {
+                int fd;
+
+                while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    if ((c = calloc(1, sizeof(*c))) == NULL)
+                    {
+                        close(fd);
+                        continue;
+                    }
+                    c->fd = fd;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT)
+            {
+                if (serve_flush(c) < 0 || (!c->outlen && c->closing))
+                {
+                    serve_close(epfd, c);
+                    continue;
+                }
+                if (!c->outlen)
+                {
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                }
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                ssize_t len;
+
+                while ((len = recv(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen, 0)) > 0)
+                {
+                    c->inlen += len;
+                    if (c->inlen == sizeof(c->in))
+                        break;
+                }
+                if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                    c->closing = 1;
+                ready[nready++] = c;
+            }
+        }
 
+        memset(&round, 0, sizeof(round));
+        for (i = 0; i < nready; i++)
+        {
+            struct serve_client *c = ready[i];
+
+            c->reply = open_memstream(&c->reply_buf, &c->reply_len);
+            serve_lines(c, &round);
+            if (c->inlen == sizeof(c->in))
+            {
+                /* A line that can never fit the buffer */
+                fprintf(c->reply, "Line too long\nERR\n");
+                c->inlen = 0;
+                c->closing = 1;
+            }
+        }
+        serve_commit(&round);
+
+        for (i = 0; i < nready; i++)
+        {
+            struct serve_client *c = ready[i];
+            int ret;
+
+            fclose(c->reply);
+            ret = serve_queue(c, &round);
+            free(c->reply_buf);
+
+            if (ret == 0)
+                ret = serve_flush(c);
+            if (ret < 0 || (ret == 0 && c->closing))
+            {
+                serve_close(epfd, c);
+            }
+            else if (ret > 0)
+            {
+                ev.events = EPOLLOUT;
+                ev.data.ptr = c;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+            }
+        }
+
+        for (i = 0; i < round.nfailed; i++)
+            free(round.failed[i].status);
+        free(round.failed);
+    }
+
+    close(epfd);
+    close(listenfd);
+    unlink(path);
     return 0;
 }
 
-static int bcm2711_next_reg(int reg)
+int main(int argc, char *argv[])
 {
-    /* Skip over non-GPIO registers */
-    if (reg < 0)
+    static char batch_outbuf[65536];
+    struct gpio_cmd cmd;
+    const char *env;
+    int fd;
+    int i;
+
+    timing_start = clock_ns(CLOCK_MONOTONIC);
+    argv++;
+    argc--;
+
+    /*
+      A batch's output is only flushed at the end unless asked to flush per
+      line. The buffer must be in place before anything is printed, so look
+      past the options and chip index for the command now.
+    */
+    for (i = 0; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+        ;
+    if (i < argc && isdigit((unsigned char)*argv[i]))
+        i++;
+    if (i < argc && strcmp(argv[i], "batch") == 0)
+        setvbuf(stdout, batch_outbuf, _IOFBF, sizeof(batch_outbuf));
+
+    chip_name = getenv("RASPI_GPIO_CHIP");
+    sim_image = getenv("RASPI_GPIO_SIM");
+    sim_loops = getenv("RASPI_GPIO_SIM_LOOP");
+    if ((env = getenv("RASPI_GPIO_ADD_CHIPS")) != NULL && add_chips(env))
+        return 1;
+    no_notice = (env = getenv("RASPI_GPIO_NO_NOTICE")) != NULL && *env && strcmp(env, "0") != 0;
+    timing = (env = getenv("RASPI_GPIO_TIMING")) != NULL && *env && strcmp(env, "0") != 0;
+    if ((env = getenv("RASPI_GPIO_SAFE")) != NULL && *env && strcmp(env, "0") != 0)
+        safe_lock = strcmp(env, "1") == 0 ? SAFE_LOCK_FILE : env;
+    if ((env = getenv("RASPI_GPIO_STATS")) != NULL && *env && strcmp(env, "0") != 0)
+        stats_format = stats_arg(env);
+    if ((env = getenv("RASPI_GPIO_TRACE")) != NULL && *env)
+        trace_file = env;
+
+
+    while (argc && strncmp(*argv, "--", 2) == 0)
+    {
+        const char *opt = *(argv++);
+        argc--;
+
+        if (strncmp(opt, "--chip=", 7) == 0)
+            chip_name = opt + 7;
+        else if (strncmp(opt, "--sim=", 6) == 0)
+            sim_image = opt + 6;
+        else if (strncmp(opt, "--loop=", 7) == 0)
+            sim_loops = opt + 7;
+        else if (strncmp(opt, "--add-chip=", 11) == 0)
+        {
+            if (add_chips(opt + 11))
+                return 1;
+        }
+        else if (strcmp(opt, "--format=text") == 0)
+            out_format = FORMAT_TEXT;
+        else if (strcmp(opt, "--format=json") == 0)
+            out_format = FORMAT_JSON;
+        else if (strcmp(opt, "--format=csv") == 0)
+            out_format = FORMAT_CSV;
+        else if (strcmp(opt, "--format=bin") == 0)
+            out_format = FORMAT_BIN;
+        else if (strcmp(opt, "--no-notice") == 0)
+            no_notice = 1;
+        else if (strcmp(opt, "--timing") == 0)
+            timing = 1;
+        else if (strcmp(opt, "--safe") == 0)
+            safe_lock = SAFE_LOCK_FILE;
+        else if (strncmp(opt, "--safe=", 7) == 0)
+            safe_lock = opt + 7;
+        else if (strcmp(opt, "--stats") == 0 ||
+                 (strncmp(opt, "--stats=", 8) == 0 && stats_arg(opt + 8) >= 0))
+            stats_format = stats_arg(opt[7] ? opt + 8 : "");
+        else if (strncmp(opt, "--trace=", 8) == 0)
+            trace_file = opt + 8;
+        else if (strncmp(opt, "--trace-records=", 16) == 0)
+            trace_records = strtoul(opt + 16, NULL, 0);
+        else
+        {
+            printf("Unknown option \"%s\" try \"raspi-gpio help\"\n", opt);
+            return 1;
+        }
+    }
+
+    /* An optional chip index comes before the command */
+    if (argc && **argv >= '0' && **argv <= '9')
+    {
+        char *end;
+        long n = strtol(*argv, &end, 10);
+
+        if (*end || n > added_count)
+        {
+            printf("No GPIO chip \"%s\" - try \"raspi-gpio chips\"\n", *argv);
+            return 1;
+        }
+        chip_index = n;
+        argv++;
+        argc--;
+    }
+
+    if (!argc)
+    {
+        printf("No arguments given - try \"raspi-gpio help\"\n");
+        return 1;
+    }
+
+    if (timing)
+        atexit(timing_report);
+
+    if (strcmp(*argv, "help") == 0)
+    {
+        print_help();
         return 0;
-    else if (reg == GPPUPPDN3)
-        return -1;
-    else if (reg == GPPUDCLK1)
-        return GPPUPPDN0;
-    return reg + 1;
+    }
+
+    if (strcmp(*argv, "vcd") == 0)
+    {
+        FILE *out = stdout;
+        int ret;
+
+        if (argc < 2 || argc > 3)
+        {
+            printf("Need a capture file (and optionally a VCD file) to convert\n");
+            return 1;
+        }
+        if (argc == 3 && (out = fopen(argv[2], "w")) == NULL)
+        {
+            printf("Can't open '%s': %s\n", argv[2], strerror(errno));
+            return 1;
+        }
+        ret = run_vcd(argv[1], out);
+        if (out != stdout)
+            fclose(out);
+        return ret;
+    }
+
+    /* Listing a trace needs no chip */
+    if (strcmp(*argv, "replay") == 0 && argc == 3 && strcmp(argv[1], "-l") == 0)
+        return run_replay(NULL, argv[2], 0, 0, 1);
+
+    /* The simulator needs no device tree; it is a bcm2835 unless told otherwise */
+    if (sim_image && !chip_name)
+        chip_name = "bcm2835";
+
+    chip = new_chip(chip_index);
+    if (!chip)
+    {
+        printf("%s\n", gpio_last_error());
+        return 1;
+    }
+    if (*gpio_last_error())
+        printf("%s\n", gpio_last_error());
+    timing_mark("detect");
+
+    if ((env = getenv("RASPI_GPIO_PUD_DELAY")) != NULL)
+        gpio_chip_set_pud_delay(chip, strtoul(env, NULL, 0));
+    if (safe_lock && gpio_chip_set_safe(chip, safe_lock, SAFE_RETRIES))
+    {
+        printf("%s\n", gpio_last_error());
+        return 1;
+    }
+
+    if (strcmp(*argv, "chips") == 0)
+    {
+        return run_chips();
+    }
+    else if (strcmp(*argv, "batch") == 0)
+    {
+        const char *file = NULL;
+        int flush_lines = 0;
+        FILE *in = stdin;
+        int ret;
+
+        while (--argc)
+        {
+            const char *arg = *(++argv);
+
+            if (strcmp(arg, "-l") == 0)
+                flush_lines = 1;
+            else if (!file)
+                file = arg;
+            else
+            {
+                printf("Too many arguments\n");
+                return 1;
+            }
+        }
+
+        if (file && strcmp(file, "-") != 0 && (in = fopen(file, "r")) == NULL)
+        {
+            printf("Can't open '%s': %s\n", file, strerror(errno));
+            return 1;
+        }
+
+        if (map_chip())
+            return 1;
+        ret = run_batch(in, flush_lines);
+        if (in != stdin)
+            fclose(in);
+        fflush(stdout);
+        if (ret)
+            return 1;
+    }
+    else if (strcmp(*argv, "serve") == 0)
+    {
+        if (argc != 2)
+        {
+            printf("Need a socket path to serve on\n");
+            return 1;
+        }
+        if (map_chip())
+            return 1;
+        return run_serve(argv[1]);
+    }
+    else if (strcmp(*argv, "capture") == 0)
+    {
+        uint32_t gpiomask[GPIO_MAX_BANKS] = { 0 };
+        const char *p;
+        double seconds;
+        char *end;
+
+        if (argc != 4)
+        {
+            printf("Need GPIO, duration and file to capture\n");
+            return 1;
+        }
+        if ((p = gpio_parse_pins(chip, argv[1], gpiomask)) != NULL)
+        {
+            printf("Unknown GPIO \"%s\"\n", p);
+            return 1;
+        }
+        seconds = strtod(argv[2], &end);
+        if (*end || seconds <= 0)
+        {
+            printf("Bad duration \"%s\"\n", argv[2]);
+            return 1;
+        }
+        if (map_chip())
+            return 1;
+        return run_capture(chip, gpiomask, seconds, argv[3]);
+    }
+    else if (strcmp(*argv, "measure") == 0)
+    {
+        uint32_t gpiomask[GPIO_MAX_BANKS] = { 0 };
+        const char *p;
+        double seconds;
+        char *end;
+
+        if (argc != 3)
+        {
+            printf("Need GPIO and duration to measure\n");
+            return 1;
+        }
+        if ((p = gpio_parse_pins(chip, argv[1], gpiomask)) != NULL)
+        {
+            printf("Unknown GPIO \"%s\"\n", p);
+            return 1;
+        }
+        seconds = strtod(argv[2], &end);
+        if (*end || seconds <= 0)
+        {
+            printf("Bad duration \"%s\"\n", argv[2]);
+            return 1;
+        }
+        if (map_chip())
+            return 1;
+        return run_measure(chip, gpiomask, seconds);
+    }
+    else if (strcmp(*argv, "bus") == 0)
+    {
+        if (map_chip())
+            return 1;
+        return run_bus(chip, argc, argv);
+    }
+    else if (strcmp(*argv, "bus-write") == 0 || strcmp(*argv, "bus-read") == 0)
+    {
+        if (map_chip())
+            return 1;
+        return run_bus_stream(chip, argc, argv);
+    }
+    else if (strcmp(*argv, "replay") == 0)
+    {
+        double speed = 1;
+        int check = 0;
+        int list = 0;
+        char *end;
+
+        for (argv++, argc--; argc > 1; argv++, argc--)
+        {
+            if (strcmp(*argv, "-c") == 0)
+                check = 1;
+            else if (strcmp(*argv, "-l") == 0)
+                list = 1;
+            else if (strcmp(*argv, "-s") == 0 && argc > 2)
+            {
+                speed = strtod(*++argv, &end);
+                argc--;
+                if (*end || speed < 0)
+                {
+                    printf("Bad speed \"%s\"\n", *argv);
+                    return 1;
+                }
+            }
+            else
+                break;
+        }
+        if (argc != 1)
+        {
+            printf("Need a trace file to replay\n");
+            return 1;
+        }
+        if (!list && map_chip())
+            return 1;
+        return run_replay(chip, *argv, speed, check, list);
+    }
+    else if (strcmp(*argv, "play") == 0)
+    {
+        FILE *in = stdin;
+        int ret;
+
+        if (argc != 2)
+        {
+            printf("Need a waveform file to play\n");
+            return 1;
+        }
+        if (strcmp(argv[1], "-") != 0 && (in = fopen(argv[1], "r")) == NULL)
+        {
+            printf("Can't open '%s': %s\n", argv[1], strerror(errno));
+            return 1;
+        }
+        if (map_chip())
+            return 1;
+        ret = run_play(chip, in);
+        if (in != stdin)
+            fclose(in);
+        return ret;
+    }
+    else if (strcmp(*argv, "save") == 0 || strcmp(*argv, "diff") == 0 ||
+             strcmp(*argv, "restore") == 0)
+    {
+        if (argc != 2)
+        {
+            printf("Need a state file to %s\n", *argv);
+            return 1;
+        }
+        if (map_chip())
+            return 1;
+        if (strcmp(*argv, "save") == 0)
+            return run_save(chip, argv[1]);
+        else if (strcmp(*argv, "diff") == 0)
+            return run_diff(chip, argv[1]);
+        return run_restore(chip, argv[1]);
+    }
+    else if (strcmp(*argv, "pwm") == 0)
+    {
+        double seconds = 0;
+        char *end;
+
+        argv++;
+        argc--;
+        if (argc >= 2 && strcmp(*argv, "-t") == 0)
+        {
+            seconds = strtod(argv[1], &end);
+            if (*end || seconds <= 0)
+            {
+                printf("Bad duration \"%s\"\n", argv[1]);
+                return 1;
+            }
+            argv += 2;
+            argc -= 2;
+        }
+        if (!argc)
+        {
+            printf("Need at least one <GPIO>:<frequency>:<duty> channel\n");
+            return 1;
+        }
+        if (map_chip())
+            return 1;
+        return run_pwm(chip, argc, argv, seconds);
+    }
+    else
+    {
+        if (parse_cmd(stdout, argc, argv, &cmd))
+            return 1;
+
+        if (cmd.type != CMD_FUNCS && map_chip())
+            return 1;
+
+        if (run_cmd(stdout, &cmd))
+            return 1;
+    }
+
+    if (!no_notice && isatty(STDOUT_FILENO))
+    {
+        fd = open("/tmp/raspi-gpio-deprecated", O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        if (fd >= 0)
+        {
+            printf("[ raspi-gpio is deprecated - try `pinctrl` instead ]\n");
+            close(fd);
+        }
+    }
+
+    return 0;
 }
@@ -0,0 +1,214 @@
+/*
+  libraspigpio internals: the chip description and register map, shared
+  by the library sources but not installed.
+*/
+
+#ifndef RASPIGPIO_PRIV_H
+#define RASPIGPIO_PRIV_H
+
+#include <stdint.h>
+
+#include "raspigpio.h"
+
+#define GPIO_BASE_OFFSET 0x00200000
+
+/* 2835 register offsets */
+#define GPFSEL0      0
+#define GPFSEL1      1
+#define GPFSEL2      2
+#define GPFSEL3      3
+#define GPFSEL4      4
+#define GPFSEL5      5
+#define GPSET0       7
+#define GPSET1       8
+#define GPCLR0       10
+#define GPCLR1       11
+#define GPLEV0       13
+#define GPLEV1       14
+#define GPEDS0       16        /* Event detect status, write 1 to clear */
+#define GPEDS1       17
+#define GPREN0       19        /* Rising edge detect enable */
+#define GPREN1       20
+#define GPFEN0       22        /* Falling edge detect enable */
+#define GPFEN1       23
+#define GPHEN0       25        /* High level detect enable */
+#define GPHEN1       26
+#define GPLEN0       28        /* Low level detect enable */
+#define GPLEN1       29
+#define GPAREN0      31        /* Async rising edge detect enable */
+#define GPAREN1      32
+#define GPAFEN0      34        /* Async falling edge detect enable */
+#define GPAFEN1      35
+#define GPPUD        37
+#define GPPUDCLK0    38
+#define GPPUDCLK1    39
+
+/* 2711 has a different mechanism for pin pull-up/down/enable  */
+#define GPPUPPDN0    57        /* Pin pull-up/down for pins 15:0  */
+#define GPPUPPDN1    58        /* Pin pull-up/down for pins 31:16 */
+#define GPPUPPDN2    59        /* Pin pull-up/down for pins 47:32 */
+#define GPPUPPDN3    60        /* Pin pull-up/down for pins 57:48 */
+
+/*
+  Minimum GPPUD setup/hold time. The datasheet asks for 150 cycles of the
+  VideoCore core clock, which the ARM can only learn by asking the firmware
+  through the mailbox, far slower than the wait itself; so this is a fixed
+  conservative bound rather than a calibrated one. 150 cycles are 600ns at
+  the usual 250MHz, and 1000ns covers any core clock down to 150MHz.
+*/
+#define GPIO_PUD_DELAY_NS 1000
+
+/* The enable register pair for each EVENT_* bit, GPREN0 onwards every 3 */
+#define GPIO_EVENT_REG(type) (GPREN0 + 3 * (type))
+
+struct gpio_sim_state;
+struct gpio_alt_entry;
+
+/* Where each pin's GPFSEL and GPPUPPDN fields are, indexed by GPIO */
+struct gpio_pin_loc
+{
+    uint8_t fsel_reg;              /* GPFSEL0 + gpio / 10 */
+    uint8_t fsel_lsb;              /* (gpio % 10) * 3 */
+    uint8_t pull_reg;              /* gpio / 16, from the chip's pull_reg */
+    uint8_t pull_lsb;              /* (gpio % 16) * 2 */
+};
+
+extern const struct gpio_pin_loc gpio_pin_locs[32 * GPIO_MAX_BANKS];
+extern const uint8_t gpio_fsel_to_hw[8];
+extern const int8_t gpio_fsel_from_hw[8];
+
+struct gpio_chip
+{
+    const char *name;
+    uint32_t reg_base;
+    uint32_t reg_size;
+    unsigned int gpio_count;
+    unsigned int fsel_count;
+    const char *info_header;
+    const char **alt_names;
+    const int *default_pulls;
+    unsigned int pull_reg;         /* First readable pull register, 0 if none */
+    const int *pull_from_hw;       /* Decodes a 2-bit pull field */
+
+    /* Only the bulk operations differ enough between chips to need these;
+       single pins are handled inline, with pull_reg telling them apart */
+    int (*set_pulls)(struct gpio_chip *chip, const struct gpio_plan *plan);
+    int (*next_reg)(int reg);
+
+    volatile uint32_t *base;
+    unsigned long pud_delay_ns;    /* Minimum GPPUD setup/hold time */
+    struct gpio_sim_state *sim;    /* Non-NULL if base is a simulated image */
+
+    /* alt_names sorted by name, built on the first lookup by name */
+    struct gpio_alt_entry *alt_index;
+    unsigned int alt_index_count;
+
+    /* Safe mode, from gpio_chip_set_safe */
+    int lock_fd;                   /* Advisory lock file, -1 if none */
+    unsigned int lock_depth;
+    unsigned int rmw_retries;      /* Verified read-modify-writes if non-zero */
+    struct gpio_contention contention;
+
+    struct gpio_stats *stats;      /* From gpio_chip_set_stats, NULL if off */
+    struct gpio_trace_header *trace; /* Mapped file from gpio_chip_set_trace, NULL if off */
+    size_t trace_size;
+    int observed;                  /* Either of stats or trace on, one test per access */
+};
+
+void gpio_set_error(const char *fmt, ...);
+void gpio_sim_write(struct gpio_chip *chip, unsigned int reg, uint32_t val);
+void gpio_reg_rmw_verified(struct gpio_chip *chip, unsigned int reg,
+                           uint32_t mask, uint32_t bits);
+void gpio_reg_observe(struct gpio_chip *chip, int op, unsigned int reg,
+                      uint32_t val, uint32_t mask);
+
+/*
+  All register accesses go through these. Reads always come straight from
+  the mapping; a simulated image keeps its readable registers up to date
+  on every write. With statistics or tracing on, each access is counted
+  or recorded, a write along with the bits it was meant to change.
+*/
+static inline uint32_t gpio_reg_read(struct gpio_chip *chip, unsigned int reg)
+{
+    uint32_t val = chip->base[reg];
+
+    if (chip->observed)
+        gpio_reg_observe(chip, GPIO_TRACE_READ, reg, val, 0);
+    return val;
+}
+
+static inline void gpio_reg_write_masked(struct gpio_chip *chip, unsigned int reg,
+                                         uint32_t val, uint32_t mask)
+{
+    if (chip->observed)
+        gpio_reg_observe(chip, GPIO_TRACE_WRITE, reg, val, mask);
+    if (chip->sim)
+        gpio_sim_write(chip, reg, val);
+    else
+        chip->base[reg] = val;
+}
+
+static inline void gpio_reg_write(struct gpio_chip *chip, unsigned int reg, uint32_t val)
+{
+    gpio_reg_write_masked(chip, reg, val, ~0u);
+}
+
+/* Replaces the bits of reg in mask with those of bits, if they differ */
+static inline void gpio_reg_rmw(struct gpio_chip *chip, unsigned int reg,
+                                uint32_t mask, uint32_t bits)
+{
+    uint32_t old;
+
+    if (chip->rmw_retries)
+    {
+        gpio_reg_rmw_verified(chip, reg, mask, bits);
+        return;
+    }
+
+    old = gpio_reg_read(chip, reg);
+
+    if (((old & ~mask) | bits) != old)
+        gpio_reg_write_masked(chip, reg, (old & ~mask) | bits, mask);
+}
+
+/*
+  Single pin accesses, with no bounds checks: gpio must be below the
+  chip's gpio_count and fsel one of FUNC_IP..FUNC_A5.
+*/
+static inline int gpio_pin_level(struct gpio_chip *chip, unsigned int gpio)
+{
+    return (gpio_reg_read(chip, GPLEV0 + gpio / 32) >> (gpio % 32)) & 1;
+}
+
+static inline int gpio_pin_fsel(struct gpio_chip *chip, unsigned int gpio)
+{
+    const struct gpio_pin_loc *loc = &gpio_pin_locs[gpio];
+
+    return gpio_fsel_from_hw[(gpio_reg_read(chip, loc->fsel_reg) >> loc->fsel_lsb) & 7];
+}
+
+static inline int gpio_pin_pull(struct gpio_chip *chip, unsigned int gpio)
+{
+    const struct gpio_pin_loc *loc = &gpio_pin_locs[gpio];
+
+    /* The bcm2835 mechanism is write-only */
+    if (!chip->pull_reg)
+        return PULL_UNSET;
+    return chip->pull_from_hw[(gpio_reg_read(chip, chip->pull_reg + loc->pull_reg) >>
+                               loc->pull_lsb) & 3];
+}
+
+static inline void gpio_pin_set_level(struct gpio_chip *chip, unsigned int gpio, int level)
+{
+    gpio_reg_write(chip, (level ? GPSET0 : GPCLR0) + gpio / 32, 1u << (gpio % 32));
+}
+
+static inline void gpio_pin_set_fsel(struct gpio_chip *chip, unsigned int gpio, int fsel)
+{
+    const struct gpio_pin_loc *loc = &gpio_pin_locs[gpio];
+
+    gpio_reg_rmw(chip, loc->fsel_reg, 7u << loc->fsel_lsb,
+                 (uint32_t)gpio_fsel_to_hw[fsel] << loc->fsel_lsb);
+}
+
+#endif
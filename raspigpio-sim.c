@@ -0,0 +1,195 @@
+/*
+  libraspigpio simulated backend: a register image in a file (or shared
+  memory, e.g. under /dev/shm) that behaves like the real GPIO block, so
+  that everything above the register accessors can be run and measured
+  without a Pi.
+
+  Modelled: GPSET/GPCLR write-1-to-act on the output latches, GPLEV
+  following outputs, pulls and loopbacks, the GPPUD/GPPUDCLK pull latching
+  protocol on bcm2835 and GPPUPPDN on bcm2711, and event detection latching
+  into write-1-to-clear GPEDS (the synchronous and asynchronous edge
+  detects being treated alike). The simulation state lives
+  in the image beyond the registers, so every process mapping the same
+  image sees the same pins.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "raspigpio.h"
+#include "raspigpio-priv.h"
+
+#define GPIO_SIM_MAGIC  0x4d495347  /* "GSIM" */
+#define GPIO_SIM_OFFSET 0x800       /* Byte offset of the state in the image */
+
+struct gpio_sim_state
+{
+    uint32_t magic;
+    uint32_t latch[GPIO_MAX_BANKS];     /* Output latches, set by GPSET/GPCLR */
+    uint32_t pulls[GPIO_MAX_PULL_REGS]; /* bcm2835 latched pulls, PULL_* in 2 bits per pin */
+    uint8_t loop[64];                   /* Source pin + 1 that each pin follows, 0 if none */
+};
+
+static int gpio_sim_is_output(struct gpio_chip *chip, unsigned int gpio)
+{
+    return ((chip->base[GPFSEL0 + gpio / 10] >> ((gpio % 10) * 3)) & 7) == 1;
+}
+
+static int gpio_sim_pull(struct gpio_chip *chip, unsigned int gpio)
+{
+    uint32_t word;
+
+    if (chip->pull_reg)
+    {
+        word = chip->base[chip->pull_reg + gpio / 16];
+        return chip->pull_from_hw[(word >> ((gpio % 16) * 2)) & 3];
+    }
+
+    return (chip->sim->pulls[gpio / 16] >> ((gpio % 16) * 2)) & 3;
+}
+
+/* Recomputes GPLEV from the latches, function selects, loopbacks and pulls */
+static void gpio_sim_update(struct gpio_chip *chip)
+{
+    struct gpio_sim_state *sim = chip->sim;
+    uint32_t lev[GPIO_MAX_BANKS];
+    unsigned int gpio;
+    int bank;
+
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+        lev[bank] = chip->base[GPLEV0 + bank];
+
+    for (gpio = 0; gpio < chip->gpio_count; gpio++)
+    {
+        uint32_t bit = 1 << (gpio % 32);
+        unsigned int src = gpio;
+        int level;
+
+        if (!gpio_sim_is_output(chip, gpio) && sim->loop[gpio])
+            src = sim->loop[gpio] - 1;
+
+        if (gpio_sim_is_output(chip, src))
+            level = (sim->latch[src / 32] >> (src % 32)) & 1;
+        else if (gpio_sim_pull(chip, gpio) == PULL_UP)
+            level = 1;
+        else if (gpio_sim_pull(chip, gpio) == PULL_DOWN)
+            level = 0;
+        else
+            continue; /* Floating - keeps its last level */
+
+        lev[gpio / 32] = level ? (lev[gpio / 32] | bit) : (lev[gpio / 32] & ~bit);
+    }
+
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+    {
+        uint32_t old = chip->base[GPLEV0 + bank];
+        uint32_t rise = ~old & lev[bank];
+        uint32_t fall = old & ~lev[bank];
+
+        chip->base[GPLEV0 + bank] = lev[bank];
+        chip->base[GPEDS0 + bank] |=
+            (rise & (chip->base[GPREN0 + bank] | chip->base[GPAREN0 + bank])) |
+            (fall & (chip->base[GPFEN0 + bank] | chip->base[GPAFEN0 + bank])) |
+            (lev[bank] & chip->base[GPHEN0 + bank]) |
+            (~lev[bank] & chip->base[GPLEN0 + bank]);
+    }
+}
+
+void gpio_sim_write(struct gpio_chip *chip, unsigned int reg, uint32_t val)
+{
+    struct gpio_sim_state *sim = chip->sim;
+    unsigned int gpio;
+
+    switch (reg)
+    {
+    case GPSET0:
+    case GPSET1:
+        __atomic_fetch_or(&sim->latch[reg - GPSET0], val, __ATOMIC_SEQ_CST);
+        break;
+
+    case GPCLR0:
+    case GPCLR1:
+        __atomic_fetch_and(&sim->latch[reg - GPCLR0], ~val, __ATOMIC_SEQ_CST);
+        break;
+
+    case GPLEV0:
+    case GPLEV1:
+        return; /* Read only */
+
+    case GPEDS0:
+    case GPEDS1:
+        chip->base[reg] &= ~val;
+        break;
+
+    case GPPUDCLK0:
+    case GPPUDCLK1:
+        /* Clocked pins latch the control value currently in GPPUD */
+        if (!chip->pull_reg && (chip->base[GPPUD] & 3) != 3)
+        {
+            for (gpio = 0; gpio < 32; gpio++)
+            {
+                unsigned int pin = (reg - GPPUDCLK0) * 32 + gpio;
+                uint32_t lsb = (pin % 16) * 2;
+
+                if (val & (1 << gpio))
+                    sim->pulls[pin / 16] = (sim->pulls[pin / 16] & ~(3 << lsb)) |
+                                           ((chip->base[GPPUD] & 3) << lsb);
+            }
+        }
+        chip->base[reg] = val;
+        break;
+
+    default:
+        chip->base[reg] = val;
+        break;
+    }
+
+    gpio_sim_update(chip);
+}
+
+int gpio_chip_map_sim(struct gpio_chip *chip, const char *image)
+{
+    struct gpio_sim_state *sim;
+
+    if (chip->reg_size < GPIO_SIM_OFFSET + sizeof(*sim))
+    {
+        gpio_set_error("Register window too small to simulate");
+        return 1;
+    }
+
+    if (gpio_chip_map(chip, image))
+        return 1;
+
+    sim = (struct gpio_sim_state *)((char *)chip->base + GPIO_SIM_OFFSET);
+    chip->sim = sim;
+
+    if (sim->magic != GPIO_SIM_MAGIC)
+    {
+        struct gpio_plan plan;
+        unsigned int gpio;
+
+        /* A new image comes up as from reset: all inputs, default pulls */
+        memset((void *)chip->base, 0, chip->reg_size);
+        gpio_plan_init(&plan);
+        for (gpio = 0; gpio < chip->gpio_count; gpio++)
+            gpio_plan_pull(&plan, gpio, chip->default_pulls[gpio]);
+        chip->set_pulls(chip, &plan);
+        sim->magic = GPIO_SIM_MAGIC;
+    }
+
+    gpio_sim_update(chip);
+    return 0;
+}
+
+int gpio_sim_loop(struct gpio_chip *chip, unsigned int from, unsigned int to)
+{
+    if (!chip->sim || from >= chip->gpio_count || to >= chip->gpio_count)
+    {
+        gpio_set_error("Invalid loopback %u:%u", from, to);
+        return 1;
+    }
+
+    chip->sim->loop[to] = from + 1;
+    gpio_sim_update(chip);
+    return 0;
+}
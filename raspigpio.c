@@ -0,0 +1,1814 @@
+/*
+  libraspigpio: the register-level GPIO support behind raspi-gpio.
+  Every function works on the chip it is given; there is no global state
+  beyond the per-thread error message.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "raspigpio.h"
+#include "raspigpio-priv.h"
+
+static void bcm2835_set_pull(struct gpio_chip *chip, unsigned int gpio, int pull);
+static int bcm2835_set_pulls(struct gpio_chip *chip, const struct gpio_plan *plan);
+static int bcm2835_next_reg(int reg);
+
+static void bcm2711_set_pull(struct gpio_chip *chip, unsigned int gpio, int pull);
+static int bcm2711_set_pulls(struct gpio_chip *chip, const struct gpio_plan *plan);
+static int bcm2711_next_reg(int reg);
+
+static const char *gpio_alt_names_2835[54*6] =
+{
+    "SDA0"      , "SA5"        , "PCLK"      , "AVEOUT_VCLK"   , "AVEIN_VCLK" , 0           ,
+    "SCL0"      , "SA4"        , "DE"        , "AVEOUT_DSYNC"  , "AVEIN_DSYNC", 0           ,
+    "SDA1"      , "SA3"        , "LCD_VSYNC" , "AVEOUT_VSYNC"  , "AVEIN_VSYNC", 0           ,
+    "SCL1"      , "SA2"        , "LCD_HSYNC" , "AVEOUT_HSYNC"  , "AVEIN_HSYNC", 0           ,
+    "GPCLK0"    , "SA1"        , "DPI_D0"    , "AVEOUT_VID0"   , "AVEIN_VID0" , "ARM_TDI"   ,
+    "GPCLK1"    , "SA0"        , "DPI_D1"    , "AVEOUT_VID1"   , "AVEIN_VID1" , "ARM_TDO"   ,
+    "GPCLK2"    , "SOE_N_SE"   , "DPI_D2"    , "AVEOUT_VID2"   , "AVEIN_VID2" , "ARM_RTCK"  ,
+    "SPI0_CE1_N", "SWE_N_SRW_N", "DPI_D3"    , "AVEOUT_VID3"   , "AVEIN_VID3" , 0           ,
+    "SPI0_CE0_N", "SD0"        , "DPI_D4"    , "AVEOUT_VID4"   , "AVEIN_VID4" , 0           ,
+    "SPI0_MISO" , "SD1"        , "DPI_D5"    , "AVEOUT_VID5"   , "AVEIN_VID5" , 0           ,
+    "SPI0_MOSI" , "SD2"        , "DPI_D6"    , "AVEOUT_VID6"   , "AVEIN_VID6" , 0           ,
+    "SPI0_SCLK" , "SD3"        , "DPI_D7"    , "AVEOUT_VID7"   , "AVEIN_VID7" , 0           ,
+    "PWM0"      , "SD4"        , "DPI_D8"    , "AVEOUT_VID8"   , "AVEIN_VID8" , "ARM_TMS"   ,
+    "PWM1"      , "SD5"        , "DPI_D9"    , "AVEOUT_VID9"   , "AVEIN_VID9" , "ARM_TCK"   ,
+    "TXD0"      , "SD6"        , "DPI_D10"   , "AVEOUT_VID10"  , "AVEIN_VID10", "TXD1"      ,
+    "RXD0"      , "SD7"        , "DPI_D11"   , "AVEOUT_VID11"  , "AVEIN_VID11", "RXD1"      ,
+    "FL0"       , "SD8"        , "DPI_D12"   , "CTS0"          , "SPI1_CE2_N" , "CTS1"      ,
+    "FL1"       , "SD9"        , "DPI_D13"   , "RTS0"          , "SPI1_CE1_N" , "RTS1"      ,
+    "PCM_CLK"   , "SD10"       , "DPI_D14"   , "I2CSL_SDA_MOSI", "SPI1_CE0_N" , "PWM0"      ,
+    "PCM_FS"    , "SD11"       , "DPI_D15"   , "I2CSL_SCL_SCLK", "SPI1_MISO"  , "PWM1"      ,
+    "PCM_DIN"   , "SD12"       , "DPI_D16"   , "I2CSL_MISO"    , "SPI1_MOSI"  , "GPCLK0"    ,
+    "PCM_DOUT"  , "SD13"       , "DPI_D17"   , "I2CSL_CE_N"    , "SPI1_SCLK"  , "GPCLK1"    ,
+    "SD0_CLK"   , "SD14"       , "DPI_D18"   , "SD1_CLK"       , "ARM_TRST"   , 0           ,
+    "SD0_CMD"   , "SD15"       , "DPI_D19"   , "SD1_CMD"       , "ARM_RTCK"   , 0           ,
+    "SD0_DAT0"  , "SD16"       , "DPI_D20"   , "SD1_DAT0"      , "ARM_TDO"    , 0           ,
+    "SD0_DAT1"  , "SD17"       , "DPI_D21"   , "SD1_DAT1"      , "ARM_TCK"    , 0           ,
+    "SD0_DAT2"  , "TE0"        , "DPI_D22"   , "SD1_DAT2"      , "ARM_TDI"    , 0           ,
+    "SD0_DAT3"  , "TE1"        , "DPI_D23"   , "SD1_DAT3"      , "ARM_TMS"    , 0           ,
+    "SDA0"      , "SA5"        , "PCM_CLK"   , "FL0"           , 0            , 0           ,
+    "SCL0"      , "SA4"        , "PCM_FS"    , "FL1"           , 0            , 0           ,
+    "TE0"       , "SA3"        , "PCM_DIN"   , "CTS0"          , 0            , "CTS1"      ,
+    "FL0"       , "SA2"        , "PCM_DOUT"  , "RTS0"          , 0            , "RTS1"      ,
+    "GPCLK0"    , "SA1"        , "RING_OCLK" , "TXD0"          , 0            , "TXD1"      ,
+    "FL1"       , "SA0"        , "TE1"       , "RXD0"          , 0            , "RXD1"      ,
+    "GPCLK0"    , "SOE_N_SE"   , "TE2"       , "SD1_CLK"       , 0            , 0           ,
+    "SPI0_CE1_N", "SWE_N_SRW_N", 0           , "SD1_CMD"       , 0            , 0           ,
+    "SPI0_CE0_N", "SD0"        , "TXD0"      , "SD1_DAT0"      , 0            , 0           ,
+    "SPI0_MISO" , "SD1"        , "RXD0"      , "SD1_DAT1"      , 0            , 0           ,
+    "SPI0_MOSI" , "SD2"        , "RTS0"      , "SD1_DAT2"      , 0            , 0           ,
+    "SPI0_SCLK" , "SD3"        , "CTS0"      , "SD1_DAT3"      , 0            , 0           ,
+    "PWM0"      , "SD4"        , 0           , "SD1_DAT4"      , "SPI2_MISO"  , "TXD1"      ,
+    "PWM1"      , "SD5"        , "TE0"       , "SD1_DAT5"      , "SPI2_MOSI"  , "RXD1"      ,
+    "GPCLK1"    , "SD6"        , "TE1"       , "SD1_DAT6"      , "SPI2_SCLK"  , "RTS1"      ,
+    "GPCLK2"    , "SD7"        , "TE2"       , "SD1_DAT7"      , "SPI2_CE0_N" , "CTS1"      ,
+    "GPCLK1"    , "SDA0"       , "SDA1"      , "TE0"           , "SPI2_CE1_N" , 0           ,
+    "PWM1"      , "SCL0"       , "SCL1"      , "TE1"           , "SPI2_CE2_N" , 0           ,
+    "SDA0"      , "SDA1"       , "SPI0_CE0_N", 0               , 0            , "SPI2_CE1_N",
+    "SCL0"      , "SCL1"       , "SPI0_MISO" , 0               , 0            , "SPI2_CE0_N",
+    "SD0_CLK"   , "FL0"        , "SPI0_MOSI" , "SD1_CLK"       , "ARM_TRST"   , "SPI2_SCLK" ,
+    "SD0_CMD"   , "GPCLK0"     , "SPI0_SCLK" , "SD1_CMD"       , "ARM_RTCK"   , "SPI2_MOSI" ,
+    "SD0_DAT0"  , "GPCLK1"     , "PCM_CLK"   , "SD1_DAT0"      , "ARM_TDO"    , 0           ,
+    "SD0_DAT1"  , "GPCLK2"     , "PCM_FS"    , "SD1_DAT1"      , "ARM_TCK"    , 0           ,
+    "SD0_DAT2"  , "PWM0"       , "PCM_DIN"   , "SD1_DAT2"      , "ARM_TDI"    , 0           ,
+    "SD0_DAT3"  , "PWM1"       , "PCM_DOUT"  , "SD1_DAT3"      , "ARM_TMS"    , 0
+};
+
+static const char *gpio_alt_names_2711[54*6] =
+{
+    "SDA0"      , "SA5"        , "PCLK"      , "SPI3_CE0_N"    , "TXD2"            , "SDA6"        ,
+    "SCL0"      , "SA4"        , "DE"        , "SPI3_MISO"     , "RXD2"            , "SCL6"        ,
+    "SDA1"      , "SA3"        , "LCD_VSYNC" , "SPI3_MOSI"     , "CTS2"            , "SDA3"        ,
+    "SCL1"      , "SA2"        , "LCD_HSYNC" , "SPI3_SCLK"     , "RTS2"            , "SCL3"        ,
+    "GPCLK0"    , "SA1"        , "DPI_D0"    , "SPI4_CE0_N"    , "TXD3"            , "SDA3"        ,
+    "GPCLK1"    , "SA0"        , "DPI_D1"    , "SPI4_MISO"     , "RXD3"            , "SCL3"        ,
+    "GPCLK2"    , "SOE_N_SE"   , "DPI_D2"    , "SPI4_MOSI"     , "CTS3"            , "SDA4"        ,
+    "SPI0_CE1_N", "SWE_N_SRW_N", "DPI_D3"    , "SPI4_SCLK"     , "RTS3"            , "SCL4"        ,
+    "SPI0_CE0_N", "SD0"        , "DPI_D4"    , "I2CSL_CE_N"    , "TXD4"            , "SDA4"        ,
+    "SPI0_MISO" , "SD1"        , "DPI_D5"    , "I2CSL_SDI_MISO", "RXD4"            , "SCL4"        ,
+    "SPI0_MOSI" , "SD2"        , "DPI_D6"    , "I2CSL_SDA_MOSI", "CTS4"            , "SDA5"        ,
+    "SPI0_SCLK" , "SD3"        , "DPI_D7"    , "I2CSL_SCL_SCLK", "RTS4"            , "SCL5"        ,
+    "PWM0_0"    , "SD4"        , "DPI_D8"    , "SPI5_CE0_N"    , "TXD5"            , "SDA5"        ,
+    "PWM0_1"    , "SD5"        , "DPI_D9"    , "SPI5_MISO"     , "RXD5"            , "SCL5"        ,
+    "TXD0"      , "SD6"        , "DPI_D10"   , "SPI5_MOSI"     , "CTS5"            , "TXD1"        ,
+    "RXD0"      , "SD7"        , "DPI_D11"   , "SPI5_SCLK"     , "RTS5"            , "RXD1"        ,
+    0           , "SD8"        , "DPI_D12"   , "CTS0"          , "SPI1_CE2_N"      , "CTS1"        ,
+    0           , "SD9"        , "DPI_D13"   , "RTS0"          , "SPI1_CE1_N"      , "RTS1"        ,
+    "PCM_CLK"   , "SD10"       , "DPI_D14"   , "SPI6_CE0_N"    , "SPI1_CE0_N"      , "PWM0_0"      ,
+    "PCM_FS"    , "SD11"       , "DPI_D15"   , "SPI6_MISO"     , "SPI1_MISO"       , "PWM0_1"      ,
+    "PCM_DIN"   , "SD12"       , "DPI_D16"   , "SPI6_MOSI"     , "SPI1_MOSI"       , "GPCLK0"      ,
+    "PCM_DOUT"  , "SD13"       , "DPI_D17"   , "SPI6_SCLK"     , "SPI1_SCLK"       , "GPCLK1"      ,
+    "SD0_CLK"   , "SD14"       , "DPI_D18"   , "SD1_CLK"       , "ARM_TRST"        , "SDA6"        ,
+    "SD0_CMD"   , "SD15"       , "DPI_D19"   , "SD1_CMD"       , "ARM_RTCK"        , "SCL6"        ,
+    "SD0_DAT0"  , "SD16"       , "DPI_D20"   , "SD1_DAT0"      , "ARM_TDO"         , "SPI3_CE1_N"  ,
+    "SD0_DAT1"  , "SD17"       , "DPI_D21"   , "SD1_DAT1"      , "ARM_TCK"         , "SPI4_CE1_N"  ,
+    "SD0_DAT2"  , 0            , "DPI_D22"   , "SD1_DAT2"      , "ARM_TDI"         , "SPI5_CE1_N"  ,
+    "SD0_DAT3"  , 0            , "DPI_D23"   , "SD1_DAT3"      , "ARM_TMS"         , "SPI6_CE1_N"  ,
+    "SDA0"      , "SA5"        , "PCM_CLK"   , 0               , "MII_A_RX_ERR"    , "RGMII_MDIO"  ,
+    "SCL0"      , "SA4"        , "PCM_FS"    , 0               , "MII_A_TX_ERR"    , "RGMII_MDC"   ,
+    0           , "SA3"        , "PCM_DIN"   , "CTS0"          , "MII_A_CRS"       , "CTS1"        ,
+    0           , "SA2"        , "PCM_DOUT"  , "RTS0"          , "MII_A_COL"       , "RTS1"        ,
+    "GPCLK0"    , "SA1"        , 0           , "TXD0"          , "SD_CARD_PRES"    , "TXD1"        ,
+    0           , "SA0"        , 0           , "RXD0"          , "SD_CARD_WRPROT"  , "RXD1"        ,
+    "GPCLK0"    , "SOE_N_SE"   , 0           , "SD1_CLK"       , "SD_CARD_LED"     , "RGMII_IRQ"   ,
+    "SPI0_CE1_N", "SWE_N_SRW_N", 0           , "SD1_CMD"       , "RGMII_START_STOP", 0             ,
+    "SPI0_CE0_N", "SD0"        , "TXD0"      , "SD1_DAT0"      , "RGMII_RX_OK"     , "MII_A_RX_ERR",
+    "SPI0_MISO" , "SD1"        , "RXD0"      , "SD1_DAT1"      , "RGMII_MDIO"      , "MII_A_TX_ERR",
+    "SPI0_MOSI" , "SD2"        , "RTS0"      , "SD1_DAT2"      , "RGMII_MDC"       , "MII_A_CRS"   ,
+    "SPI0_SCLK" , "SD3"        , "CTS0"      , "SD1_DAT3"      , "RGMII_IRQ"       , "MII_A_COL"   ,
+    "PWM1_0"    , "SD4"        , 0           , "SD1_DAT4"      , "SPI0_MISO"       , "TXD1"        ,
+    "PWM1_1"    , "SD5"        , 0           , "SD1_DAT5"      , "SPI0_MOSI"       , "RXD1"        ,
+    "GPCLK1"    , "SD6"        , 0           , "SD1_DAT6"      , "SPI0_SCLK"       , "RTS1"        ,
+    "GPCLK2"    , "SD7"        , 0           , "SD1_DAT7"      , "SPI0_CE0_N"      , "CTS1"        ,
+    "GPCLK1"    , "SDA0"       , "SDA1"      , 0               , "SPI0_CE1_N"      , "SD_CARD_VOLT",
+    "PWM0_1"    , "SCL0"       , "SCL1"      , 0               , "SPI0_CE2_N"      , "SD_CARD_PWR0",
+    "SDA0"      , "SDA1"       , "SPI0_CE0_N", 0               , 0                 , "SPI2_CE1_N"  ,
+    "SCL0"      , "SCL1"       , "SPI0_MISO" , 0               , 0                 , "SPI2_CE0_N"  ,
+    "SD0_CLK"   , 0            , "SPI0_MOSI" , "SD1_CLK"       , "ARM_TRST"        , "SPI2_SCLK"   ,
+    "SD0_CMD"   , "GPCLK0"     , "SPI0_SCLK" , "SD1_CMD"       , "ARM_RTCK"        , "SPI2_MOSI"   ,
+    "SD0_DAT0"  , "GPCLK1"     , "PCM_CLK"   , "SD1_DAT0"      , "ARM_TDO"         , "SPI2_MISO"   ,
+    "SD0_DAT1"  , "GPCLK2"     , "PCM_FS"    , "SD1_DAT1"      , "ARM_TCK"         , "SD_CARD_LED" ,
+    "SD0_DAT2"  , "PWM0_0"     , "PCM_DIN"   , "SD1_DAT2"      , "ARM_TDI"         , 0             ,
+    "SD0_DAT3"  , "PWM0_1"     , "PCM_DOUT"  , "SD1_DAT3"      , "ARM_TMS"         , 0             ,
+};
+
+#define GPIO_PIN_LOC(n)   { GPFSEL0 + (n) / 10, ((n) % 10) * 3, (n) / 16, ((n) % 16) * 2 }
+#define GPIO_PIN_LOC4(n)  GPIO_PIN_LOC(n), GPIO_PIN_LOC((n) + 1), \
+                          GPIO_PIN_LOC((n) + 2), GPIO_PIN_LOC((n) + 3)
+#define GPIO_PIN_LOC16(n) GPIO_PIN_LOC4(n), GPIO_PIN_LOC4((n) + 4), \
+                          GPIO_PIN_LOC4((n) + 8), GPIO_PIN_LOC4((n) + 12)
+
+const struct gpio_pin_loc gpio_pin_locs[32 * GPIO_MAX_BANKS] =
+{
+    GPIO_PIN_LOC16(0), GPIO_PIN_LOC16(16), GPIO_PIN_LOC16(32), GPIO_PIN_LOC16(48)
+};
+
+/* GPFSEL hardware encoding, indexed by FUNC_IP..FUNC_A5 */
+const uint8_t gpio_fsel_to_hw[8] =
+{
+    0, 1, 4, 5, 6, 7, 3, 2
+};
+
+/* FUNC_* for each GPFSEL hardware encoding */
+const int8_t gpio_fsel_from_hw[8] =
+{
+    FUNC_IP, FUNC_OP, FUNC_A5, FUNC_A4, FUNC_A0, FUNC_A1, FUNC_A2, FUNC_A3
+};
+
+/* The lowest bit of every GPFSEL field */
+#define GPIO_FSEL_LSBS 0x09249249
+
+/* PULL_* for each GPPUPPDN hardware encoding */
+static const int gpio_pull_from_2711[4] =
+{
+    PULL_NONE, PULL_UP, PULL_DOWN, PULL_UNSET
+};
+
+/* GPPUPPDN hardware encoding, indexed by PULL_NONE/DOWN/UP */
+static const uint8_t gpio_pull_to_2711[3] =
+{
+    0, 2, 1
+};
+
+static const char *gpio_pull_names[4] =
+{
+    "NONE", "DOWN", "UP", "?"
+};
+
+/* 0 = none, 1 = down, 2 = up */
+static const int gpio_default_pullstate_2835[54] =
+{
+    2,2,2,2,2,2,2,2,2, /*GPIO0-8 UP*/
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, /*GPIO9-27 DOWN*/
+    0,0, /*GPIO28-29 NONE*/
+    1,1,1,1, /*GPIO30-33 DOWN*/
+    2,2,2, /*GPIO34-36 UP*/
+    1,1,1,1,1,1,1, /*GPIO37-43 DOWN*/
+    0,0, /*GPIO44-45 NONE*/
+    2,2,2,2,2,2,2,2 /*GPIO46-53 UP*/
+};
+
+static const struct gpio_chip gpio_chip_2835 =
+{
+    "bcm2835",
+    0x00200000,
+    0x1000,
+    54,
+    6,
+    "GPIO, DEFAULT PULL, ALT0, ALT1, ALT2, ALT3, ALT4, ALT5",
+    gpio_alt_names_2835,
+    gpio_default_pullstate_2835,
+    0,
+    NULL,
+    bcm2835_set_pulls,
+    bcm2835_next_reg,
+};
+
+static const struct gpio_chip gpio_chip_2711 =
+{
+    "bcm2711",
+    0x00200000,
+    0x1000,
+    54,
+    6,
+    "GPIO, DEFAULT PULL, ALT0, ALT1, ALT2, ALT3, ALT4, ALT5",
+    gpio_alt_names_2711,
+    gpio_default_pullstate_2835,
+    GPPUPPDN0,
+    gpio_pull_from_2711,
+    bcm2711_set_pulls,
+    bcm2711_next_reg,
+};
+
+static __thread char gpio_errbuf[256];
+
+void gpio_set_error(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(gpio_errbuf, sizeof(gpio_errbuf), fmt, ap);
+    va_end(ap);
+}
+
+const char *gpio_last_error(void)
+{
+    return gpio_errbuf;
+}
+
+static const char gpio_revision_file[] = "/proc/device-tree/system/linux,revision";
+
+/*
+  Reads the SoC code from the revision in the device tree. If it can't be
+  read this returns 1 with cpu 0, as earlier kernels had no device tree and
+  were all bcm2835, leaving the reason in gpio_last_error().
+*/
+static int gpio_read_cpu(unsigned int *cpu)
+{
+    uint8_t revision[4];
+    int fd;
+
+    *cpu = 0;
+    if ((fd = open(gpio_revision_file, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        gpio_set_error("Can't open '%s'", gpio_revision_file);
+        return 1;
+    }
+    if (read(fd, revision, sizeof(revision)) != sizeof(revision))
+    {
+        gpio_set_error("Revision data too short");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    *cpu = (revision[2] >> 4) & 0xf;
+    return 0;
+}
+
+static struct gpio_chip *gpio_chip_alloc(const struct gpio_chip *template, uint32_t reg_base)
+{
+    struct gpio_chip *chip = malloc(sizeof(*chip));
+
+    if (!chip)
+    {
+        gpio_set_error("Out of memory");
+        return NULL;
+    }
+    *chip = *template;
+    chip->reg_base = reg_base;
+    chip->base = NULL;
+    chip->pud_delay_ns = GPIO_PUD_DELAY_NS;
+    chip->lock_fd = -1;
+    chip->stats = NULL;
+    chip->trace = NULL;
+    chip->observed = 0;
+
+    return chip;
+}
+
+static struct gpio_chip *gpio_chip_for_cpu(unsigned int cpu)
+{
+    switch (cpu)
+    {
+    case 0: /* BCM2835 */
+        return gpio_chip_alloc(&gpio_chip_2835, 0x20000000 + GPIO_BASE_OFFSET);
+    case 1: /* BCM2836 */
+    case 2: /* BCM2837 */
+        return gpio_chip_alloc(&gpio_chip_2835, 0x3f000000 + GPIO_BASE_OFFSET);
+    case 3: /* BCM2711 */
+        return gpio_chip_alloc(&gpio_chip_2711, 0xfe000000 + GPIO_BASE_OFFSET);
+    case 4: /* BCM2712 */
+        gpio_set_error("raspi-gpio is not supported on Pi 5 - use `pinctrl`");
+        return NULL;
+    default:
+        gpio_set_error("Unrecognised revision code");
+        return NULL;
+    }
+}
+
+struct gpio_chip *gpio_chip_new(const char *name)
+{
+    unsigned int cpu;
+
+    gpio_errbuf[0] = '\0';
+
+    if (!name)
+    {
+        gpio_read_cpu(&cpu);
+        return gpio_chip_for_cpu(cpu);
+    }
+
+    if (strcmp(name, gpio_chip_2835.name) == 0)
+        return gpio_chip_alloc(&gpio_chip_2835, gpio_chip_2835.reg_base);
+    else if (strcmp(name, gpio_chip_2711.name) == 0)
+        return gpio_chip_alloc(&gpio_chip_2711, gpio_chip_2711.reg_base);
+
+    gpio_set_error("Unknown chip \"%s\"", name);
+    return NULL;
+}
+
+static volatile uint32_t *gpio_map_image(struct gpio_chip *chip, const char *path)
+{
+    struct stat st;
+    void *base;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0)
+    {
+        gpio_set_error("Unable to open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == 0 && st.st_size < chip->reg_size &&
+        ftruncate(fd, chip->reg_size) != 0)
+    {
+        gpio_set_error("Unable to size %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(0, chip->reg_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        gpio_set_error("mmap (%s) failed: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    return base;
+}
+
+int gpio_chip_map(struct gpio_chip *chip, const char *image)
+{
+    int fd;
+
+    /* A file-backed register image can stand in for the hardware */
+    if (image)
+    {
+        chip->base = gpio_map_image(chip, image);
+        return chip->base ? 0 : 1;
+    }
+
+    /* Check for /dev/gpiomem, else we need root access for /dev/mem */
+    if ((fd = open ("/dev/gpiomem", O_RDWR | O_SYNC | O_CLOEXEC) ) >= 0)
+    {
+        chip->base = (uint32_t *)mmap(0, chip->reg_size,
+                                      PROT_READ|PROT_WRITE, MAP_SHARED,
+                                      fd, 0);
+        close(fd);
+    }
+    else
+    {
+        if (geteuid())
+        {
+            gpio_set_error("Must be root");
+            return 1;
+        }
+
+        if ((fd = open ("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC) ) < 0)
+        {
+            gpio_set_error("Unable to open /dev/mem: %s", strerror (errno));
+            return 1;
+        }
+
+        chip->base = (uint32_t *)mmap(0, chip->reg_size,
+                                      PROT_READ|PROT_WRITE, MAP_SHARED,
+                                      fd, chip->reg_base);
+        close(fd);
+    }
+
+    if (chip->base == (uint32_t *)-1)
+    {
+        chip->base = NULL;
+        gpio_set_error("mmap (GPIO) failed: %s", strerror (errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+struct gpio_chip *gpio_open(const char *name, const char *image)
+{
+    struct gpio_chip *chip = gpio_chip_new(name);
+
+    if (chip && gpio_chip_map(chip, image))
+    {
+        free(chip);
+        return NULL;
+    }
+
+    return chip;
+}
+
+void gpio_close(struct gpio_chip *chip)
+{
+    if (!chip)
+        return;
+    if (chip->base)
+        munmap((void *)chip->base, chip->reg_size);
+    if (chip->lock_fd >= 0)
+        close(chip->lock_fd);
+    free(chip->alt_index);
+    free(chip->stats);
+    if (chip->trace)
+        munmap(chip->trace, chip->trace_size);
+    free(chip);
+}
+
+const char *gpio_chip_name(const struct gpio_chip *chip)
+{
+    return chip->name;
+}
+
+unsigned int gpio_chip_gpio_count(const struct gpio_chip *chip)
+{
+    return chip->gpio_count;
+}
+
+unsigned int gpio_chip_alt_count(const struct gpio_chip *chip)
+{
+    return chip->fsel_count;
+}
+
+void gpio_chip_set_pud_delay(struct gpio_chip *chip, unsigned long ns)
+{
+    chip->pud_delay_ns = ns;
+}
+
+int gpio_chip_set_safe(struct gpio_chip *chip, const char *lock_file, unsigned int retries)
+{
+    int fd = -1;
+
+    /* Read-only is enough for flock, and lets anyone share a root-created file */
+    if (lock_file &&
+        (fd = open(lock_file, O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644)) < 0)
+    {
+        gpio_set_error("Can't open lock file '%s': %s", lock_file, strerror(errno));
+        return 1;
+    }
+
+    if (chip->lock_fd >= 0)
+        close(chip->lock_fd);
+    chip->lock_fd = fd;
+    chip->lock_depth = 0;
+    chip->rmw_retries = retries;
+    return 0;
+}
+
+static inline uint64_t gpio_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void gpio_lock(struct gpio_chip *chip)
+{
+    uint64_t start;
+
+    if (chip->lock_fd < 0 || chip->lock_depth++)
+        return;
+
+    if (flock(chip->lock_fd, LOCK_EX | LOCK_NB) == 0)
+        return;
+    chip->contention.lock_waits++;
+    start = chip->stats ? gpio_now_ns() : 0;
+    while (flock(chip->lock_fd, LOCK_EX) != 0 && errno == EINTR)
+        ;
+    if (chip->stats)
+        chip->stats->lock_wait_ns += gpio_now_ns() - start;
+}
+
+void gpio_unlock(struct gpio_chip *chip)
+{
+    if (chip->lock_fd < 0 || --chip->lock_depth)
+        return;
+    flock(chip->lock_fd, LOCK_UN);
+}
+
+void gpio_get_contention(const struct gpio_chip *chip, struct gpio_contention *contention)
+{
+    *contention = chip->contention;
+}
+
+int gpio_chip_set_stats(struct gpio_chip *chip, int enable)
+{
+    if (!enable)
+    {
+        free(chip->stats);
+        chip->stats = NULL;
+        chip->observed = chip->trace != NULL;
+        return 0;
+    }
+
+    if (!chip->stats && (chip->stats = malloc(sizeof(*chip->stats))) == NULL)
+    {
+        gpio_set_error("Out of memory");
+        return 1;
+    }
+    gpio_reset_stats(chip);
+    chip->observed = 1;
+    return 0;
+}
+
+int gpio_get_stats(const struct gpio_chip *chip, struct gpio_stats *stats)
+{
+    if (!chip->stats)
+        return -1;
+    *stats = *chip->stats;
+    return 0;
+}
+
+void gpio_reset_stats(struct gpio_chip *chip)
+{
+    if (chip->stats)
+        memset(chip->stats, 0, sizeof(*chip->stats));
+}
+
+const char *gpio_op_name(int op)
+{
+    static const char *names[GPIO_OPS] =
+    {
+        "get_fsel", "get_level", "get_pull", "set_fsel", "set_level", "set_pull",
+        "read_levels", "write_levels", "read_events", "snapshot", "commit"
+    };
+
+    return op >= 0 && op < GPIO_OPS ? names[op] : NULL;
+}
+
+const char *gpio_reg_name(int reg)
+{
+    static const char *names[GPPUPPDN3 + 1] =
+    {
+        [GPFSEL0] = "GPFSEL0", [GPFSEL1] = "GPFSEL1", [GPFSEL2] = "GPFSEL2",
+        [GPFSEL3] = "GPFSEL3", [GPFSEL4] = "GPFSEL4", [GPFSEL5] = "GPFSEL5",
+        [GPSET0] = "GPSET0", [GPSET1] = "GPSET1", [GPCLR0] = "GPCLR0", [GPCLR1] = "GPCLR1",
+        [GPLEV0] = "GPLEV0", [GPLEV1] = "GPLEV1", [GPEDS0] = "GPEDS0", [GPEDS1] = "GPEDS1",
+        [GPREN0] = "GPREN0", [GPREN1] = "GPREN1", [GPFEN0] = "GPFEN0", [GPFEN1] = "GPFEN1",
+        [GPHEN0] = "GPHEN0", [GPHEN1] = "GPHEN1", [GPLEN0] = "GPLEN0", [GPLEN1] = "GPLEN1",
+        [GPAREN0] = "GPAREN0", [GPAREN1] = "GPAREN1", [GPAFEN0] = "GPAFEN0",
+        [GPAFEN1] = "GPAFEN1", [GPPUD] = "GPPUD", [GPPUDCLK0] = "GPPUDCLK0",
+        [GPPUDCLK1] = "GPPUDCLK1", [GPPUPPDN0] = "GPPUPPDN0", [GPPUPPDN1] = "GPPUPPDN1",
+        [GPPUPPDN2] = "GPPUPPDN2", [GPPUPPDN3] = "GPPUPPDN3",
+    };
+
+    return reg >= 0 && reg <= GPPUPPDN3 ? names[reg] : NULL;
+}
+
+/* The kernel's random ID for this boot, or zeros if it can't be read */
+static void gpio_boot_id(uint8_t *id)
+{
+    char text[64];
+    ssize_t len;
+    int fd, i;
+    int n = 0;
+
+    memset(id, 0, 16);
+    if ((fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    len = read(fd, text, sizeof(text));
+    close(fd);
+
+    /* A UUID: 32 hex digits and dashes */
+    for (i = 0; i < len && n < 32; i++)
+    {
+        int c = tolower((unsigned char)text[i]);
+        int digit;
+
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else
+            continue;
+        id[n / 2] |= n % 2 ? digit : digit << 4;
+        n++;
+    }
+}
+
+/*
+  A trace file that already holds a trace of the same chip, made since
+  the last boot, is carried on with, so that the runs of a script
+  accumulate in one ring; anything else is replaced by an empty ring of
+  records slots.
+*/
+int gpio_chip_set_trace(struct gpio_chip *chip, const char *path, unsigned long records)
+{
+    struct gpio_trace_header *trace;
+    uint8_t boot_id[16];
+    struct stat st;
+    size_t size;
+    int fd;
+
+    if (chip->trace)
+    {
+        munmap(chip->trace, chip->trace_size);
+        chip->trace = NULL;
+        chip->observed = chip->stats != NULL;
+    }
+    if (!path)
+        return 0;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 || fstat(fd, &st) < 0)
+    {
+        gpio_set_error("Can't open trace file '%s': %s", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    gpio_boot_id(boot_id);
+    size = st.st_size;
+    if (size >= sizeof(*trace))
+    {
+        trace = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (trace != MAP_FAILED &&
+            (trace->magic != GPIO_TRACE_MAGIC || trace->version != GPIO_TRACE_VERSION ||
+             strncmp(trace->chip, chip->name, sizeof(trace->chip)) != 0 || !trace->capacity ||
+             memcmp(trace->boot_id, boot_id, sizeof(boot_id)) != 0 ||
+             trace->start_ns > gpio_now_ns() ||
+             trace->capacity > (SIZE_MAX - sizeof(*trace)) / sizeof(struct gpio_trace_record) ||
+             size != sizeof(*trace) + trace->capacity * sizeof(struct gpio_trace_record)))
+        {
+            munmap(trace, size);
+            size = 0;
+        }
+        else if (trace == MAP_FAILED)
+        {
+            size = 0;
+        }
+    }
+    else
+    {
+        size = 0;
+    }
+
+    if (!size)
+    {
+        if (records > (SIZE_MAX - sizeof(*trace)) / sizeof(struct gpio_trace_record))
+            records = 0;
+        size = sizeof(*trace) + records * sizeof(struct gpio_trace_record);
+        if (!records || ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0 ||
+            (trace = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        {
+            gpio_set_error("Can't create trace file '%s': %s", path,
+                           records ? strerror(errno) : "no room for records");
+            close(fd);
+            return 1;
+        }
+        /* The truncate zeroed the header, so the name stays terminated */
+        strncpy(trace->chip, chip->name, sizeof(trace->chip) - 1);
+        trace->capacity = records;
+        trace->count = 0;
+        trace->start_ns = gpio_now_ns();
+        memcpy(trace->boot_id, boot_id, sizeof(boot_id));
+        trace->version = GPIO_TRACE_VERSION;
+        trace->magic = GPIO_TRACE_MAGIC;
+    }
+    close(fd);
+
+    chip->trace = trace;
+    chip->trace_size = size;
+    chip->observed = 1;
+    return 0;
+}
+
+/* The out-of-line half of gpio_reg_read and gpio_reg_write_masked */
+void gpio_reg_observe(struct gpio_chip *chip, int op, unsigned int reg,
+                      uint32_t val, uint32_t mask)
+{
+    if (chip->stats)
+    {
+        if (op == GPIO_TRACE_READ)
+            chip->stats->reads[reg]++;
+        else
+            chip->stats->writes[reg]++;
+    }
+
+    if (chip->trace)
+    {
+        struct gpio_trace_header *trace = chip->trace;
+        /* Other processes may be appending to the same file */
+        uint64_t n = __atomic_fetch_add(&trace->count, 1, __ATOMIC_RELAXED);
+        struct gpio_trace_record *rec = &gpio_trace_records(trace)[n % trace->capacity];
+
+        rec->ns = gpio_now_ns() - trace->start_ns;
+        rec->value = val;
+        rec->mask = mask;
+        rec->offset = reg * 4;
+        rec->op = op;
+        memset(rec->reserved, 0, sizeof(rec->reserved));
+    }
+}
+
+uint32_t gpio_read_reg(struct gpio_chip *chip, unsigned int offset)
+{
+    return gpio_reg_read(chip, offset / 4);
+}
+
+void gpio_write_reg(struct gpio_chip *chip, unsigned int offset, uint32_t value)
+{
+    gpio_reg_write(chip, offset / 4, value);
+}
+
+/* Timing of the calls in enum gpio_op; start is 0 with statistics off */
+static inline uint64_t gpio_stats_start(const struct gpio_chip *chip)
+{
+    return chip->stats ? gpio_now_ns() : 0;
+}
+
+static void gpio_stats_record(struct gpio_chip *chip, int op, uint64_t start)
+{
+    struct gpio_op_stats *s = &chip->stats->ops[op];
+    uint64_t ns = gpio_now_ns() - start;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+    s->calls++;
+    s->total_ns += ns;
+    if (!s->min_ns || ns < s->min_ns)
+        s->min_ns = ns;
+    if (ns > s->max_ns)
+        s->max_ns = ns;
+    s->hist[bucket < GPIO_STATS_BUCKETS ? bucket : GPIO_STATS_BUCKETS - 1]++;
+}
+
+static inline void gpio_stats_end(struct gpio_chip *chip, int op, uint64_t start)
+{
+    if (start && chip->stats)
+        gpio_stats_record(chip, op, start);
+}
+
+/*
+  gpio_reg_rmw in safe mode. The register is read back after the write;
+  if the field no longer holds what was written, another writer's stale
+  read-modify-write has replaced it, so it is redone from a fresh read.
+*/
+void gpio_reg_rmw_verified(struct gpio_chip *chip, unsigned int reg,
+                           uint32_t mask, uint32_t bits)
+{
+    unsigned int attempt;
+
+    for (attempt = 0; ; attempt++)
+    {
+        uint32_t old = gpio_reg_read(chip, reg);
+
+        if (((old & ~mask) | bits) != old)
+            gpio_reg_write_masked(chip, reg, (old & ~mask) | bits, mask);
+        if ((gpio_reg_read(chip, reg) & mask) == bits)
+            return;
+
+        if (attempt == chip->rmw_retries)
+        {
+            chip->contention.failures++;
+            gpio_set_error("Register %u was changed by another writer %u times running",
+                           reg, attempt + 1);
+            return;
+        }
+        chip->contention.retries++;
+    }
+}
+
+const char *gpio_alt_name(const struct gpio_chip *chip, unsigned int gpio, int alt)
+{
+    if (gpio >= chip->gpio_count || alt < 0 || alt >= chip->fsel_count)
+        return NULL;
+    return chip->alt_names[gpio * chip->fsel_count + alt];
+}
+
+const char *gpio_fsel_to_namestr(const struct gpio_chip *chip, unsigned int gpio, int fsel)
+{
+    static const char *alt_strs[] = { "alt0", "alt1", "alt2", "alt3", "alt4", "alt5" };
+    const char *name = NULL;
+
+    if (gpio >= chip->gpio_count)
+        return NULL;
+
+    if (fsel == FUNC_IP)
+        return "INPUT";
+    else if (fsel == FUNC_OP)
+        return "OUTPUT";
+
+    fsel -= FUNC_A0;
+    if (fsel >= 0 && fsel < chip->fsel_count)
+        name = chip->alt_names[gpio * chip->fsel_count + fsel];
+    if (!name && fsel >= 0 && fsel < 6)
+        name = alt_strs[fsel];
+
+    return name;
+}
+
+const char *gpio_pull_name(int pull)
+{
+    return gpio_pull_names[pull & 3];
+}
+
+int gpio_default_pull(const struct gpio_chip *chip, unsigned int gpio)
+{
+    if (gpio >= chip->gpio_count)
+        return PULL_UNSET;
+    return chip->default_pulls[gpio];
+}
+
+struct gpio_alt_entry
+{
+    const char *name;
+    uint8_t gpio;
+    uint8_t alt;
+};
+
+static int gpio_alt_entry_cmp(const void *a, const void *b)
+{
+    const struct gpio_alt_entry *x = a;
+    const struct gpio_alt_entry *y = b;
+    int cmp = strcasecmp(x->name, y->name);
+
+    if (cmp)
+        return cmp;
+    return x->gpio != y->gpio ? x->gpio - y->gpio : x->alt - y->alt;
+}
+
+/*
+  The chip's alt function names sorted for binary search. Sorting costs
+  more than a single scan of the table, so it is put off until a lookup
+  by name first needs it, then kept for the life of the chip. Threads
+  racing to build it agree on the one that gets installed.
+*/
+static const struct gpio_alt_entry *gpio_alt_index(const struct gpio_chip *chip,
+                                                   unsigned int *count)
+{
+    struct gpio_chip *cache = (struct gpio_chip *)chip;
+    struct gpio_alt_entry *index = __atomic_load_n(&chip->alt_index, __ATOMIC_ACQUIRE);
+    struct gpio_alt_entry *expected = NULL;
+    unsigned int n = 0;
+    unsigned int i;
+
+    if (!index)
+    {
+        index = malloc(chip->gpio_count * chip->fsel_count * sizeof(*index));
+        if (!index)
+        {
+            *count = 0;
+            return NULL;
+        }
+        for (i = 0; i < chip->gpio_count * chip->fsel_count; i++)
+        {
+            if (!chip->alt_names[i])
+                continue;
+            index[n].name = chip->alt_names[i];
+            index[n].gpio = i / chip->fsel_count;
+            index[n++].alt = i % chip->fsel_count;
+        }
+        qsort(index, n, sizeof(*index), gpio_alt_entry_cmp);
+
+        __atomic_store_n(&cache->alt_index_count, n, __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&cache->alt_index, &expected, index, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            free(index);
+            index = expected;
+        }
+    }
+
+    *count = __atomic_load_n(&chip->alt_index_count, __ATOMIC_RELAXED);
+    return index;
+}
+
+int gpio_find_alt(const struct gpio_chip *chip, const char *name, int prefix,
+                  struct gpio_alt_ref *refs, unsigned int max)
+{
+    size_t len = strlen(name);
+    const struct gpio_alt_entry *index;
+    unsigned int lo = 0, hi;
+    unsigned int found = 0;
+
+    index = gpio_alt_index(chip, &hi);
+
+    /* The first entry not below name; all that match follow it */
+    while (lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (strcasecmp(index[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (hi = chip->alt_index_count; lo < hi; lo++)
+    {
+        if (prefix ? strncasecmp(index[lo].name, name, len) != 0 :
+                     strcasecmp(index[lo].name, name) != 0)
+            break;
+        if (found < max)
+        {
+            refs[found].name = index[lo].name;
+            refs[found].gpio = index[lo].gpio;
+            refs[found].alt = index[lo].alt;
+        }
+        found++;
+    }
+
+    return found;
+}
+
+#define GPIO_GROUP_MAX_SIGNALS 32
+
+/* One signal of a peripheral; optional ones are only placed on pins asked for */
+struct gpio_group_signal
+{
+    char name[24];
+    int optional;
+};
+
+static int gpio_group_add(struct gpio_group_signal *sigs, int count, const char *fmt,
+                          const char *unit, int optional)
+{
+    if (count < GPIO_GROUP_MAX_SIGNALS)
+    {
+        snprintf(sigs[count].name, sizeof(sigs[count].name), fmt, unit);
+        sigs[count++].optional = optional;
+    }
+    return count;
+}
+
+/*
+  The signals making up peripheral name: SDA<n> and SCL<n> for I2C<n>,
+  TXD<n> and RXD<n> (and CTS<n> and RTS<n>) for UART<n>, else every alt
+  function called name_*, the extra SPI chip selects optional, or failing
+  those one called name itself.
+*/
+static int gpio_group_signals(const struct gpio_chip *chip, const char *name,
+                              struct gpio_group_signal *sigs)
+{
+    struct gpio_alt_ref refs[32 * GPIO_MAX_BANKS * 6];
+    size_t len = strlen(name);
+    int count = 0;
+    int found;
+    int i;
+
+    if (strncasecmp(name, "I2C", 3) == 0 && isdigit((unsigned char)name[3]))
+    {
+        count = gpio_group_add(sigs, count, "SDA%s", name + 3, 0);
+        return gpio_group_add(sigs, count, "SCL%s", name + 3, 0);
+    }
+    if (strncasecmp(name, "UART", 4) == 0 && isdigit((unsigned char)name[4]))
+    {
+        count = gpio_group_add(sigs, count, "TXD%s", name + 4, 0);
+        count = gpio_group_add(sigs, count, "RXD%s", name + 4, 0);
+        count = gpio_group_add(sigs, count, "CTS%s", name + 4, 1);
+        return gpio_group_add(sigs, count, "RTS%s", name + 4, 1);
+    }
+
+    /* Matches come sorted by name, so each new signal differs from the last */
+    found = gpio_find_alt(chip, name, 1, refs, sizeof(refs) / sizeof(refs[0]));
+    for (i = 0; i < found && i < sizeof(refs) / sizeof(refs[0]); i++)
+    {
+        const char *sig = refs[i].name;
+
+        if (sig[len] != '_')
+            continue;
+        if (count && strcasecmp(sigs[count - 1].name, sig) == 0)
+            continue;
+        count = gpio_group_add(sigs, count, "%s", sig,
+                               strstr(sig, "_CE1_N") != NULL || strstr(sig, "_CE2_N") != NULL);
+    }
+
+    /* A lone signal such as GPCLK0, but not SD1 (SMI data) when asked for SD1_* */
+    if (!count && found && refs[0].name[len] == '\0')
+        count = gpio_group_add(sigs, count, "%s", refs[0].name, 0);
+
+    return count;
+}
+
+static int gpio_alt_ref_cmp(const void *a, const void *b)
+{
+    const struct gpio_alt_ref *x = a;
+    const struct gpio_alt_ref *y = b;
+
+    return (int)x->gpio - (int)y->gpio;
+}
+
+int gpio_find_group(const struct gpio_chip *chip, const char *name, const uint32_t *gpiomask,
+                    struct gpio_alt_ref *refs, unsigned int max)
+{
+    struct gpio_group_signal sigs[GPIO_GROUP_MAX_SIGNALS];
+    uint32_t used[GPIO_MAX_BANKS] = { 0 };
+    int all_pins = !gpiomask || gpio_mask_empty(gpiomask, GPIO_MAX_BANKS);
+    unsigned int placed = 0;
+    int count;
+    int gpio;
+    int i;
+
+    count = gpio_group_signals(chip, name, sigs);
+    for (i = 0; i < count; i++)
+    {
+        struct gpio_alt_ref cands[32 * GPIO_MAX_BANKS];
+        int found;
+        int c;
+
+        if (sigs[i].optional && all_pins)
+            continue;
+
+        /* The lowest pin, of those asked for, not already taken */
+        found = gpio_find_alt(chip, sigs[i].name, 0, cands, sizeof(cands) / sizeof(cands[0]));
+        for (c = 0; c < found; c++)
+        {
+            if (gpio_mask_test(used, cands[c].gpio) ||
+                (!all_pins && !gpio_mask_test(gpiomask, cands[c].gpio)))
+                continue;
+            gpio_mask_add(used, cands[c].gpio);
+            if (placed < max)
+                refs[placed] = cands[c];
+            placed++;
+            break;
+        }
+
+        if (c == found && all_pins && !sigs[i].optional && found)
+        {
+            gpio_set_error("No GPIO for %s", sigs[i].name);
+            return -1;
+        }
+    }
+
+    if (!placed)
+    {
+        gpio_set_error("Unknown peripheral \"%s\"", name);
+        return -1;
+    }
+
+    if (!all_pins)
+    {
+        gpio_mask_for_each(gpio, gpiomask, GPIO_MAX_BANKS)
+        {
+            if (!gpio_mask_test(used, gpio))
+            {
+                gpio_set_error("GPIO %d has no %s function", gpio, name);
+                return -1;
+            }
+        }
+    }
+
+    if (placed <= max)
+        qsort(refs, placed, sizeof(*refs), gpio_alt_ref_cmp);
+    return placed;
+}
+
+/* Adds every pin with the signal at the start of p, returning its length or 0 */
+static int gpio_parse_signal(const struct gpio_chip *chip, const char *p, uint32_t *gpiomask)
+{
+    struct gpio_alt_ref refs[32 * GPIO_MAX_BANKS];
+    char name[32];
+    int len = 0;
+    int count;
+    int i;
+
+    while ((isalnum((unsigned char)p[len]) || p[len] == '_') && len < sizeof(name) - 1)
+    {
+        name[len] = p[len];
+        len++;
+    }
+    name[len] = '\0';
+
+    count = gpio_find_alt(chip, name, 0, refs, sizeof(refs) / sizeof(refs[0]));
+    if (count <= 0 || (p[len] && p[len] != ','))
+        return 0;
+    for (i = 0; i < count && i < sizeof(refs) / sizeof(refs[0]); i++)
+        gpio_mask_add(gpiomask, refs[i].gpio);
+
+    return len;
+}
+
+const char *gpio_parse_pins(const struct gpio_chip *chip, const char *list, uint32_t *gpiomask)
+{
+    const char *p = list;
+    int ret;
+
+    while (p)
+    {
+        int pin, pin2, len;
+
+        if (isalpha((unsigned char)*p))
+        {
+            if ((len = gpio_parse_signal(chip, p, gpiomask)) == 0)
+                break;
+            p += len;
+            if (*p == '\0')
+                p = NULL;
+            else
+                p++;
+            continue;
+        }
+
+        ret = sscanf(p, "%d%n", &pin, &len);
+        if (ret != 1 || pin < 0 || pin >= chip->gpio_count)
+            break;
+        p += len;
+
+        if (*p == '-')
+        {
+            p++;
+            ret = sscanf(p, "%d%n", &pin2, &len);
+            if (ret != 1 || pin2 < 0 || pin2 >= chip->gpio_count)
+                break;
+            if (pin2 < pin)
+            {
+                int tmp = pin2;
+                pin2 = pin;
+                pin = tmp;
+            }
+            p += len;
+        }
+        else
+        {
+            pin2 = pin;
+        }
+        gpio_mask_add_range(gpiomask, pin, pin2);
+        if (*p == '\0')
+        {
+            p = NULL;
+        }
+        else
+        {
+            if (*p != ',')
+                break;
+            p++;
+        }
+    }
+
+    return p;
+}
+
+int gpio_get_fsel(struct gpio_chip *chip, unsigned int gpio)
+{
+    uint64_t start = gpio_stats_start(chip);
+    int fsel;
+
+    if (gpio >= chip->gpio_count)
+        return -1;
+    fsel = gpio_pin_fsel(chip, gpio);
+    gpio_stats_end(chip, GPIO_OP_GET_FSEL, start);
+    return fsel;
+}
+
+int gpio_get_level(struct gpio_chip *chip, unsigned int gpio)
+{
+    uint64_t start = gpio_stats_start(chip);
+    int level;
+
+    if (gpio >= chip->gpio_count)
+        return -1;
+    level = gpio_pin_level(chip, gpio);
+    gpio_stats_end(chip, GPIO_OP_GET_LEVEL, start);
+    return level;
+}
+
+int gpio_get_pull(struct gpio_chip *chip, unsigned int gpio)
+{
+    uint64_t start = gpio_stats_start(chip);
+    int pull;
+
+    if (gpio >= chip->gpio_count)
+        return -1;
+    pull = gpio_pin_pull(chip, gpio);
+    gpio_stats_end(chip, GPIO_OP_GET_PULL, start);
+    return pull;
+}
+
+int gpio_set_fsel(struct gpio_chip *chip, unsigned int gpio, int fsel)
+{
+    uint64_t failures = chip->contention.failures;
+    uint64_t start = gpio_stats_start(chip);
+
+    if (gpio >= chip->gpio_count || fsel < FUNC_IP || fsel > FUNC_A5)
+        return -1;
+    gpio_lock(chip);
+    gpio_pin_set_fsel(chip, gpio, fsel);
+    gpio_unlock(chip);
+    gpio_stats_end(chip, GPIO_OP_SET_FSEL, start);
+    return chip->contention.failures != failures ? -1 : 0;
+}
+
+int gpio_set_level(struct gpio_chip *chip, unsigned int gpio, int level)
+{
+    uint64_t start = gpio_stats_start(chip);
+
+    if (gpio >= chip->gpio_count)
+        return -1;
+    gpio_pin_set_level(chip, gpio, level);
+    gpio_stats_end(chip, GPIO_OP_SET_LEVEL, start);
+    return 0;
+}
+
+int gpio_set_pull(struct gpio_chip *chip, unsigned int gpio, int pull)
+{
+    uint64_t failures = chip->contention.failures;
+    uint64_t start = gpio_stats_start(chip);
+
+    if (gpio >= chip->gpio_count || pull < PULL_NONE || pull > PULL_UP)
+        return -1;
+    gpio_lock(chip);
+    if (chip->pull_reg)
+        bcm2711_set_pull(chip, gpio, pull);
+    else
+        bcm2835_set_pull(chip, gpio, pull);
+    gpio_unlock(chip);
+    gpio_stats_end(chip, GPIO_OP_SET_PULL, start);
+    return chip->contention.failures != failures ? -1 : 0;
+}
+
+/*
+  The bulk operations below work on whole registers at a time rather than
+  pin by pin. The slice of a pin mask covering a register is taken as one
+  word, then spread out so that each pin's bit lands on the lowest bit of
+  its field; multiplying that by a field value then sets the field for
+  every pin at once.
+*/
+
+/* gpio_mask_field, less any pins beyond the end of the chip */
+static inline uint32_t gpio_chip_field(const struct gpio_chip *chip, const uint32_t *gpiomask,
+                                       unsigned int first, unsigned int n)
+{
+    if (first >= chip->gpio_count)
+        return 0;
+    if (chip->gpio_count - first < n)
+        n = chip->gpio_count - first;
+    return gpio_mask_field(gpiomask, GPIO_MAX_BANKS, first, n);
+}
+
+/* Moves the low 10 bits of x to every third bit, one per GPFSEL field */
+static inline uint32_t gpio_spread3(uint32_t x)
+{
+    x &= 0x3ff;
+    x = (x | x << 16) & 0x030000ff;
+    x = (x | x << 8) & 0x0300f00f;
+    x = (x | x << 4) & 0x030c30c3;
+    x = (x | x << 2) & GPIO_FSEL_LSBS;
+    return x;
+}
+
+/* Moves the low 16 bits of x to every second bit, one per GPPUPPDN field */
+static inline uint32_t gpio_spread2(uint32_t x)
+{
+    x &= 0xffff;
+    x = (x | x << 8) & 0x00ff00ff;
+    x = (x | x << 4) & 0x0f0f0f0f;
+    x = (x | x << 2) & 0x33333333;
+    x = (x | x << 1) & 0x55555555;
+    return x;
+}
+
+void gpio_read_levels(struct gpio_chip *chip, uint32_t *levels)
+{
+    uint64_t start = gpio_stats_start(chip);
+    int bank;
+
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+        levels[bank] = gpio_reg_read(chip, GPLEV0 + bank);
+    gpio_stats_end(chip, GPIO_OP_READ_LEVELS, start);
+}
+
+const volatile uint32_t *gpio_level_regs(struct gpio_chip *chip)
+{
+    return chip->base + GPLEV0;
+}
+
+void gpio_read_events(struct gpio_chip *chip, uint32_t *events, const uint32_t *clear)
+{
+    uint64_t start = gpio_stats_start(chip);
+    int bank;
+
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+    {
+        events[bank] = gpio_reg_read(chip, GPEDS0 + bank);
+        if (clear && (events[bank] & clear[bank]))
+            gpio_reg_write(chip, GPEDS0 + bank, events[bank] & clear[bank]);
+    }
+    gpio_stats_end(chip, GPIO_OP_READ_EVENTS, start);
+}
+
+void gpio_write_levels(struct gpio_chip *chip, const uint32_t *set, const uint32_t *clr)
+{
+    uint64_t start = gpio_stats_start(chip);
+    int bank;
+
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+    {
+        if (set && set[bank])
+            gpio_reg_write(chip, GPSET0 + bank, set[bank]);
+        if (clr && clr[bank])
+            gpio_reg_write(chip, GPCLR0 + bank, clr[bank]);
+    }
+    gpio_stats_end(chip, GPIO_OP_WRITE_LEVELS, start);
+}
+
+void gpio_snapshot_take(struct gpio_chip *chip, struct gpio_snapshot *snap)
+{
+    unsigned int banks = (chip->gpio_count + 31) / 32;
+    uint64_t start = gpio_stats_start(chip);
+    unsigned int i;
+
+    snap->chip = chip;
+    for (i = 0; i < (chip->gpio_count + 9) / 10; i++)
+        snap->regs[GPFSEL0 + i] = gpio_reg_read(chip, GPFSEL0 + i);
+    for (i = 0; i < banks; i++)
+    {
+        int type;
+
+        snap->regs[GPLEV0 + i] = gpio_reg_read(chip, GPLEV0 + i);
+        snap->regs[GPEDS0 + i] = gpio_reg_read(chip, GPEDS0 + i);
+        for (type = 0; type < GPIO_EVENT_TYPES; type++)
+            snap->regs[GPIO_EVENT_REG(type) + i] = gpio_reg_read(chip, GPIO_EVENT_REG(type) + i);
+    }
+    if (chip->pull_reg)
+    {
+        for (i = 0; i < (chip->gpio_count + 15) / 16; i++)
+            snap->regs[chip->pull_reg + i] = gpio_reg_read(chip, chip->pull_reg + i);
+    }
+    gpio_stats_end(chip, GPIO_OP_SNAPSHOT, start);
+}
+
+/* As gpio_snapshot_take, but copies every register listed by next_reg */
+void gpio_snapshot_take_all(struct gpio_chip *chip, struct gpio_snapshot *snap)
+{
+    uint64_t start = gpio_stats_start(chip);
+    int reg;
+
+    memset(snap->regs, 0, sizeof(snap->regs));
+    snap->chip = chip;
+    for (reg = chip->next_reg(-1); reg >= 0; reg = chip->next_reg(reg))
+        snap->regs[reg] = gpio_reg_read(chip, reg);
+    gpio_stats_end(chip, GPIO_OP_SNAPSHOT, start);
+}
+
+int gpio_snapshot_fsel(const struct gpio_snapshot *snap, unsigned int gpio)
+{
+    const struct gpio_pin_loc *loc = &gpio_pin_locs[gpio];
+
+    return gpio_fsel_from_hw[(snap->regs[loc->fsel_reg] >> loc->fsel_lsb) & 7];
+}
+
+int gpio_snapshot_level(const struct gpio_snapshot *snap, unsigned int gpio)
+{
+    return (snap->regs[GPLEV0 + gpio / 32] >> (gpio % 32)) & 1;
+}
+
+int gpio_snapshot_pull(const struct gpio_snapshot *snap, unsigned int gpio)
+{
+    const struct gpio_chip *chip = snap->chip;
+    const struct gpio_pin_loc *loc = &gpio_pin_locs[gpio];
+
+    if (!chip->pull_reg)
+        return PULL_UNSET;
+    return chip->pull_from_hw[(snap->regs[chip->pull_reg + loc->pull_reg] >> loc->pull_lsb) & 3];
+}
+
+/* The EVENT_* detects enabled for gpio */
+int gpio_snapshot_events(const struct gpio_snapshot *snap, unsigned int gpio)
+{
+    int events = 0;
+    int type;
+
+    for (type = 0; type < GPIO_EVENT_TYPES; type++)
+    {
+        if ((snap->regs[GPIO_EVENT_REG(type) + gpio / 32] >> (gpio % 32)) & 1)
+            events |= 1 << type;
+    }
+
+    return events;
+}
+
+/* Whether gpio has a latched event */
+int gpio_snapshot_event(const struct gpio_snapshot *snap, unsigned int gpio)
+{
+    return (snap->regs[GPEDS0 + gpio / 32] >> (gpio % 32)) & 1;
+}
+
+void gpio_snapshot_record(const struct gpio_snapshot *snap, unsigned int gpio,
+                          struct gpio_pin_record *rec)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->gpio = gpio;
+    rec->fsel = gpio_snapshot_fsel(snap, gpio);
+    rec->level = gpio_snapshot_level(snap, gpio);
+    rec->pull = gpio_snapshot_pull(snap, gpio);
+    rec->events = gpio_snapshot_events(snap, gpio);
+    rec->event = gpio_snapshot_event(snap, gpio);
+}
+
+int gpio_next_reg(const struct gpio_chip *chip, int reg)
+{
+    return chip->next_reg(reg);
+}
+
+void gpio_plan_init(struct gpio_plan *plan)
+{
+    memset(plan, 0, sizeof(*plan));
+}
+
+void gpio_plan_fsel(struct gpio_plan *plan, unsigned int gpio, int fsel)
+{
+    const struct gpio_pin_loc *loc = &gpio_pin_locs[gpio];
+    uint32_t reg = loc->fsel_reg - GPFSEL0;
+
+    plan->fsel_mask[reg] |= 7u << loc->fsel_lsb;
+    plan->fsel_bits[reg] = (plan->fsel_bits[reg] & ~(7u << loc->fsel_lsb)) |
+                           ((uint32_t)gpio_fsel_to_hw[fsel] << loc->fsel_lsb);
+}
+
+void gpio_plan_level(struct gpio_plan *plan, unsigned int gpio, int level)
+{
+    uint32_t bit = 1 << (gpio % 32);
+
+    plan->set[gpio / 32] = level ? (plan->set[gpio / 32] | bit) : (plan->set[gpio / 32] & ~bit);
+    plan->clr[gpio / 32] = level ? (plan->clr[gpio / 32] & ~bit) : (plan->clr[gpio / 32] | bit);
+}
+
+void gpio_plan_pull(struct gpio_plan *plan, unsigned int gpio, int pull)
+{
+    uint32_t bit = 1 << (gpio % 32);
+    int p;
+
+    for (p = PULL_NONE; p <= PULL_UP; p++)
+        plan->pull[p][gpio / 32] &= ~bit;
+    plan->pull[pull][gpio / 32] |= bit;
+}
+
+/* Replaces the detects enabled for gpio with the EVENT_* bits in events */
+void gpio_plan_events(struct gpio_plan *plan, unsigned int gpio, int events)
+{
+    uint32_t bit = 1u << (gpio % 32);
+    int type;
+
+    plan->event_mask[gpio / 32] |= bit;
+    for (type = 0; type < GPIO_EVENT_TYPES; type++)
+    {
+        uint32_t en = -(uint32_t)((events >> type) & 1);
+
+        plan->event_en[type][gpio / 32] = (plan->event_en[type][gpio / 32] & ~bit) | (bit & en);
+    }
+}
+
+void gpio_plan_set_events(const struct gpio_chip *chip, struct gpio_plan *plan,
+                          const uint32_t *gpiomask, int events)
+{
+    int bank;
+    int type;
+
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+    {
+        uint32_t bits = gpio_chip_field(chip, gpiomask, 32 * bank, 32);
+
+        plan->event_mask[bank] |= bits;
+        for (type = 0; type < GPIO_EVENT_TYPES; type++)
+        {
+            uint32_t en = -(uint32_t)((events >> type) & 1);
+
+            plan->event_en[type][bank] = (plan->event_en[type][bank] & ~bits) | (bits & en);
+        }
+    }
+}
+
+int gpio_plan_commit(struct gpio_chip *chip, const struct gpio_plan *plan)
+{
+    uint64_t failures = chip->contention.failures;
+    uint64_t start = gpio_stats_start(chip);
+    int ret;
+    int i;
+
+    gpio_lock(chip);
+
+    /* Latch the output levels first so that pins switching to outputs
+       come up driving the requested level */
+    for (i = 0; i < GPIO_MAX_BANKS; i++)
+    {
+        if (plan->set[i])
+            gpio_reg_write(chip, GPSET0 + i, plan->set[i]);
+        if (plan->clr[i])
+            gpio_reg_write(chip, GPCLR0 + i, plan->clr[i]);
+    }
+
+    for (i = 0; i < GPIO_MAX_FSEL_REGS; i++)
+    {
+        if (plan->fsel_mask[i])
+            gpio_reg_rmw(chip, GPFSEL0 + i, plan->fsel_mask[i], plan->fsel_bits[i]);
+    }
+
+    ret = chip->set_pulls(chip, plan);
+
+    /* Detects are enabled last, once the pins have settled */
+    for (i = 0; i < GPIO_MAX_BANKS; i++)
+    {
+        int type;
+
+        for (type = 0; plan->event_mask[i] && type < GPIO_EVENT_TYPES; type++)
+            gpio_reg_rmw(chip, GPIO_EVENT_REG(type) + i, plan->event_mask[i],
+                         plan->event_en[type][i]);
+    }
+
+    gpio_unlock(chip);
+    gpio_stats_end(chip, GPIO_OP_COMMIT, start);
+    return chip->contention.failures != failures ? -1 : ret;
+}
+
+/* The function gpio will have once plan is committed over snap */
+int gpio_plan_fsel_after(const struct gpio_plan *plan, const struct gpio_snapshot *snap,
+                         unsigned int gpio)
+{
+    const struct gpio_pin_loc *loc = &gpio_pin_locs[gpio];
+    uint32_t reg = loc->fsel_reg - GPFSEL0;
+    uint32_t word = (snap->regs[loc->fsel_reg] & ~plan->fsel_mask[reg]) | plan->fsel_bits[reg];
+
+    return gpio_fsel_from_hw[(word >> loc->fsel_lsb) & 7];
+}
+
+/*
+  Adds a set of every pin in gpiomask to plan. snap is only consulted (and
+  may be NULL otherwise) when driving a level without changing function.
+  Returns 1, leaving plan untouched, if drive is set on a non-output.
+*/
+int gpio_plan_set(const struct gpio_chip *chip, struct gpio_plan *plan,
+                  const struct gpio_snapshot *snap, const uint32_t *gpiomask,
+                  int fsparam, int drive, int pull)
+{
+    unsigned int reg;
+    int bank;
+    int p;
+
+    if (drive != DRIVE_UNSET)
+    {
+        if (fsparam != FUNC_UNSET && fsparam != FUNC_OP)
+            return 1;
+
+        /* XOR with the output encoding (1) leaves a non-zero field for
+           any pin that won't be an output */
+        for (reg = 0; fsparam == FUNC_UNSET && reg < GPIO_MAX_FSEL_REGS; reg++)
+        {
+            uint32_t word = (snap->regs[GPFSEL0 + reg] & ~plan->fsel_mask[reg]) |
+                            plan->fsel_bits[reg];
+            uint32_t other = word ^ GPIO_FSEL_LSBS;
+
+            other = (other | other >> 1 | other >> 2) & GPIO_FSEL_LSBS;
+            if (other & gpio_spread3(gpio_chip_field(chip, gpiomask, 10 * reg, 10)))
+                return 1;
+        }
+    }
+
+    if (fsparam != FUNC_UNSET)
+    {
+        for (reg = 0; reg < GPIO_MAX_FSEL_REGS; reg++)
+        {
+            uint32_t lsbs = gpio_spread3(gpio_chip_field(chip, gpiomask, 10 * reg, 10));
+
+            plan->fsel_mask[reg] |= lsbs * 7;
+            plan->fsel_bits[reg] = (plan->fsel_bits[reg] & ~(lsbs * 7)) |
+                                   (lsbs * gpio_fsel_to_hw[fsparam]);
+        }
+    }
+
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+    {
+        uint32_t bits = gpio_chip_field(chip, gpiomask, 32 * bank, 32);
+
+        if (drive != DRIVE_UNSET)
+        {
+            uint32_t high = bits & -(uint32_t)(drive != 0);
+
+            plan->set[bank] = (plan->set[bank] & ~bits) | high;
+            plan->clr[bank] = (plan->clr[bank] & ~bits) | (bits ^ high);
+        }
+        if (pull != PULL_UNSET)
+        {
+            for (p = PULL_NONE; p <= PULL_UP; p++)
+                plan->pull[p][bank] &= ~bits;
+            plan->pull[pull][bank] |= bits;
+        }
+    }
+
+    return 0;
+}
+
+/* Returns 1 without writing anything if drive is set on a non-output */
+int gpio_set_mask(struct gpio_chip *chip, const uint32_t *gpiomask,
+                  int fsparam, int drive, int pull)
+{
+    struct gpio_snapshot snap;
+    struct gpio_plan plan;
+
+    gpio_plan_init(&plan);
+
+    if (drive != DRIVE_UNSET && fsparam == FUNC_UNSET)
+        gpio_snapshot_take(chip, &snap);
+
+    if (gpio_plan_set(chip, &plan, &snap, gpiomask, fsparam, drive, pull))
+        return 1;
+
+    return gpio_plan_commit(chip, &plan);
+}
+
+int gpio_record_diff(const struct gpio_pin_record *want, const struct gpio_pin_record *have)
+{
+    int diff = 0;
+
+    if (want->fsel != have->fsel)
+        diff |= GPIO_DIFF_FSEL;
+    if (want->fsel == FUNC_OP && want->level != have->level)
+        diff |= GPIO_DIFF_LEVEL;
+    if (want->pull != PULL_UNSET && have->pull != PULL_UNSET && want->pull != have->pull)
+        diff |= GPIO_DIFF_PULL;
+    if (want->events != have->events)
+        diff |= GPIO_DIFF_EVENTS;
+
+    return diff;
+}
+
+int gpio_plan_restore(const struct gpio_chip *chip, struct gpio_plan *plan,
+                      const struct gpio_snapshot *snap,
+                      const struct gpio_pin_record *recs, unsigned int count)
+{
+    unsigned int changed = 0;
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+    {
+        const struct gpio_pin_record *want = &recs[i];
+        struct gpio_pin_record have;
+        int diff;
+
+        if (want->gpio >= chip->gpio_count || want->fsel < FUNC_IP || want->fsel > FUNC_A5)
+            continue;
+
+        gpio_snapshot_record(snap, want->gpio, &have);
+        diff = gpio_record_diff(want, &have);
+        if (!diff)
+            continue;
+
+        if (diff & GPIO_DIFF_FSEL)
+            gpio_plan_fsel(plan, want->gpio, want->fsel);
+        if (want->fsel == FUNC_OP && (diff & (GPIO_DIFF_FSEL | GPIO_DIFF_LEVEL)))
+            gpio_plan_level(plan, want->gpio, want->level);
+        if (diff & GPIO_DIFF_PULL)
+            gpio_plan_pull(plan, want->gpio, want->pull);
+        if (diff & GPIO_DIFF_EVENTS)
+            gpio_plan_events(plan, want->gpio, want->events);
+        changed++;
+    }
+
+    return changed;
+}
+
+/*
+  The pull control signal must be set up for, and held after, 150 cycles of
+  GPPUDCLK. Spinning on the monotonic clock for a configurable minimum is
+  far shorter (and more predictable) than a usleep, which is typically
+  rounded up to tens of microseconds by the scheduler.
+*/
+static void gpio_delay_ns(struct gpio_chip *chip, unsigned long ns)
+{
+    uint64_t start = gpio_now_ns();
+    uint64_t now;
+
+    do
+    {
+        now = gpio_now_ns();
+    } while (now - start < ns);
+
+    if (chip->stats)
+    {
+        chip->stats->delays++;
+        chip->stats->delay_ns += now - start;
+    }
+}
+
+/* Clock one pull value into every pin in clkmask, all banks at once */
+static void bcm2835_pud_sequence(struct gpio_chip *chip, int pull, const uint32_t *clkmask)
+{
+    int bank;
+
+    gpio_reg_write(chip, GPPUD, pull);
+    gpio_delay_ns(chip, chip->pud_delay_ns);
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+    {
+        if (clkmask[bank])
+            gpio_reg_write(chip, GPPUDCLK0 + bank, clkmask[bank]);
+    }
+    gpio_delay_ns(chip, chip->pud_delay_ns);
+    gpio_reg_write(chip, GPPUD, 0);
+    for (bank = 0; bank < GPIO_MAX_BANKS; bank++)
+    {
+        if (clkmask[bank])
+            gpio_reg_write(chip, GPPUDCLK0 + bank, 0);
+    }
+}
+
+static void bcm2835_set_pull(struct gpio_chip *chip, unsigned int gpio, int pull)
+{
+    uint32_t clkmask[GPIO_MAX_BANKS] = { 0 };
+
+    clkmask[gpio / 32] = 1 << (gpio % 32);
+    bcm2835_pud_sequence(chip, pull, clkmask);
+}
+
+static int bcm2835_set_pulls(struct gpio_chip *chip, const struct gpio_plan *plan)
+{
+    int pull;
+
+    /* One clocked sequence per requested pull value */
+    for (pull = PULL_NONE; pull <= PULL_UP; pull++)
+    {
+        if (plan->pull[pull][0] | plan->pull[pull][1])
+            bcm2835_pud_sequence(chip, pull, plan->pull[pull]);
+    }
+
+    return 0;
+}
+
+static int bcm2835_next_reg(int reg)
+{
+    if (reg < 0)
+        return 0;
+    else if (reg == GPPUDCLK1)
+        return -1;
+    return reg + 1;
+}
+
+static void bcm2711_set_pull(struct gpio_chip *chip, unsigned int gpio, int pull)
+{
+    const struct gpio_pin_loc *loc = &gpio_pin_locs[gpio];
+
+    gpio_reg_rmw(chip, GPPUPPDN0 + loc->pull_reg, 3u << loc->pull_lsb,
+                 (uint32_t)gpio_pull_to_2711[pull] << loc->pull_lsb);
+}
+
+static int bcm2711_set_pulls(struct gpio_chip *chip, const struct gpio_plan *plan)
+{
+    int pull;
+    int reg;
+
+    for (reg = 0; reg < GPIO_MAX_PULL_REGS; reg++)
+    {
+        uint32_t mask = 0;
+        uint32_t bits = 0;
+
+        for (pull = PULL_NONE; pull <= PULL_UP; pull++)
+        {
+            uint32_t lsbs = gpio_spread2(gpio_chip_field(chip, plan->pull[pull], 16 * reg, 16));
+
+            mask |= lsbs * 3;
+            bits |= lsbs * gpio_pull_to_2711[pull];
+        }
+        if (mask)
+            gpio_reg_rmw(chip, GPPUPPDN0 + reg, mask, bits);
+    }
+
+    return 0;
+}
+
+static int bcm2711_next_reg(int reg)
+{
+    /* Skip over non-GPIO registers */
+    if (reg < 0)
+        return 0;
+    else if (reg == GPPUPPDN3)
+        return -1;
+    else if (reg == GPPUDCLK1)
+        return GPPUPPDN0;
+    return reg + 1;
+}
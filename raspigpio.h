@@ -0,0 +1,449 @@
+/*
+  libraspigpio - direct access to the BCM2835/BCM2711 GPIO registers.
+  Shared by raspi-gpio and any application that would otherwise have to
+  run it to change a pin.
+*/
+
+#ifndef RASPIGPIO_H
+#define RASPIGPIO_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DRIVE_UNSET -1
+#define DRIVE_LOW    0
+#define DRIVE_HIGH   1
+
+#define PULL_UNSET  -1
+#define PULL_NONE    0
+#define PULL_DOWN    1
+#define PULL_UP      2
+
+#define FUNC_UNSET  -1
+#define FUNC_IP      0
+#define FUNC_OP      1
+#define FUNC_ALT(x)  (2 + (x))
+#define FUNC_A0      FUNC_ALT(0)
+#define FUNC_A1      FUNC_ALT(1)
+#define FUNC_A2      FUNC_ALT(2)
+#define FUNC_A3      FUNC_ALT(3)
+#define FUNC_A4      FUNC_ALT(4)
+#define FUNC_A5      FUNC_ALT(5)
+
+/* Event detect enables, one GPxxEN register pair each, in register order */
+#define EVENT_UNSET         -1
+#define EVENT_RISING        (1 << 0)  /* GPREN */
+#define EVENT_FALLING       (1 << 1)  /* GPFEN */
+#define EVENT_HIGH          (1 << 2)  /* GPHEN */
+#define EVENT_LOW           (1 << 3)  /* GPLEN */
+#define EVENT_ASYNC_RISING  (1 << 4)  /* GPAREN */
+#define EVENT_ASYNC_FALLING (1 << 5)  /* GPAFEN */
+#define GPIO_EVENT_TYPES    6
+
+#define GPIO_MAX_BANKS      2  /* GPSET/GPCLR/GPLEV/GPPUDCLK 0-1 */
+#define GPIO_MAX_FSEL_REGS  6  /* GPFSEL0-5 */
+#define GPIO_MAX_PULL_REGS  4  /* GPPUPPDN0-3 */
+#define GPIO_MAX_REGS       64 /* Enough for every register up to GPPUPPDN3 */
+
+/*
+  Pin masks are arrays of words, bit n of word w being GPIO 32*w+n. A
+  chip's masks are GPIO_MAX_BANKS words, one per GPSET/GPCLR/GPLEV bank,
+  but the helpers below take the length so that they work on any set of
+  pins; iteration skips straight from one set bit to the next.
+*/
+#define GPIO_MASK_WORDS(pins) (((pins) + 31) / 32)
+
+static inline int gpio_mask_test(const uint32_t *mask, unsigned int gpio)
+{
+    return (mask[gpio / 32] >> (gpio % 32)) & 1;
+}
+
+static inline void gpio_mask_add(uint32_t *mask, unsigned int gpio)
+{
+    mask[gpio / 32] |= 1u << (gpio % 32);
+}
+
+static inline int gpio_mask_empty(const uint32_t *mask, unsigned int words)
+{
+    uint32_t any = 0;
+    unsigned int w;
+
+    for (w = 0; w < words; w++)
+        any |= mask[w];
+    return !any;
+}
+
+/* The first pin in mask at or after gpio, or -1 if there are none */
+static inline int gpio_mask_next(const uint32_t *mask, unsigned int words, unsigned int gpio)
+{
+    unsigned int w = gpio / 32;
+    uint32_t bits;
+
+    if (w >= words)
+        return -1;
+    bits = mask[w] & (~0u << (gpio % 32));
+    while (!bits)
+    {
+        if (++w >= words)
+            return -1;
+        bits = mask[w];
+    }
+    return w * 32 + __builtin_ctz(bits);
+}
+
+#define gpio_mask_for_each(gpio, mask, words) \
+    for ((gpio) = gpio_mask_next((mask), (words), 0); (gpio) >= 0; \
+         (gpio) = gpio_mask_next((mask), (words), (gpio) + 1))
+
+/* Pins first to first + n - 1 (n up to 32) of mask, as the low bits of a word */
+static inline uint32_t gpio_mask_field(const uint32_t *mask, unsigned int words,
+                                       unsigned int first, unsigned int n)
+{
+    unsigned int w = first / 32, lsb = first % 32;
+    uint64_t bits = 0;
+
+    if (w < words)
+        bits = mask[w];
+    if (lsb + n > 32 && w + 1 < words)
+        bits |= (uint64_t)mask[w + 1] << 32;
+    return (bits >> lsb) & (n < 32 ? (1u << n) - 1 : ~0u);
+}
+
+/* Adds pins from to to (inclusive), a word at a time */
+static inline void gpio_mask_add_range(uint32_t *mask, unsigned int from, unsigned int to)
+{
+    while (from <= to)
+    {
+        unsigned int n = 32 - from % 32;
+        uint32_t bits;
+
+        if (to - from + 1 < n)
+            n = to - from + 1;
+        bits = n < 32 ? ((1u << n) - 1) << (from % 32) : ~0u;
+        mask[from / 32] |= bits;
+        from += n;
+    }
+}
+
+struct gpio_chip;
+
+/*
+  A batched register update. Pins are accumulated into per-register masks
+  so that committing the plan costs one read-modify-write per GPFSEL (and
+  GPPUPPDN) register and one GPSET/GPCLR store per bank, regardless of how
+  many pins are involved.
+*/
+struct gpio_plan
+{
+    uint32_t fsel_mask[GPIO_MAX_FSEL_REGS];
+    uint32_t fsel_bits[GPIO_MAX_FSEL_REGS];
+    uint32_t set[GPIO_MAX_BANKS];
+    uint32_t clr[GPIO_MAX_BANKS];
+    uint32_t pull[3][GPIO_MAX_BANKS];  /* Indexed by PULL_NONE/DOWN/UP */
+    uint32_t event_mask[GPIO_MAX_BANKS];             /* Pins whose enables are replaced */
+    uint32_t event_en[GPIO_EVENT_TYPES][GPIO_MAX_BANKS];
+};
+
+/*
+  A coherent copy of the register window, taken once and then decoded for
+  as many pins as required without further MMIO reads.
+*/
+struct gpio_snapshot
+{
+    struct gpio_chip *chip;
+    uint32_t regs[GPIO_MAX_REGS];  /* Indexed by register number */
+};
+
+/*
+  The decoded state of one pin in a fixed 8-byte layout, for binary output
+  and saved state that can be read back without any parsing.
+*/
+struct gpio_pin_record
+{
+    uint8_t gpio;
+    int8_t fsel;         /* FUNC_* */
+    int8_t level;
+    int8_t pull;         /* PULL_*, or PULL_UNSET where it can't be read back */
+    uint8_t events;      /* EVENT_* detects enabled */
+    uint8_t event;       /* Event latched in GPEDS */
+    uint8_t reserved[2];
+};
+
+/* Fields of a pin record that differ, from gpio_record_diff */
+#define GPIO_DIFF_FSEL   (1 << 0)
+#define GPIO_DIFF_LEVEL  (1 << 1)
+#define GPIO_DIFF_PULL   (1 << 2)
+#define GPIO_DIFF_EVENTS (1 << 3)
+
+/*
+  Opening a chip. name is "bcm2835" or "bcm2711", or NULL to detect the
+  SoC from the device tree. image is a file to map as a register image in
+  place of the hardware, or NULL for /dev/gpiomem (or /dev/mem).
+  Functions returning NULL or non-zero leave the reason in
+  gpio_last_error().
+*/
+struct gpio_chip *gpio_chip_new(const char *name);
+int gpio_chip_map(struct gpio_chip *chip, const char *image);
+struct gpio_chip *gpio_open(const char *name, const char *image);
+void gpio_close(struct gpio_chip *chip);
+const char *gpio_last_error(void);
+
+/*
+  The simulated backend maps image (created if need be) as a register
+  block that behaves like the hardware, optionally with output pin 'from'
+  wired to input pin 'to'. See raspigpio-sim.c.
+*/
+int gpio_chip_map_sim(struct gpio_chip *chip, const char *image);
+int gpio_sim_loop(struct gpio_chip *chip, unsigned int from, unsigned int to);
+
+const char *gpio_chip_name(const struct gpio_chip *chip);
+unsigned int gpio_chip_gpio_count(const struct gpio_chip *chip);
+unsigned int gpio_chip_alt_count(const struct gpio_chip *chip);
+void gpio_chip_set_pud_delay(struct gpio_chip *chip, unsigned long ns);
+
+/* Names */
+const char *gpio_alt_name(const struct gpio_chip *chip, unsigned int gpio, int alt);
+const char *gpio_fsel_to_namestr(const struct gpio_chip *chip, unsigned int gpio, int fsel);
+const char *gpio_pull_name(int pull);
+int gpio_default_pull(const struct gpio_chip *chip, unsigned int gpio);
+
+/* A pin and alt function (0-5, for FUNC_ALT(alt)) that carries a signal */
+struct gpio_alt_ref
+{
+    const char *name;
+    unsigned int gpio;
+    int alt;
+};
+
+/*
+  Looks up alt functions by signal name, ignoring case: those named name,
+  or beginning with it if prefix is non-zero. Stores up to max of them in
+  refs, ordered by name then GPIO, and returns how many there are in all.
+  Lookups are a binary search of an index sorted on the first use.
+*/
+int gpio_find_alt(const struct gpio_chip *chip, const char *name, int prefix,
+                  struct gpio_alt_ref *refs, unsigned int max);
+
+/*
+  Places the signals of a peripheral ("I2C1", "SPI0", "UART0", "PCM"...)
+  on pins, each on the lowest numbered GPIO with it as an alt function.
+  If gpiomask is neither NULL nor empty, the signals go on those pins
+  instead, as many as will fit (including the optional ones: UART flow
+  control, extra SPI chip selects), and every pin must take one. Stores
+  up to max placements in refs, by GPIO, and returns how many there are,
+  or -1 on failure.
+*/
+int gpio_find_group(const struct gpio_chip *chip, const char *name, const uint32_t *gpiomask,
+                    struct gpio_alt_ref *refs, unsigned int max);
+
+/*
+  Adds a comma-separated list of pins and ranges ("4", "18-21", "7,9-11")
+  to gpiomask. A signal name ("SPI0_MOSI") stands for every pin with an
+  alt function of that name. Returns NULL on success, else where parsing
+  stopped.
+*/
+const char *gpio_parse_pins(const struct gpio_chip *chip, const char *list, uint32_t *gpiomask);
+
+/*
+  Safe mode, for when other processes may be changing pins in the same
+  registers. Nothing in the GPIO block makes a read-modify-write atomic,
+  so with lock_file set every update of the chip holds an advisory flock
+  on it, which serialises all the processes using the same file. With
+  retries non-zero each read-modify-write is also read back, and redone
+  up to retries times if another writer (such as a kernel driver, which
+  takes no notice of the lock) changed it in between; an update still
+  lost after that makes the call fail. gpio_lock and gpio_unlock hold the
+  lock (and nest) across several calls, e.g. a check and the update that
+  depends on it. The contention counters show how often either was
+  needed.
+*/
+struct gpio_contention
+{
+    uint64_t lock_waits;   /* Times the lock was held by another process */
+    uint64_t retries;      /* Read-modify-writes redone after a lost update */
+    uint64_t failures;     /* Updates still lost after every retry */
+};
+
+int gpio_chip_set_safe(struct gpio_chip *chip, const char *lock_file, unsigned int retries);
+void gpio_lock(struct gpio_chip *chip);
+void gpio_unlock(struct gpio_chip *chip);
+void gpio_get_contention(const struct gpio_chip *chip, struct gpio_contention *contention);
+
+/*
+  Instrumentation, off until gpio_chip_set_stats turns it on. Every
+  register access the library makes is counted (though not sampling
+  through gpio_level_regs), and each of the calls below is timed on the
+  monotonic clock into a histogram of power-of-two buckets. The time
+  spent in the bcm2835 pull setup/hold delays, and waiting for the safe
+  mode lock, is kept apart from that spent working. gpio_get_stats
+  returns -1 if the chip has no statistics turned on.
+*/
+#define GPIO_STATS_BUCKETS 32   /* Bucket i counts calls of 2^i to 2^(i+1)-1 ns */
+
+enum gpio_op
+{
+    GPIO_OP_GET_FSEL,
+    GPIO_OP_GET_LEVEL,
+    GPIO_OP_GET_PULL,
+    GPIO_OP_SET_FSEL,
+    GPIO_OP_SET_LEVEL,
+    GPIO_OP_SET_PULL,
+    GPIO_OP_READ_LEVELS,
+    GPIO_OP_WRITE_LEVELS,
+    GPIO_OP_READ_EVENTS,
+    GPIO_OP_SNAPSHOT,
+    GPIO_OP_COMMIT,
+    GPIO_OPS
+};
+
+struct gpio_op_stats
+{
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t hist[GPIO_STATS_BUCKETS];
+};
+
+struct gpio_stats
+{
+    uint64_t reads[GPIO_MAX_REGS];     /* Indexed by register number */
+    uint64_t writes[GPIO_MAX_REGS];
+    uint64_t delays;                   /* bcm2835 pull setup/hold delays */
+    uint64_t delay_ns;
+    uint64_t lock_wait_ns;             /* Waiting for the safe mode lock */
+    struct gpio_op_stats ops[GPIO_OPS];
+};
+
+int gpio_chip_set_stats(struct gpio_chip *chip, int enable);
+int gpio_get_stats(const struct gpio_chip *chip, struct gpio_stats *stats);
+void gpio_reset_stats(struct gpio_chip *chip);
+const char *gpio_op_name(int op);
+const char *gpio_reg_name(int reg);
+
+/*
+  Tracing. gpio_chip_set_trace records every register read and write the
+  library makes, as a struct gpio_trace_record, into a ring in the file
+  path, mapped shared so that the records survive the process however it
+  ends. A file already holding a trace of the same chip is appended to,
+  so several runs can share it; otherwise it is made afresh with room for
+  records entries. A NULL path stops tracing. Once count passes capacity
+  the oldest records are overwritten, record n being in slot n % capacity.
+  Times are only comparable within one boot, so a trace from an earlier
+  boot is started afresh rather than appended to.
+*/
+#define GPIO_TRACE_MAGIC   0x43525447   /* "GTRC" */
+#define GPIO_TRACE_VERSION 2
+
+#define GPIO_TRACE_READ    0
+#define GPIO_TRACE_WRITE   1
+
+struct gpio_trace_header
+{
+    uint32_t magic;
+    uint32_t version;
+    char chip[16];               /* gpio_chip_name() */
+    uint64_t capacity;           /* Records the ring holds */
+    uint64_t count;              /* Records written, overwritten ones included */
+    uint64_t start_ns;           /* CLOCK_MONOTONIC when the trace began */
+    uint8_t boot_id[16];         /* The boot start_ns is from, zeros if unknown */
+};
+
+struct gpio_trace_record
+{
+    uint64_t ns;                 /* Since start_ns */
+    uint32_t value;              /* Read or written */
+    uint32_t mask;               /* Bits a write was meant to change; all for a plain write */
+    uint16_t offset;             /* Byte offset of the register */
+    uint8_t op;                  /* GPIO_TRACE_READ or GPIO_TRACE_WRITE */
+    uint8_t reserved[5];
+};
+
+static inline struct gpio_trace_record *gpio_trace_records(struct gpio_trace_header *trace)
+{
+    return (struct gpio_trace_record *)(trace + 1);
+}
+
+int gpio_chip_set_trace(struct gpio_chip *chip, const char *path, unsigned long records);
+
+/*
+  A register by byte offset, for replaying traces; offset must be one
+  listed by gpio_next_reg (times 4).
+*/
+uint32_t gpio_read_reg(struct gpio_chip *chip, unsigned int offset);
+void gpio_write_reg(struct gpio_chip *chip, unsigned int offset, uint32_t value);
+
+/* Single pin access */
+int gpio_get_fsel(struct gpio_chip *chip, unsigned int gpio);
+int gpio_get_level(struct gpio_chip *chip, unsigned int gpio);
+int gpio_get_pull(struct gpio_chip *chip, unsigned int gpio);
+int gpio_set_fsel(struct gpio_chip *chip, unsigned int gpio, int fsel);
+int gpio_set_level(struct gpio_chip *chip, unsigned int gpio, int level);
+int gpio_set_pull(struct gpio_chip *chip, unsigned int gpio, int pull);
+
+/* Whole-bank level access: one GPLEV read, or one GPSET and GPCLR write, per bank */
+void gpio_read_levels(struct gpio_chip *chip, uint32_t *levels);
+void gpio_write_levels(struct gpio_chip *chip, const uint32_t *set, const uint32_t *clr);
+
+/*
+  The mapped GPLEV0/1 registers themselves, for sampling loops that cannot
+  afford a function call per read. Valid until the chip is closed.
+*/
+const volatile uint32_t *gpio_level_regs(struct gpio_chip *chip);
+
+/*
+  Reads the latched event status (GPEDS) of every bank into events, then
+  clears those read that are also in clear (which may be NULL) with one
+  write per bank, so that no event arriving in between is lost.
+*/
+void gpio_read_events(struct gpio_chip *chip, uint32_t *events, const uint32_t *clear);
+
+/* Snapshots */
+void gpio_snapshot_take(struct gpio_chip *chip, struct gpio_snapshot *snap);
+void gpio_snapshot_take_all(struct gpio_chip *chip, struct gpio_snapshot *snap);
+int gpio_snapshot_fsel(const struct gpio_snapshot *snap, unsigned int gpio);
+int gpio_snapshot_level(const struct gpio_snapshot *snap, unsigned int gpio);
+int gpio_snapshot_pull(const struct gpio_snapshot *snap, unsigned int gpio);
+int gpio_snapshot_events(const struct gpio_snapshot *snap, unsigned int gpio);
+int gpio_snapshot_event(const struct gpio_snapshot *snap, unsigned int gpio);
+void gpio_snapshot_record(const struct gpio_snapshot *snap, unsigned int gpio,
+                          struct gpio_pin_record *rec);
+int gpio_next_reg(const struct gpio_chip *chip, int reg);
+
+/* Batched updates */
+void gpio_plan_init(struct gpio_plan *plan);
+void gpio_plan_fsel(struct gpio_plan *plan, unsigned int gpio, int fsel);
+void gpio_plan_level(struct gpio_plan *plan, unsigned int gpio, int level);
+void gpio_plan_pull(struct gpio_plan *plan, unsigned int gpio, int pull);
+void gpio_plan_events(struct gpio_plan *plan, unsigned int gpio, int events);
+int gpio_plan_fsel_after(const struct gpio_plan *plan, const struct gpio_snapshot *snap,
+                         unsigned int gpio);
+int gpio_plan_set(const struct gpio_chip *chip, struct gpio_plan *plan,
+                  const struct gpio_snapshot *snap, const uint32_t *gpiomask,
+                  int fsparam, int drive, int pull);
+void gpio_plan_set_events(const struct gpio_chip *chip, struct gpio_plan *plan,
+                          const uint32_t *gpiomask, int events);
+int gpio_plan_commit(struct gpio_chip *chip, const struct gpio_plan *plan);
+int gpio_set_mask(struct gpio_chip *chip, const uint32_t *gpiomask,
+                  int fsparam, int drive, int pull);
+
+/*
+  Restoring saved state. gpio_record_diff compares the state wanted with
+  the state a pin has; levels only count on outputs, and pulls only where
+  both are known. gpio_plan_restore adds to plan just the fields of the
+  pins that differ from snap, so that committing it touches only the
+  registers holding those pins, and returns the number of pins that did.
+*/
+int gpio_record_diff(const struct gpio_pin_record *want, const struct gpio_pin_record *have);
+int gpio_plan_restore(const struct gpio_chip *chip, struct gpio_plan *plan,
+                      const struct gpio_snapshot *snap,
+                      const struct gpio_pin_record *recs, unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif